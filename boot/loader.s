@@ -150,9 +150,22 @@ p_mode_start:
     ; 加载 kernel
     mov eax, KERNEL_START_SECTOR ; kernel.bin 所在的扇区号
     mov ebx, KERNEL_BIN_BASE_ADDR ; 从磁盘读出后，写入到 ebx 指定的地址
-    mov ecx, 200 ; 读入的扇区数
-
-    call rd_disk_m_32
+    mov ecx, KERNEL_BIN_SECTORS ; 读入的扇区数
+
+    call rd_disk_secs_32
+
+    ; 加载可选的内存盘映像, 没有映像时也要清掉魔数, 以免内核把残留的数据当成映像
+    mov dword [RAMDISK_INFO_ADDR], 0
+    mov ecx, RAMDISK_SECTORS
+    cmp ecx, 0
+    je .no_ramdisk
+    mov eax, RAMDISK_START_SECTOR
+    mov ebx, RAMDISK_LOAD_ADDR
+    call rd_disk_secs_32
+    mov dword [RAMDISK_INFO_ADDR], RAMDISK_MAGIC
+    mov dword [RAMDISK_INFO_ADDR + 4], RAMDISK_LOAD_ADDR
+    mov dword [RAMDISK_INFO_ADDR + 8], RAMDISK_SECTORS * 512
+.no_ramdisk:
 
     ; 创建页目录及页表并初始化页内存位图
     call setup_page
@@ -237,6 +250,29 @@ setup_page:
     loop .create_kernel_pde
     ret
 
+; 读入 ecx 个扇区, 扇区数寄存器只有 8 位, 所以每次最多读 RD_DISK_MAX_SECS 个
+; 输入: eax = 起始扇区号, ebx = 写入的地址, ecx = 扇区数
+; 输出: ebx 指向读入数据之后
+rd_disk_secs_32:
+    cmp ecx, 0
+    je .done
+    push ecx ; 剩余的扇区数
+    push eax ; 本次的起始扇区号
+    cmp ecx, RD_DISK_MAX_SECS
+    jbe .read
+    mov ecx, RD_DISK_MAX_SECS
+.read:
+    push ecx ; 本次读入的扇区数
+    call rd_disk_m_32
+    pop edx
+    pop eax
+    pop ecx
+    add eax, edx
+    sub ecx, edx
+    jmp rd_disk_secs_32
+.done:
+    ret
+
 ; 保护模式的硬盘读取函数
 rd_disk_m_32:
     mov esi, eax
@@ -16,7 +16,7 @@ LIBS="-I ../lib/ -I ../lib/kernel/ -I ../lib/user/ -I \
     ../kernel/ -I ../device/ -I ../thread/ -I \
     ../userprog/ -I ../fs/ -I ../shell/"
 OBJS="../build/string.o ../build/syscall.o \
-    ../build/stdio.o ../build/assert.o start.o"
+    ../build/stdio.o ../build/assert.o ../build/usync.o ../build/uthread.o start.o"
 DD_IN=$BIN
 DD_OUT="../hd60M.img"
 
@@ -14,7 +14,7 @@ CFLAGS="-Wall -m32 -c -fno-builtin -W -Wstrict-prototypes
     -Wmissing-prototypes -Wsystem-headers"
 LIB="-I ../lib -I ../lib/user -I ../fs"
 OBJS="../build/string.o ../build/syscall.o \
-    ../build/stdio.o ../build/assert.o start.o"
+    ../build/stdio.o ../build/assert.o ../build/usync.o ../build/uthread.o start.o"
 DD_IN=$BIN
 DD_OUT="../hd60M.img"
 
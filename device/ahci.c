@@ -0,0 +1,513 @@
+#include "ahci.h"
+#include "ide.h"
+#include "blk.h"
+#include "pci.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "string.h"
+#include "stdio.h"
+#include "stdio-kernel.h"
+#include "debug.h"
+#include "atomic.h"
+
+// HBA 全局寄存器的偏移
+#define HBA_CAP		 0x00	// 能力, 第 8~12 位为命令槽数减 1, 第 30 位表示支持 NCQ
+#define HBA_GHC		 0x04	// 全局控制
+#define HBA_IS		 0x08	// 各端口的中断汇总, 写 1 清除
+#define HBA_PI		 0x0c	// 实现了哪些端口
+#define HBA_PORT_BASE	 0x100	// 第 n 个端口的寄存器从 0x100 + n * 0x80 开始
+#define HBA_PORT_SIZE	 0x80
+#define HBA_MAX_PORTS	 32
+
+#define CAP_SNCQ	 0x40000000
+#define GHC_IE		 0x2		// 允许 HBA 发中断
+#define GHC_AE		 0x80000000	// 以 ahci 模式工作
+
+// 端口寄存器的偏移
+#define PORT_CLB	 0x00	// 命令列表的物理地址, 1KB 对齐
+#define PORT_CLBU	 0x04
+#define PORT_FB		 0x08	// 接收 FIS 区的物理地址, 256 字节对齐
+#define PORT_FBU	 0x0c
+#define PORT_IS		 0x10	// 中断状态, 写 1 清除
+#define PORT_IE		 0x14	// 中断允许
+#define PORT_CMD	 0x18
+#define PORT_TFD	 0x20	// 低 8 位是设备的 ata 状态寄存器
+#define PORT_SIG	 0x24	// 设备签名
+#define PORT_SSTS	 0x28	// sata 链路状态
+#define PORT_SCTL	 0x2c	// sata 链路控制
+#define PORT_SERR	 0x30	// sata 错误, 写 1 清除
+#define PORT_SACT	 0x34	// 在途的 NCQ 命令, 设备完成时用 Set Device Bits FIS 清除对应位
+#define PORT_CI		 0x38	// 发出命令的槽位, 非 NCQ 命令完成时由 HBA 清除
+
+#define PORT_CMD_ST	 0x1	// 开始处理命令列表
+#define PORT_CMD_FRE	 0x10	// 允许接收 FIS
+#define PORT_CMD_FR	 0x4000	// FIS 接收正在运行
+#define PORT_CMD_CR	 0x8000	// 命令列表正在处理
+
+#define PORT_IS_DHRS	 0x1		// 收到 D2H 寄存器 FIS, 非 NCQ 命令完成
+#define PORT_IS_SDBS	 0x8		// 收到 Set Device Bits FIS, NCQ 命令完成
+#define PORT_IS_ERR	 0x78000000	// 任务文件错误及各种总线错误
+
+#define SSTS_DET	 0xf	// 链路检测状态, 3 表示有设备且已建立通信
+#define SSTS_DET_OK	 0x3
+#define SCTL_DET_INIT	 0x1	// 发出 COMRESET
+#define SIG_ATA		 0x00000101
+
+// PORT_TFD 中 ata 状态的位
+#define ATA_STAT_BSY	 0x80
+#define ATA_STAT_DRQ	 0x08
+#define ATA_STAT_ERR	 0x01
+
+#define FIS_TYPE_H2D	 0x27	// 主机发给设备的寄存器 FIS
+#define FIS_H2D_CMD	 0x80	// 寄存器 FIS 中表示这是一条命令
+#define FIS_DEV_LBA	 0x40
+
+// 用到的 ata 命令
+#define CMD_IDENTIFY	   0xec
+#define CMD_READ_DMA_EXT   0x25
+#define CMD_WRITE_DMA_EXT  0x35
+#define CMD_READ_FPDMA	   0x60	    // NCQ 读, 扇区数放在 feature 中, count 的第 3~7 位是标签
+#define CMD_WRITE_FPDMA	   0x61	    // NCQ 写
+
+#define CMD_HDR_WRITE	 0x40	// 命令头中表示数据从内存写到设备
+#define PRD_MAX_BYTES	 0x400000	// 一个 PRD 最多描述 4MB
+#define AHCI_PRDT_CNT	 248	// 命令表占一页, 除去开头 128 字节后可放的 PRD 数
+#define AHCI_MAX_SECS	 2048	// 合并后一次传输的上限, 1MB
+
+// 命令列表中的命令头, 每个槽位一项
+struct ahci_cmd_header {
+    uint16_t flags;          // 第 0~4 位为命令 FIS 的双字数, 第 6 位表示写
+    uint16_t prdtl;          // PRD 表的项数
+    volatile uint32_t prdbc; // 已传输的字节数, 由 HBA 填写
+    uint32_t ctba;           // 命令表的物理地址, 128 字节对齐
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__ ((packed));
+
+// 命令表中的物理区域描述符
+struct ahci_prd {
+    uint32_t dba;            // 内存区域的物理地址, 须 2 字节对齐
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;            // 第 0~21 位为字节数减 1
+} __attribute__ ((packed));
+
+// 主机发给设备的寄存器 FIS, 即 ata 的任务文件寄存器
+struct fis_h2d {
+    uint8_t type;
+    uint8_t flags;           // 最高位为 1 表示命令
+    uint8_t command;
+    uint8_t feature_l;
+    uint8_t lba0, lba1, lba2;
+    uint8_t device;
+    uint8_t lba3, lba4, lba5;
+    uint8_t feature_h;
+    uint8_t count_l, count_h;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} __attribute__ ((packed));
+
+// 命令表, 开头是命令 FIS, 0x80 处开始是 PRD 表
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDT_CNT];
+} __attribute__ ((packed));
+
+static volatile uint32_t* hba;				// HBA 寄存器的虚拟地址
+static struct ahci_port ports[AHCI_MAX_DISKS];
+static uint32_t port_cnt;
+static struct ahci_port* port_map[HBA_MAX_PORTS];	// 按端口号找到连着硬盘的端口
+
+static uint32_t hba_read(uint32_t reg) {
+    return hba[reg / 4];
+}
+
+static void hba_write(uint32_t reg, uint32_t value) {
+    hba[reg / 4] = value;
+}
+
+static uint32_t port_read(struct ahci_port* port, uint32_t reg) {
+    return port->regs[reg / 4];
+}
+
+static void port_write(struct ahci_port* port, uint32_t reg, uint32_t value) {
+    port->regs[reg / 4] = value;
+}
+
+// 等待端口寄存器 reg 中 mask 所选的位变为 value, 最多等 ms 毫秒, 超时返回 false
+static bool port_wait(struct ahci_port* port, uint32_t reg, uint32_t mask, uint32_t value, uint32_t ms) {
+    uint32_t us = ms * 1000;
+    while ((port_read(port, reg) & mask) != value) {
+        if (us < 10) {
+            return false;
+        }
+        udelay(10);
+        us -= 10;
+    }
+    return true;
+}
+
+// 停止端口处理命令和接收 FIS, 改动命令列表和接收区的地址之前必须先停止
+static bool port_stop(struct ahci_port* port) {
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_ST);
+    if (!port_wait(port, PORT_CMD, PORT_CMD_CR, 0, 500)) {
+        return false;
+    }
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_FRE);
+    return port_wait(port, PORT_CMD, PORT_CMD_FR, 0, 500);
+}
+
+// 等设备不忙后开始接收 FIS 和处理命令列表
+static bool port_start(struct ahci_port* port) {
+    if (!port_wait(port, PORT_TFD, ATA_STAT_BSY | ATA_STAT_DRQ, 0, 1000)) {
+        return false;
+    }
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_FRE);
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_ST);
+    return true;
+}
+
+// 命令出错后端口停止处理命令列表, 停止再重启端口以清除出错状态
+// 设备仍然忙时发 COMRESET 复位链路, NCQ 出错时设备会丢弃所有在途命令, 所以一律按失败处理
+// 要等待寄存器变化最多上秒, 只在派发线程中调用, 中断处理程序只记下 need_recover
+static void port_recover(struct ahci_port* port) {
+    port_stop(port);
+    port_write(port, PORT_SERR, 0xffffffff);
+    port_write(port, PORT_IS, 0xffffffff);
+    if (port_read(port, PORT_TFD) & (ATA_STAT_BSY | ATA_STAT_DRQ)) {
+        port_write(port, PORT_SCTL, (port_read(port, PORT_SCTL) & ~SSTS_DET) | SCTL_DET_INIT);
+        udelay(1000);
+        port_write(port, PORT_SCTL, port_read(port, PORT_SCTL) & ~SSTS_DET);
+        port_wait(port, PORT_SSTS, SSTS_DET, SSTS_DET_OK, 100);
+        port_write(port, PORT_SERR, 0xffffffff);
+    }
+    port_start(port);
+}
+
+// 填写槽位 slot 的命令头和命令表, batch 为 NULL 时用 buf_paddr 处的 buf_len 字节作唯一的 PRD
+static void cmd_build(struct ahci_port* port, uint32_t slot, struct fis_h2d* fis, bool write, \
+                      struct list* batch, uint32_t buf_paddr, uint32_t buf_len) {
+    struct ahci_cmd_table* table = port->tables[slot];
+    struct ahci_prd* prd = table->prdt;
+    if (batch == NULL) {
+        prd->dba = buf_paddr;
+        prd->dbau = 0;
+        prd->dbc = buf_len - 1;
+        prd++;
+    } else {
+        struct list_elem* elem = batch->head.next;
+        while (elem != &batch->tail) {
+            struct blk_request* req = elem2entry(struct blk_request, tag, elem);
+            uint32_t seg_idx;
+            for (seg_idx = 0; seg_idx < req->seg_cnt; seg_idx++) {
+                ASSERT(prd < table->prdt + AHCI_PRDT_CNT && req->segs[seg_idx].len <= PRD_MAX_BYTES);
+                prd->dba = req->segs[seg_idx].paddr;
+                prd->dbau = 0;
+                prd->dbc = req->segs[seg_idx].len - 1;
+                prd++;
+            }
+            elem = elem->next;
+        }
+    }
+    memcpy(table->cfis, fis, sizeof(struct fis_h2d));
+
+    struct ahci_cmd_header* header = &port->cmd_list[slot];
+    header->flags = sizeof(struct fis_h2d) / 4 | (write ? CMD_HDR_WRITE : 0);
+    header->prdtl = prd - table->prdt;
+    header->prdbc = 0;
+    header->ctba = port->table_paddr[slot];
+    header->ctbau = 0;
+}
+
+// 填写读写命令的 FIS, NCQ 命令的扇区数放在 feature 中, 标签即槽位号
+static void fis_rw_build(struct fis_h2d* fis, bool ncq, uint32_t slot, uint32_t lba, uint32_t sec_cnt, bool write) {
+    memset(fis, 0, sizeof(struct fis_h2d));
+    fis->type = FIS_TYPE_H2D;
+    fis->flags = FIS_H2D_CMD;
+    fis->device = FIS_DEV_LBA;
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    if (ncq) {
+        fis->command = write ? CMD_WRITE_FPDMA : CMD_READ_FPDMA;
+        fis->feature_l = sec_cnt;
+        fis->feature_h = sec_cnt >> 8;
+        fis->count_l = slot << 3;
+    } else {
+        fis->command = write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT;
+        fis->count_l = sec_cnt;
+        fis->count_h = sec_cnt >> 8;
+    }
+}
+
+// 块设备队列的传输回调, 由硬盘的派发线程调用, 一批请求对应一条命令
+// 每个派发线程占用一个槽位, 支持 NCQ 时多条命令同时交给设备, 由设备自行安排顺序, 完成的先后也不定
+static bool ahci_transfer(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write) {
+    ASSERT(sec_cnt > 0 && sec_cnt <= hd->queue.max_secs && lba + sec_cnt <= hd->sectors);
+    struct ahci_port* port = hd->priv;
+
+    // 1. 取一个空闲槽位, 派发线程数等于槽位数, 所以总能取到
+    enum intr_status old_status = spin_lock_irqsave(&port->lock);
+    ASSERT(port->free_slots != 0);
+    uint32_t slot = 0;
+    while (!(port->free_slots & (1 << slot))) {
+        slot++;
+    }
+    port->free_slots &= ~(1 << slot);
+    spin_unlock_irqrestore(&port->lock, old_status);
+
+    // 2. 槽位归本线程所有, 填写命令时不必持锁
+    struct fis_h2d fis;
+    fis_rw_build(&fis, port->ncq, slot, lba, sec_cnt, write);
+    cmd_build(port, slot, &fis, write, batch, 0, 0);
+    barrier();
+
+    // 3. 发出命令, NCQ 命令要先在 SACT 中置位, 然后阻塞到中断处理程序发现它完成
+    // 端口因出错停下时先恢复, 此时出错前在途的命令都已按失败完成
+    old_status = spin_lock_irqsave(&port->lock);
+    while (port->need_recover) {
+        spin_unlock_irqrestore(&port->lock, old_status);
+        lock_acquire(&port->recover_lock);
+        if (port->need_recover) {
+            port_recover(port);
+            old_status = spin_lock_irqsave(&port->lock);
+            port->need_recover = false;
+            spin_unlock_irqrestore(&port->lock, old_status);
+        }
+        lock_release(&port->recover_lock);
+        old_status = spin_lock_irqsave(&port->lock);
+    }
+    port->issued |= 1 << slot;
+    if (port->ncq) {
+        port_write(port, PORT_SACT, 1 << slot);
+    }
+    port_write(port, PORT_CI, 1 << slot);
+    spin_unlock_irqrestore(&port->lock, old_status);
+    sema_down(&port->slot_done[slot]);
+
+    // 4. 取走结果, 归还槽位
+    old_status = spin_lock_irqsave(&port->lock);
+    bool ok = !(port->failed & (1 << slot));
+    port->failed &= ~(1 << slot);
+    port->free_slots |= 1 << slot;
+    spin_unlock_irqrestore(&port->lock, old_status);
+    if (!ok) {
+        printk("%s %s sector %d failed\n", hd->name, write ? "write" : "read", lba);
+    }
+    return ok;
+}
+
+// 处理一个端口的中断: 在途命令中 SACT 和 CI 都已清除的就是完成了的, 完成顺序与发出顺序无关
+static void port_intr(struct ahci_port* port) {
+    uint32_t status = port_read(port, PORT_IS);
+    port_write(port, PORT_IS, status);
+
+    spin_lock(&port->lock);
+    uint32_t busy = port_read(port, PORT_CI);
+    if (port->ncq) {
+        busy |= port_read(port, PORT_SACT);
+    }
+    // 出错时端口已停止处理命令, 在途的命令全部按失败完成, 恢复留给下一个发命令的派发线程
+    if (status & PORT_IS_ERR) {
+        port->failed |= port->issued;
+        port->need_recover = true;
+        busy = 0;
+    }
+    uint32_t done = port->issued & ~busy;
+    port->issued &= ~done;
+    spin_unlock(&port->lock);
+
+    uint32_t slot;
+    for (slot = 0; slot < port->depth; slot++) {
+        if (done & (1 << slot)) {
+            sema_up(&port->slot_done[slot]);
+        }
+    }
+}
+
+// ahci 中断处理程序, 所有端口共用 HBA 的一条中断线
+static void intr_ahci_handler(uint8_t vec_nr UNUSED) {
+    uint32_t pending = hba_read(HBA_IS);
+    uint32_t port_no;
+    for (port_no = 0; port_no < HBA_MAX_PORTS; port_no++) {
+        if (!(pending & (1 << port_no))) {
+            continue;
+        }
+        if (port_map[port_no] != NULL) {
+            port_intr(port_map[port_no]);
+        } else {
+            volatile uint32_t* regs = hba + (HBA_PORT_BASE + port_no * HBA_PORT_SIZE) / 4;
+            regs[PORT_IS / 4] = regs[PORT_IS / 4];
+        }
+    }
+    // 端口的中断状态清除后才能清除汇总位
+    hba_write(HBA_IS, pending);
+}
+
+// 在槽位 0 上发出 IDENTIFY 命令并轮询等待结果, 只在初始化端口、还没打开中断时使用
+static bool port_identify(struct ahci_port* port, void* buf) {
+    struct fis_h2d fis;
+    memset(&fis, 0, sizeof(struct fis_h2d));
+    fis.type = FIS_TYPE_H2D;
+    fis.flags = FIS_H2D_CMD;
+    fis.command = CMD_IDENTIFY;
+    cmd_build(port, 0, &fis, false, NULL, addr_v2p((uint32_t)buf), SECTOR_SIZE);
+    barrier();
+    port_write(port, PORT_CI, 1);
+    uint32_t ms = 1000;
+    while (port_read(port, PORT_CI) & 1) {
+        if ((port_read(port, PORT_IS) & PORT_IS_ERR) || ms-- == 0) {
+            return false;
+        }
+        udelay(1000);
+    }
+    port_write(port, PORT_IS, port_read(port, PORT_IS));
+    return !(port_read(port, PORT_TFD) & ATA_STAT_ERR);
+}
+
+// 为 port_no 号端口上的硬盘分配命令列表、接收区和命令表, 启动端口并获取硬盘参数
+// hba_slots 为 HBA 支持的槽位数, ncq_cap 表示 HBA 支持 NCQ
+static bool port_init(struct ahci_port* port, uint32_t port_no, uint32_t hba_slots, bool ncq_cap) {
+    port->port_no = port_no;
+    port->regs = hba + (HBA_PORT_BASE + port_no * HBA_PORT_SIZE) / 4;
+    if (!port_stop(port)) {
+        return false;
+    }
+
+    // 命令列表 32 项共 1KB, 接收 FIS 区 256 字节, 同放在一页中
+    uint8_t* page = get_kernel_pages(1);
+    uint32_t depth = hba_slots < AHCI_QUEUE_DEPTH ? hba_slots : AHCI_QUEUE_DEPTH;
+    uint32_t slot;
+    for (slot = 0; slot < depth; slot++) {
+        port->tables[slot] = get_kernel_pages(1);
+        if (port->tables[slot] == NULL) {
+            break;
+        }
+        port->table_paddr[slot] = addr_v2p((uint32_t)port->tables[slot]);
+    }
+    if (page == NULL || slot < depth) {
+        PANIC("ahci: alloc memory failed!");
+    }
+    port->cmd_list = (struct ahci_cmd_header*)page;
+    port->rx_fis = page + 1024;
+    uint32_t page_paddr = addr_v2p((uint32_t)page);
+    port_write(port, PORT_CLB, page_paddr);
+    port_write(port, PORT_CLBU, 0);
+    port_write(port, PORT_FB, page_paddr + 1024);
+    port_write(port, PORT_FBU, 0);
+    port_write(port, PORT_SERR, 0xffffffff);
+    port_write(port, PORT_IS, 0xffffffff);
+    port_write(port, PORT_IE, 0);
+    if (!port_start(port)) {
+        return false;
+    }
+
+    struct disk* hd = &port->disk;
+    uint16_t* id_info = kmalloc(SECTOR_SIZE);   // 小块内存不会跨页, 物理上连续
+    if (id_info == NULL) {
+        PANIC("ahci: alloc memory failed!");
+    }
+    if (!port_identify(port, id_info)) {
+        kfree(id_info);
+        printk("  ahci port %d identify failed\n", port_no);
+        return false;
+    }
+    // sata 硬盘都支持 LBA48, 第 100~103 字是 48 位的扇区总数, 超过 2TB 的部分用不到
+    hd->lba48 = true;
+    hd->sectors = *(uint32_t*)&id_info[102] != 0 ? 0xffffffff : *(uint32_t*)&id_info[100];
+    hd->dma = true;
+    hd->multi_secs = 1;
+    // 第 76 字的第 8 位表示支持 NCQ, 第 75 字的低 5 位是设备的队列深度减 1
+    port->ncq = ncq_cap && (id_info[76] & 0x100);
+    port->depth = 1;
+    if (port->ncq) {
+        uint32_t dev_depth = (id_info[75] & 0x1f) + 1;
+        port->depth = depth < dev_depth ? depth : dev_depth;
+    }
+    kfree(id_info);
+
+    spin_init(&port->lock);
+    port->free_slots = (1 << port->depth) - 1;
+    port->issued = 0;
+    port->failed = 0;
+    port->need_recover = false;
+    lock_init(&port->recover_lock, "ahci_recover");
+    for (slot = 0; slot < port->depth; slot++) {
+        sema_init(&port->slot_done[slot], 0);
+    }
+    hd->priv = port;
+    hd->my_channel = NULL;
+    hd->dev_no = port_no;
+    return true;
+}
+
+// 找 pci 上的 ahci 控制器, 初始化连着 sata 硬盘的端口并扫描其分区
+// 在 ide_init 之后调用, 硬盘紧接着 ide 硬盘命名
+void ahci_init(void) {
+    // 大容量存储控制器中的 sata 控制器, 编程接口 1 表示 ahci
+    struct pci_dev* pdev = pci_find_class(0x01, 0x06);
+    if (pdev == NULL || pdev->prog_if != 0x01) {
+        return;
+    }
+    printk("ahci_init start\n");
+    // 读写都靠中断得知完成, 没有可用的中断线就不启用控制器
+    if (pdev->irq_line >= PCI_IRQ_LINES) {
+        printk("    ahci controller has no usable irq line (%d), skipped\n", pdev->irq_line);
+        return;
+    }
+    pci_enable_bus_master(pdev);
+    // BAR5 是 HBA 寄存器所在的内存地址, 32 个端口的寄存器共占两页
+    hba = mmio_map(pci_bar(pdev, 5) & 0xfffff000, 2);
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_AE);
+    uint32_t cap = hba_read(HBA_CAP);
+    uint32_t hba_slots = ((cap >> 8) & 0x1f) + 1;
+    uint32_t implemented = hba_read(HBA_PI);
+
+    uint32_t port_no;
+    char letter = 'a' + channel_cnt * 2;
+    for (port_no = 0; port_no < HBA_MAX_PORTS && port_cnt < AHCI_MAX_DISKS; port_no++) {
+        if (!(implemented & (1 << port_no))) {
+            continue;
+        }
+        // 只处理已建立链路的 ata 硬盘, 光驱等 atapi 设备的签名不同
+        volatile uint32_t* regs = hba + (HBA_PORT_BASE + port_no * HBA_PORT_SIZE) / 4;
+        if ((regs[PORT_SSTS / 4] & SSTS_DET) != SSTS_DET_OK || regs[PORT_SIG / 4] != SIG_ATA) {
+            continue;
+        }
+        struct ahci_port* port = &ports[port_cnt];
+        sprintf(port->disk.name, "sd%c", letter);
+        if (!port_init(port, port_no, hba_slots, (cap & CAP_SNCQ) != 0)) {
+            continue;
+        }
+        port_map[port_no] = port;
+        port_cnt++;
+        letter++;
+        printk("    disk %s on ahci port %d\n", port->disk.name, port_no);
+        printk("    SECTORS: %d\n", port->disk.sectors);
+        printk("    CAPACITY: %dMB\n", port->disk.sectors / 2048);
+        printk("    NCQ: %s, depth %d\n", port->ncq ? "yes" : "no", port->depth);
+    }
+
+    // 打开各端口和 HBA 的中断, 此后的读写都靠中断得知完成
+    uint32_t idx;
+    for (idx = 0; idx < port_cnt; idx++) {
+        port_write(&ports[idx], PORT_IS, 0xffffffff);
+        port_write(&ports[idx], PORT_IE, PORT_IS_DHRS | PORT_IS_SDBS | PORT_IS_ERR);
+    }
+    hba_write(HBA_IS, 0xffffffff);
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_IE);
+    pci_irq_register(pdev->irq_line, intr_ahci_handler);
+
+    // 每个槽位一个派发线程, 一批的段数不能超过命令表中的 PRD 数
+    for (idx = 0; idx < port_cnt; idx++) {
+        struct disk* hd = &ports[idx].disk;
+        blk_queue_init(hd, ahci_transfer, AHCI_MAX_SECS, AHCI_PRDT_CNT, ports[idx].depth);
+        disk_partition_scan(hd);
+    }
+    printk("ahci_init done\n");
+}
@@ -0,0 +1,35 @@
+#ifndef __DEVICE_AHCI_H
+#define __DEVICE_AHCI_H
+#include "stdint.h"
+#include "global.h"
+#include "sync.h"
+#include "ide.h"
+
+#define AHCI_MAX_DISKS   4     // 支持的 sata 硬盘数
+#define AHCI_QUEUE_DEPTH 8     // 每块盘同时在途的命令数上限, 即所用的命令槽数和派发线程数
+
+struct ahci_cmd_header;
+struct ahci_cmd_table;
+
+// 一个连接了 sata 硬盘的 ahci 端口
+struct ahci_port {
+    uint8_t port_no;                            // 在 HBA 上的端口号
+    volatile uint32_t* regs;                    // 本端口寄存器的虚拟地址
+    struct ahci_cmd_header* cmd_list;           // 命令列表, 每个槽位一个命令头
+    uint8_t* rx_fis;                            // 接收 FIS 区
+    struct ahci_cmd_table* tables[AHCI_QUEUE_DEPTH]; // 各槽位的命令表, 各占一页
+    uint32_t table_paddr[AHCI_QUEUE_DEPTH];
+    bool ncq;                                   // 是否用 NCQ 命令, 否则一次只发一条 DMA 命令
+    uint32_t depth;                             // 实际使用的槽位数
+    struct spinlock lock;                       // 保护下面四项及对 SACT、CI 的写入, 中断处理程序也会获取
+    uint32_t free_slots;                        // 空闲槽位的位图
+    uint32_t issued;                            // 已发出、尚未完成的槽位
+    uint32_t failed;                            // 出错的槽位, 完成时由等待者取走
+    bool need_recover;                          // 出错后端口已停止处理命令, 发下一条命令前要先恢复
+    struct lock recover_lock;                   // 使同一时刻只有一个派发线程执行恢复
+    struct semaphore slot_done[AHCI_QUEUE_DEPTH]; // 槽位上的命令完成时 up
+    struct disk disk;
+};
+
+void ahci_init(void);
+#endif
@@ -0,0 +1,228 @@
+#include "aio.h"
+#include "blk.h"
+#include "ide.h"
+#include "memory.h"
+#include "sync.h"
+#include "list.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "atomic.h"
+#include "process.h"
+
+// 进程的异步 io 上下文, 挂在主线程上, 首次提交时创建
+struct aio_ctx {
+    struct spinlock lock;   // 保护以下各项, 派发线程完成请求时也要获取
+    struct list done;       // 已完成、待 aio_reap 取回的请求
+    uint32_t done_cnt;
+    uint32_t inflight;      // 已提交、尚未完成的请求数
+    struct wait_queue wq;   // aio_reap 和 aio_exit 在这里等待完成
+};
+
+// 一个 aiocb 在内核中的表示, 按 BLK_REQ_MAX_SECS 拆成若干块设备请求
+struct aio_req {
+    struct aio_ctx* ctx;
+    struct aiocb* cb;           // 用户空间中的 aiocb, 原样放进完成事件
+    uint32_t sec_cnt;
+    volatile uint32_t remaining; // 尚未完成的块设备请求数
+    bool ok;
+    struct list_elem tag;       // 在 ctx->done 中的标记
+    uint32_t req_cnt;
+    struct blk_request reqs[0];
+};
+
+// [vaddr, vaddr+size) 是否全部是已映射的用户页
+static bool user_range_ok(uint32_t vaddr, uint32_t size) {
+    if (size == 0 || vaddr < USER_VADDR_START || vaddr >= 0xc0000000 || size > 0xc0000000 - vaddr) {
+        return false;
+    }
+    uint32_t page = vaddr & 0xfffff000;
+    while (page < vaddr + size) {
+        if (!(*pde_ptr(page) & PG_P_1)) {
+            return false;
+        }
+        uint32_t* pte = pte_ptr(page);
+        if (!(*pte & PG_P_1) || !(*pte & PG_US_U)) {
+            return false;
+        }
+        page += PG_SIZE;
+    }
+    return true;
+}
+
+// 块设备请求的完成回调, 在派发线程中执行, 直接完成的设备上在提交时执行
+// 一个 aiocb 的最后一个块设备请求完成时把它移入 done 队列并唤醒等待者
+static void aio_end_io(struct blk_request* req) {
+    struct aio_req* areq = req->private;
+    if (!req->ok) {
+        areq->ok = false;
+    }
+    if (atomic_add_return(&areq->remaining, -1) != 0) {
+        return;
+    }
+    struct aio_ctx* ctx = areq->ctx;
+    enum intr_status old_status = spin_lock_irqsave(&ctx->lock);
+    list_append(&ctx->done, &areq->tag);
+    ctx->done_cnt++;
+    ctx->inflight--;
+    spin_unlock_irqrestore(&ctx->lock, old_status);
+    wait_queue_wake_all(&ctx->wq);
+}
+
+// 取当前进程的异步 io 上下文, 没有则创建, 由大内核锁保证只创建一次
+static struct aio_ctx* aio_ctx_get(void) {
+    struct task_struct* leader = running_thread()->group_leader;
+    if (leader->aio == NULL) {
+        struct aio_ctx* ctx = kmalloc(sizeof(struct aio_ctx));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        spin_init(&ctx->lock);
+        list_init(&ctx->done);
+        ctx->done_cnt = 0;
+        ctx->inflight = 0;
+        wait_queue_init(&ctx->wq);
+        leader->aio = ctx;
+    }
+    return leader->aio;
+}
+
+// 检查并准备一个 aiocb, 失败返回 NULL
+static struct aio_req* aio_prepare(struct aio_ctx* ctx, struct aiocb* cb) {
+    if (!user_range_ok((uint32_t)cb, sizeof(struct aiocb))) {
+        return NULL;
+    }
+    struct aiocb kcb = *cb;
+    struct disk* hd = blk_disk(kcb.disk);
+    if (hd == NULL || kcb.opcode > AIO_WRITE || kcb.sec_cnt == 0 || kcb.sec_cnt > AIO_MAX_SECS || \
+        kcb.lba >= hd->sectors || kcb.sec_cnt > hd->sectors - kcb.lba || ((uint32_t)kcb.buf & 1) || \
+        !user_range_ok((uint32_t)kcb.buf, kcb.sec_cnt * SECTOR_SIZE)) {
+        return NULL;
+    }
+    uint32_t req_cnt = DIV_ROUND_UP(kcb.sec_cnt, BLK_REQ_MAX_SECS);
+    struct aio_req* areq = kmalloc(sizeof(struct aio_req) + req_cnt * sizeof(struct blk_request));
+    if (areq == NULL) {
+        return NULL;
+    }
+    areq->ctx = ctx;
+    areq->cb = cb;
+    areq->sec_cnt = kcb.sec_cnt;
+    areq->remaining = req_cnt;
+    areq->ok = true;
+    areq->req_cnt = req_cnt;
+    // 缓冲区在当前进程的地址空间中, 须在这里就换算成物理地址
+    uint32_t idx, secs_done = 0;
+    for (idx = 0; idx < req_cnt; idx++) {
+        uint32_t secs_op = kcb.sec_cnt - secs_done < BLK_REQ_MAX_SECS ? kcb.sec_cnt - secs_done : BLK_REQ_MAX_SECS;
+        struct blk_request* req = &areq->reqs[idx];
+        blk_request_init(req, hd, kcb.lba + secs_done, (uint8_t*)kcb.buf + secs_done * SECTOR_SIZE, \
+                         secs_op, kcb.opcode == AIO_WRITE);
+        req->end_io = aio_end_io;
+        req->private = areq;
+        secs_done += secs_op;
+    }
+    return areq;
+}
+
+// 提交 cbs 中的 nr 个请求, 不等待完成
+// 返回成功提交的个数, 遇到非法的 aiocb 或超过在途上限时停在那里; 第一个就失败则返回 -1
+int32_t sys_aio_submit(struct aiocb* cbs, uint32_t nr) {
+    struct aio_ctx* ctx = aio_ctx_get();
+    if (ctx == NULL || nr == 0) {
+        return -1;
+    }
+    // 整批放进 plug 后再一起入队, 相邻的请求可以合并
+    struct blk_plug plug;
+    blk_plug_init(&plug);
+    uint32_t submitted = 0;
+    while (submitted < nr) {
+        if (ctx->inflight >= AIO_MAX_INFLIGHT) {
+            break;
+        }
+        struct aio_req* areq = aio_prepare(ctx, &cbs[submitted]);
+        if (areq == NULL) {
+            break;
+        }
+        enum intr_status old_status = spin_lock_irqsave(&ctx->lock);
+        ctx->inflight++;
+        spin_unlock_irqrestore(&ctx->lock, old_status);
+        uint32_t idx;
+        for (idx = 0; idx < areq->req_cnt; idx++) {
+            blk_submit(&plug, &areq->reqs[idx]);
+        }
+        submitted++;
+    }
+    blk_unplug(&plug);
+    return submitted == 0 ? -1 : (int32_t)submitted;
+}
+
+// 取回已完成的请求, 写入 events, 最多 max_nr 个
+// 不足 min_nr 个时阻塞等待, 但不会等在途请求都完成后仍凑不够的数量. 返回取回的个数, 参数非法返回 -1
+int32_t sys_aio_reap(struct aio_event* events, uint32_t min_nr, uint32_t max_nr) {
+    if (max_nr == 0 || min_nr > max_nr || max_nr > AIO_MAX_INFLIGHT || \
+        !user_range_ok((uint32_t)events, max_nr * sizeof(struct aio_event))) {
+        return -1;
+    }
+    struct aio_ctx* ctx = aio_ctx_get();
+    if (ctx == NULL) {
+        return -1;
+    }
+    struct list reaped;
+    list_init(&reaped);
+    uint32_t cnt = 0;
+    enum intr_status old_status = spin_lock_irqsave(&ctx->lock);
+    while (ctx->done_cnt < min_nr && ctx->inflight > 0) {
+        // 所在进程要退出时不再等, 有多少取多少
+        if (!wait_queue_sleep_interruptible(&ctx->wq, &ctx->lock)) {
+            break;
+        }
+    }
+    while (cnt < max_nr && !list_empty(&ctx->done)) {
+        list_append(&reaped, list_pop(&ctx->done));
+        ctx->done_cnt--;
+        cnt++;
+    }
+    spin_unlock_irqrestore(&ctx->lock, old_status);
+
+    uint32_t idx = 0;
+    while (!list_empty(&reaped)) {
+        struct aio_req* areq = elem2entry(struct aio_req, tag, list_pop(&reaped));
+        events[idx].cb = areq->cb;
+        events[idx].result = areq->ok ? (int32_t)areq->sec_cnt : -1;
+        idx++;
+        kfree(areq);
+    }
+    return cnt;
+}
+
+// 进程 leader 是否有在途的异步 io, 它们的缓冲区所在的页不能归还
+bool aio_inflight(struct task_struct* leader) {
+    struct aio_ctx* ctx = leader->aio;
+    return ctx != NULL && ctx->inflight > 0;
+}
+
+// 等进程 leader 在途的异步 io 全部完成, 已完成的留在 done 中等 aio_reap 取回
+void aio_drain(struct task_struct* leader) {
+    struct aio_ctx* ctx = leader->aio;
+    if (ctx == NULL) {
+        return;
+    }
+    enum intr_status old_status = spin_lock_irqsave(&ctx->lock);
+    while (ctx->inflight > 0) {
+        wait_queue_sleep(&ctx->wq, &ctx->lock);
+    }
+    spin_unlock_irqrestore(&ctx->lock, old_status);
+}
+
+// 进程退出或 exec 前调用: 等在途的请求都完成后释放上下文, 否则设备会写进已释放的页
+void aio_exit(struct task_struct* leader) {
+    struct aio_ctx* ctx = leader->aio;
+    if (ctx == NULL) {
+        return;
+    }
+    aio_drain(leader);
+    while (!list_empty(&ctx->done)) {
+        kfree(elem2entry(struct aio_req, tag, list_pop(&ctx->done)));
+    }
+    leader->aio = NULL;
+    kfree(ctx);
+}
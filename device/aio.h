@@ -0,0 +1,31 @@
+#ifndef __DEVICE_AIO_H
+#define __DEVICE_AIO_H
+#include "stdint.h"
+#include "thread.h"
+
+#define AIO_READ         0
+#define AIO_WRITE        1
+#define AIO_MAX_SECS     64  // 一个 aiocb 最多读写的扇区数
+#define AIO_MAX_INFLIGHT 64  // 每个进程同时在途的 aiocb 数上限
+
+// 用户提交的一个异步读写请求
+struct aiocb {
+    uint32_t disk;     // 硬盘编号, 按驱动初始化的顺序, 0 为 sda, 1 为 sdb, 依此类推
+    uint32_t opcode;   // AIO_READ 或 AIO_WRITE
+    uint32_t lba;      // 起始扇区
+    uint32_t sec_cnt;  // 扇区数, 1 ~ AIO_MAX_SECS
+    void* buf;         // 须 2 字节对齐, 在被 aio_reap 取回之前不能释放, 否则 free 会等到请求完成
+};
+
+// aio_reap 取回的完成事件
+struct aio_event {
+    struct aiocb* cb;  // 对应的请求
+    int32_t result;    // 成功时为传输的扇区数, 失败为 -1
+};
+
+int32_t sys_aio_submit(struct aiocb* cbs, uint32_t nr);
+int32_t sys_aio_reap(struct aio_event* events, uint32_t min_nr, uint32_t max_nr);
+bool aio_inflight(struct task_struct* leader);
+void aio_drain(struct task_struct* leader);
+void aio_exit(struct task_struct* leader);
+#endif
@@ -0,0 +1,192 @@
+#include "apic.h"
+#include "memory.h"
+#include "timer.h"
+#include "print.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "atomic.h"
+
+// local APIC 寄存器相对基址的偏移
+#define LAPIC_ID	 0x020
+#define LAPIC_TPR	 0x080	// 任务优先级
+#define LAPIC_EOI	 0x0b0
+#define LAPIC_SVR	 0x0f0	// 伪中断向量及软件启用位
+#define LAPIC_ESR	 0x280	// 错误状态
+#define LAPIC_ICR_LOW	 0x300	// 中断命令寄存器, 写低 32 位时发出 IPI
+#define LAPIC_ICR_HIGH	 0x310	// 中断命令寄存器高 32 位, 存目标的 APIC ID
+#define LAPIC_LVT_TIMER	 0x320
+#define LAPIC_LVT_LINT0	 0x350
+#define LAPIC_LVT_LINT1	 0x360
+#define LAPIC_LVT_ERROR	 0x370
+#define LAPIC_TIMER_INIT 0x380	// 计时器初始计数
+#define LAPIC_TIMER_CUR	 0x390	// 计时器当前计数
+#define LAPIC_TIMER_DIV	 0x3e0	// 计时器分频
+
+#define SVR_ENABLE	 0x100
+#define LVT_MASKED	 0x10000
+#define LVT_ONESHOT	 0x00000
+#define LVT_PERIODIC	 0x20000
+#define LVT_EXTINT	 0x700	// 交付模式 ExtINT, 中断向量由 8259A 提供
+#define LVT_NMI		 0x400
+#define ICR_INIT	 0x500
+#define ICR_STARTUP	 0x600
+#define ICR_PENDING	 0x1000	// 上一个 IPI 尚未送出
+#define ICR_ASSERT	 0x4000
+#define ICR_LEVEL	 0x8000
+#define REDTBL_LEVEL	 0x8000	// 重定向表项的电平触发位
+#define TIMER_DIV_16	 0x3
+
+// IO APIC 通过选择寄存器和数据窗口间接访问
+#define IOAPIC_REGSEL	 0x00
+#define IOAPIC_WIN	 0x10
+#define IOAPIC_VER	 0x01
+#define IOAPIC_REDTBL	 0x10	// 第 n 项重定向表占 0x10+2n 和 0x11+2n 两个寄存器
+
+bool lapic_enabled;			// local APIC 是否已启用
+bool apic_irq_mode;			// 外部中断是否改由 IO APIC 送入, 决定 kernel.S 中向谁发 EOI
+volatile uint32_t* lapic_eoi_reg;	// EOI 寄存器的地址, 供 kernel.S 中的中断入口使用
+static volatile uint32_t* lapic;	// local APIC 寄存器的基址, 各 cpu 的 local APIC 都映射在这里
+static volatile uint32_t* ioapic;
+uint32_t lapic_timer_count;		// 计时器每个嘀嗒的计数值
+
+static uint32_t lapic_read(uint32_t reg) {
+   return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+   lapic[reg / 4] = value;
+   lapic[LAPIC_ID / 4];	   // 读一次, 等待写入生效
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+   ioapic[IOAPIC_REGSEL / 4] = reg;
+   return ioapic[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+   ioapic[IOAPIC_REGSEL / 4] = reg;
+   ioapic[IOAPIC_WIN / 4] = value;
+}
+
+// 等待上一个 IPI 送出
+static void lapic_icr_wait(void) {
+   while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+      cpu_relax();
+   }
+}
+
+// 写 ICR 发出一个 IPI, 先写高 32 位的目标再写低 32 位
+static void lapic_icr_write(uint8_t apic_id, uint32_t icr_low) {
+   enum intr_status old_status = intr_disable();   // 两次写之间不能被本 cpu 上的另一次发送打断
+   lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+   lapic_write(LAPIC_ICR_LOW, icr_low);
+   lapic_icr_wait();
+   intr_set_status(old_status);
+}
+
+// 映射 local APIC 的寄存器页, 由 BSP 在解析 MP 表后调用一次
+void lapic_map(uint32_t paddr) {
+   lapic = mmio_map(paddr, 1);
+   lapic_eoi_reg = lapic + LAPIC_EOI / 4;
+}
+
+// 初始化本 cpu 的 local APIC
+void lapic_init(bool bsp) {
+   // 设置伪中断向量并软件启用
+   lapic_write(LAPIC_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+   lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+   // BSP 的 LINT0 接着 8259A 的 INTR, 即虚拟线路模式; AP 不接收 8259A 的中断
+   lapic_write(LAPIC_LVT_LINT0, bsp ? LVT_EXTINT : LVT_MASKED);
+   lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+   lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+   // ESR 要连写两次才能清除
+   lapic_write(LAPIC_ESR, 0);
+   lapic_write(LAPIC_ESR, 0);
+   lapic_write(LAPIC_EOI, 0);
+   lapic_write(LAPIC_TPR, 0);   // 接收所有优先级的中断
+   lapic_enabled = true;
+}
+
+// 本 cpu 的 APIC ID
+uint8_t lapic_id(void) {
+   return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+   lapic_write(LAPIC_EOI, 0);
+}
+
+// 向 apic_id 号 cpu 发送中断向量为 vector 的 IPI
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+   lapic_icr_write(apic_id, ICR_ASSERT | vector);
+}
+
+// 按 INIT-SIPI-SIPI 的顺序启动 AP, AP 从实模式的 entry_paddr 处开始执行
+void lapic_start_ap(uint8_t apic_id, uint32_t entry_paddr) {
+   ASSERT((entry_paddr & 0xfff00fff) == 0);   // SIPI 的向量号是入口地址的第 12~19 位
+   lapic_icr_write(apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+   udelay(200);
+   lapic_icr_write(apic_id, ICR_INIT | ICR_LEVEL);
+   udelay(10000);
+   uint8_t i;
+   for (i = 0; i < 2; i++) {
+      lapic_icr_write(apic_id, ICR_STARTUP | (entry_paddr >> 12));
+      udelay(200);
+   }
+}
+
+// 以 udelay 为基准, 测出计时器在 16 分频下一个嘀嗒的计数值
+void lapic_timer_calibrate(void) {
+   lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+   lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+   lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+   udelay(1000000 / TIMER_HZ);
+   lapic_timer_count = 0xffffffff - lapic_read(LAPIC_TIMER_CUR);
+   lapic_write(LAPIC_TIMER_INIT, 0);   // 停止计时
+   put_str("   lapic timer count per tick: 0x"); put_int(lapic_timer_count); put_str("\n");
+}
+
+// 让本 cpu 的计时器以 TIMER_HZ 的频率周期性地产生 vector 号中断
+void lapic_timer_start(uint8_t vector) {
+   ASSERT(lapic_timer_count != 0);
+   lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+   lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | vector);
+   lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+// 让本 cpu 的计时器在 tick_cnt 个嘀嗒后产生一次 vector 号中断
+void lapic_timer_oneshot(uint8_t vector, uint32_t tick_cnt) {
+   ASSERT(tick_cnt != 0 && tick_cnt <= 0xffffffff / lapic_timer_count);
+   lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+   lapic_write(LAPIC_LVT_TIMER, LVT_ONESHOT | vector);
+   lapic_write(LAPIC_TIMER_INIT, tick_cnt * lapic_timer_count);
+}
+
+// 本 cpu 计时器的当前计数值, 单次模式下即为距离到期还剩的计数
+uint32_t lapic_timer_current(void) {
+   return lapic_read(LAPIC_TIMER_CUR);
+}
+
+// 把 IO APIC 的 pin 号输入以边沿触发、高电平有效的方式作为 vector 号中断送给 apic_id 号 cpu
+void ioapic_route(uint8_t pin, uint8_t vector, uint8_t apic_id) {
+   ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, (uint32_t)apic_id << 24);
+   ioapic_write(IOAPIC_REDTBL + 2 * pin, vector);
+}
+
+// 同 ioapic_route, 但按电平触发, 用于可共享的 pci 中断线, 设备清除中断源之前引脚一直有效
+void ioapic_route_level(uint8_t pin, uint8_t vector, uint8_t apic_id) {
+   ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, (uint32_t)apic_id << 24);
+   ioapic_write(IOAPIC_REDTBL + 2 * pin, REDTBL_LEVEL | vector);
+}
+
+// 映射 IO APIC 并屏蔽其全部中断输入, 此时外部中断仍由 8259A 经 BSP 的 LINT0 送入
+void ioapic_init(uint32_t paddr) {
+   ioapic = mmio_map(paddr, 1);
+   uint32_t irq_cnt = ((ioapic_read(IOAPIC_VER) >> 16) & 0xff) + 1;
+   uint32_t irq;
+   for (irq = 0; irq < irq_cnt; irq++) {
+      ioapic_write(IOAPIC_REDTBL + 2 * irq, LVT_MASKED);
+      ioapic_write(IOAPIC_REDTBL + 2 * irq + 1, 0);
+   }
+   put_str("   ioapic irqs: 0x"); put_int(irq_cnt); put_str("\n");
+}
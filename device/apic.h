@@ -0,0 +1,30 @@
+#ifndef __DEVICE_APIC_H
+#define __DEVICE_APIC_H
+#include "stdint.h"
+#include "global.h"
+
+// local APIC 使用的中断向量号, 紧接在 8259A 的 0x20~0x2f 之后
+#define LAPIC_TIMER_VECTOR    0x30 // AP 的 local APIC 计时器
+#define IPI_RESCHEDULE_VECTOR 0x31 // 唤醒停机中的 cpu 来调度
+#define IPI_TLB_VECTOR        0x32 // TLB 刷新请求
+#define SPURIOUS_VECTOR       0x3f // 伪中断, 不需要 EOI
+
+extern bool lapic_enabled;
+extern bool apic_irq_mode;
+extern volatile uint32_t* lapic_eoi_reg;
+extern uint32_t lapic_timer_count;
+
+void lapic_map(uint32_t paddr);
+void lapic_init(bool bsp);
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_start_ap(uint8_t apic_id, uint32_t entry_paddr);
+void lapic_timer_calibrate(void);
+void lapic_timer_start(uint8_t vector);
+void lapic_timer_oneshot(uint8_t vector, uint32_t tick_cnt);
+uint32_t lapic_timer_current(void);
+void ioapic_init(uint32_t paddr);
+void ioapic_route(uint8_t pin, uint8_t vector, uint8_t apic_id);
+void ioapic_route_level(uint8_t pin, uint8_t vector, uint8_t apic_id);
+#endif
@@ -0,0 +1,500 @@
+#include "blk.h"
+#include "ide.h"
+#include "memory.h"
+#include "thread.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "super_block.h"
+#include "fs.h"
+#include "file.h"
+#include "stdio.h"
+#include "stdio-kernel.h"
+#include "string.h"
+
+// 派发线程正在传输的扇区范围 [lba, lba + sec_cnt), 位于派发线程的栈上
+struct blk_inflight {
+    uint32_t lba;
+    uint32_t sec_cnt;
+    struct list_elem tag;      // 在 blk_queue.inflight 中的标记
+};
+
+// 按注册顺序记录的磁盘, 下标即对外的硬盘编号
+static struct disk* disks[BLK_MAX_DISKS];
+static uint32_t disk_cnt;
+
+// 把 req 按 lba 升序插入 hd 的队列, lba 相同的排在已有请求之后, 保持提交顺序
+static void blk_enqueue(struct blk_queue* q, struct blk_request* req) {
+    struct list_elem* elem = q->reqs.head.next;
+    while (elem != &q->reqs.tail) {
+        struct blk_request* queued = elem2entry(struct blk_request, tag, elem);
+        if (queued->lba > req->lba) {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &req->tag);
+    req->queue_tsc = rdtsc();
+}
+
+// [lba, lba + sec_cnt) 是否与 q 上正在传输的某个范围重叠. 调用者持有 q->lock
+static bool blk_inflight_overlap(struct blk_queue* q, uint32_t lba, uint32_t sec_cnt) {
+    struct list_elem* elem = q->inflight.head.next;
+    while (elem != &q->inflight.tail) {
+        struct blk_inflight* range = elem2entry(struct blk_inflight, tag, elem);
+        if (lba < range->lba + range->sec_cnt && range->lba < lba + sec_cnt) {
+            return true;
+        }
+        elem = elem->next;
+    }
+    return false;
+}
+
+// C-LOOK: 取 lba 不低于磁头位置的第一个可派发的请求, 没有就绕回最低处
+// 再把其后 lba 紧接、方向相同的请求一并移入 batch, 直到达到扇区数或段数的上限
+// 与在途范围重叠的请求不可派发, lba 落在这种请求范围内的后续请求也不可派发, 免得越过它先执行
+// 返回这一批的扇区数, 没有可派发的请求时返回 0. 调用者持有 q->lock
+static uint32_t blk_pick_batch(struct blk_queue* q, struct list* batch, uint32_t* lba, bool* write) {
+    struct list_elem* elem = q->reqs.head.next;
+    struct list_elem* first = NULL;     // 最低处的可派发请求
+    struct list_elem* start = NULL;     // 磁头之后的第一个可派发请求
+    struct blk_request* req;
+    uint32_t held_end = 0;              // 已被挡住的请求的最高结束扇区
+    while (elem != &q->reqs.tail && start == NULL) {
+        req = elem2entry(struct blk_request, tag, elem);
+        if (req->lba < held_end || blk_inflight_overlap(q, req->lba, req->sec_cnt)) {
+            if (req->lba + req->sec_cnt > held_end) {
+                held_end = req->lba + req->sec_cnt;
+            }
+        } else {
+            if (first == NULL) {
+                first = elem;
+            }
+            if (req->lba >= q->head_pos) {
+                start = elem;
+            }
+        }
+        elem = elem->next;
+    }
+    if (start == NULL) {
+        start = first;
+    }
+    if (start == NULL) {
+        return 0;
+    }
+    elem = start;
+    req = elem2entry(struct blk_request, tag, elem);
+    *lba = req->lba;
+    *write = req->write;
+    uint32_t sec_cnt = 0, seg_cnt = 0;
+    uint64_t now = rdtsc();
+    while (elem != &q->reqs.tail) {
+        req = elem2entry(struct blk_request, tag, elem);
+        if (req->lba != *lba + sec_cnt || req->write != *write || \
+            sec_cnt + req->sec_cnt > q->max_secs || seg_cnt + req->seg_cnt > q->max_segs || \
+            blk_inflight_overlap(q, req->lba, req->sec_cnt)) {
+            break;
+        }
+        elem = elem->next;
+        list_remove(&req->tag);
+        list_append(batch, &req->tag);
+        req->dispatch_tsc = now;
+        sec_cnt += req->sec_cnt;
+        seg_cnt += req->seg_cnt;
+    }
+    q->head_pos = *lba + sec_cnt;
+    return sec_cnt;
+}
+
+// 找出完全容纳 [lba, lba + sec_cnt) 的分区, 没有时返回 NULL
+static struct partition* blk_find_part(struct disk* hd, uint32_t lba, uint32_t sec_cnt) {
+    uint32_t idx;
+    for (idx = 0; idx < 12; idx++) {
+        struct partition* part = idx < 4 ? &hd->prim_parts[idx] : &hd->logic_parts[idx - 4];
+        if (part->sec_cnt != 0 && lba >= part->start_lba && lba + sec_cnt <= part->start_lba + part->sec_cnt) {
+            return part;
+        }
+    }
+    return NULL;
+}
+
+// 两次 TSC 读数之差, 两次可能读自不同的 cpu, 后者偏小时按 0 算
+static uint64_t tsc_delta(uint64_t from, uint64_t to) {
+    return to > from ? to - from : 0;
+}
+
+// 延迟为 us 微秒的请求落在直方图的哪个桶
+static uint32_t lat_bucket(uint32_t us) {
+    uint32_t bucket = 0;
+    while (us > 1 && bucket < BLK_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void blk_stat_add(struct blk_io_stat* st, struct blk_request* req, bool ok, uint32_t wait_us, uint32_t service_us) {
+    st->ios++;
+    st->sectors += req->sec_cnt;
+    if (!ok) {
+        st->errors++;
+    }
+    if (tsc_khz != 0) {
+        st->wait_us += wait_us;
+        st->service_us += service_us;
+        st->hist[lat_bucket(wait_us + service_us)]++;
+    }
+}
+
+// 把 batch 这一条命令计入磁盘及其中各请求所在分区的统计, now 为命令完成的时刻
+static void blk_account(struct list* batch, bool ok, uint64_t now) {
+    struct blk_request* req = elem2entry(struct blk_request, tag, batch->head.next);
+    struct disk* hd = req->hd;
+    enum intr_status old_status = spin_lock_irqsave(&hd->queue.lock);
+    hd->stats.rw[req->write].cmds++;
+    struct list_elem* elem = batch->head.next;
+    while (elem != &batch->tail) {
+        req = elem2entry(struct blk_request, tag, elem);
+        uint32_t wait_us = 0, service_us = 0;
+        if (tsc_khz != 0) {
+            wait_us = cycles2us(tsc_delta(req->queue_tsc, req->dispatch_tsc));
+            service_us = cycles2us(tsc_delta(req->dispatch_tsc, now));
+        }
+        blk_stat_add(&hd->stats.rw[req->write], req, ok, wait_us, service_us);
+        struct partition* part = blk_find_part(hd, req->lba, req->sec_cnt);
+        if (part != NULL) {
+            struct blk_io_stat* st = &part->stats.rw[req->write];
+            blk_stat_add(st, req, ok, wait_us, service_us);
+            // 超级块、位图和 inode 表都在数据区之前, 目录和文件内容在数据区中
+            if (part->sb != NULL && req->lba < part->sb->data_start_lba) {
+                st->meta_ios++;
+                st->meta_sectors += req->sec_cnt;
+            }
+        }
+        elem = elem->next;
+    }
+    spin_unlock_irqrestore(&hd->queue.lock, old_status);
+}
+
+// 通知 batch 中的请求已完成
+// 先把请求摘下来再通知, 提交者得知完成后请求可能马上被释放
+static void blk_complete(struct list* batch, bool ok) {
+    blk_account(batch, ok, rdtsc());
+    while (!list_empty(batch)) {
+        struct blk_request* req = elem2entry(struct blk_request, tag, list_pop(batch));
+        req->ok = ok;
+        if (req->end_io != NULL) {
+            req->end_io(req);
+        } else {
+            sema_up(&req->done);
+        }
+    }
+}
+
+// 直接完成的设备没有队列, 在提交者的上下文中立即传输 req
+static void blk_direct(struct blk_request* req) {
+    struct list batch;
+    list_init(&batch);
+    list_append(&batch, &req->tag);
+    req->queue_tsc = req->dispatch_tsc = rdtsc();
+    bool ok = req->hd->queue.transfer(req->hd, &batch, req->lba, req->sec_cnt, req->write);
+    blk_complete(&batch, ok);
+}
+
+// 派发线程, 没有可派发的请求时睡眠, 否则逐批交给驱动传输, 同一块盘的多个派发线程各自取批次
+// 传输期间批次的范围登记在 q->inflight 中, 完成后唤醒其他派发线程, 被它挡住的请求可能已经可以派发了
+static void blk_dispatch_thread(void* arg) {
+    struct disk* hd = arg;
+    struct blk_queue* q = &hd->queue;
+    struct list batch;
+    struct blk_inflight range;
+    uint32_t lba, sec_cnt;
+    bool write;
+    while (1) {
+        enum intr_status old_status = spin_lock_irqsave(&q->lock);
+        list_init(&batch);
+        while (list_empty(&q->reqs) || (sec_cnt = blk_pick_batch(q, &batch, &lba, &write)) == 0) {
+            wait_queue_sleep(&q->kick, &q->lock);
+        }
+        range.lba = lba;
+        range.sec_cnt = sec_cnt;
+        list_append(&q->inflight, &range.tag);
+        spin_unlock_irqrestore(&q->lock, old_status);
+
+        bool ok = q->transfer(hd, &batch, lba, sec_cnt, write);
+
+        old_status = spin_lock_irqsave(&q->lock);
+        list_remove(&range.tag);
+        if (!list_empty(&q->reqs)) {
+            wait_queue_wake_all(&q->kick);
+        }
+        spin_unlock_irqrestore(&q->lock, old_status);
+        blk_complete(&batch, ok);
+    }
+}
+
+// 初始化 hd 的请求队列, 启动 depth 个派发线程, 并把 hd 登记为下一个编号的磁盘
+// transfer 及一次传输的上限由驱动提供, depth 为设备能同时执行的命令数, 只能串行执行命令的设备为 1
+// 传输不会睡眠的设备(如内存盘)depth 为 0, 不启动派发线程, 请求在提交时就直接完成
+void blk_queue_init(struct disk* hd, blk_transfer_func transfer, uint32_t max_secs, uint32_t max_segs, uint32_t depth) {
+    ASSERT(max_secs >= BLK_REQ_MAX_SECS && max_segs >= BLK_REQ_MAX_SEGS);
+    ASSERT(disk_cnt < BLK_MAX_DISKS);
+    struct blk_queue* q = &hd->queue;
+    spin_init(&q->lock);
+    list_init(&q->reqs);
+    list_init(&q->inflight);
+    q->head_pos = 0;
+    wait_queue_init(&q->kick);
+    q->transfer = transfer;
+    q->max_secs = max_secs;
+    q->max_segs = max_segs;
+    q->direct = depth == 0;
+    disks[disk_cnt++] = hd;
+    while (depth-- > 0) {
+        thread_start(hd->name, 31, blk_dispatch_thread, hd);
+    }
+}
+
+// 按编号取磁盘, 编号按驱动初始化的顺序分配, 不存在时返回 NULL
+struct disk* blk_disk(uint32_t idx) {
+    return idx < disk_cnt ? disks[idx] : NULL;
+}
+
+// 在提交者的上下文中把 buf 换算成物理段, 之后派发线程不必再访问提交者的地址空间
+// 异步提交时在此之后设置 end_io 和 private
+void blk_request_init(struct blk_request* req, struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt, bool write) {
+    ASSERT(sec_cnt > 0 && sec_cnt <= BLK_REQ_MAX_SECS);
+    ASSERT(((uint32_t)buf & 1) == 0);   // DMA 和 PIO 都按字搬运
+    req->hd = hd;
+    req->lba = lba;
+    req->sec_cnt = sec_cnt;
+    req->write = write;
+    req->ok = false;
+    req->seg_cnt = 0;
+    sema_init(&req->done, 0);
+    req->end_io = NULL;
+    req->private = NULL;
+
+    uint32_t vaddr = (uint32_t)buf;
+    uint32_t byte_cnt = sec_cnt * SECTOR_SIZE;
+    while (byte_cnt > 0) {
+        // 页内的物理地址必定连续, 每段不超出一页
+        uint32_t size = PG_SIZE - (vaddr & (PG_SIZE - 1));
+        if (size > byte_cnt) {
+            size = byte_cnt;
+        }
+        ASSERT(req->seg_cnt < BLK_REQ_MAX_SEGS);
+        req->segs[req->seg_cnt].paddr = addr_v2p(vaddr);
+        req->segs[req->seg_cnt].len = size;
+        req->seg_cnt++;
+        vaddr += size;
+        byte_cnt -= size;
+    }
+}
+
+void blk_plug_init(struct blk_plug* plug) {
+    list_init(&plug->reqs);
+}
+
+// 提交 req, plug 不为 NULL 时先暂存在 plug 中, 到 blk_unplug 时才放进磁盘队列
+void blk_submit(struct blk_plug* plug, struct blk_request* req) {
+    if (plug != NULL) {
+        list_append(&plug->reqs, &req->tag);
+        return;
+    }
+    struct blk_queue* q = &req->hd->queue;
+    if (q->direct) {
+        blk_direct(req);
+        return;
+    }
+    enum intr_status old_status = spin_lock_irqsave(&q->lock);
+    blk_enqueue(q, req);
+    spin_unlock_irqrestore(&q->lock, old_status);
+    wait_queue_wake_one(&q->kick);
+}
+
+// 把 plug 中暂存的请求一起放进各自磁盘的队列, 再唤醒派发线程
+// 同一批里的请求先全部入队, 派发线程醒来时就能看到相邻的请求并合并
+void blk_unplug(struct blk_plug* plug) {
+    while (!list_empty(&plug->reqs)) {
+        struct blk_request* req = elem2entry(struct blk_request, tag, list_pop(&plug->reqs));
+        struct blk_queue* q = &req->hd->queue;
+        if (q->direct) {
+            blk_direct(req);
+            continue;
+        }
+        enum intr_status old_status = spin_lock_irqsave(&q->lock);
+        blk_enqueue(q, req);
+        // 后面还有同一块盘的请求就先不唤醒
+        bool more = false;
+        if (!list_empty(&plug->reqs)) {
+            struct blk_request* next = elem2entry(struct blk_request, tag, plug->reqs.head.next);
+            more = next->hd == req->hd;
+        }
+        spin_unlock_irqrestore(&q->lock, old_status);
+        if (!more) {
+            wait_queue_wake_one(&q->kick);
+        }
+    }
+}
+
+// 等待 req 完成, 成功返回 true
+bool blk_wait(struct blk_request* req) {
+    sema_down(&req->done);
+    return req->ok;
+}
+
+// 同步读写 hd 上从 lba 起的 sec_cnt 个扇区
+// 按 BLK_REQ_MAX_SECS 拆成多个请求一起提交, 由队列合并回大的传输
+bool blk_rw(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt, bool write) {
+    ASSERT(sec_cnt > 0);
+    if (sec_cnt <= BLK_REQ_MAX_SECS) {
+        struct blk_request req;
+        blk_request_init(&req, hd, lba, buf, sec_cnt, write);
+        blk_submit(NULL, &req);
+        return blk_wait(&req);
+    }
+
+    uint32_t req_cnt = DIV_ROUND_UP(sec_cnt, BLK_REQ_MAX_SECS);
+    struct blk_request* reqs = kmalloc(req_cnt * sizeof(struct blk_request));
+    if (reqs == NULL) {
+        return false;
+    }
+    struct blk_plug plug;
+    blk_plug_init(&plug);
+    uint32_t idx, secs_done = 0;
+    for (idx = 0; idx < req_cnt; idx++) {
+        uint32_t secs_op = sec_cnt - secs_done < BLK_REQ_MAX_SECS ? sec_cnt - secs_done : BLK_REQ_MAX_SECS;
+        blk_request_init(&reqs[idx], hd, lba + secs_done, (uint8_t*)buf + secs_done * SECTOR_SIZE, secs_op, write);
+        blk_submit(&plug, &reqs[idx]);
+        secs_done += secs_op;
+    }
+    blk_unplug(&plug);
+    bool ok = true;
+    for (idx = 0; idx < req_cnt; idx++) {
+        if (!blk_wait(&reqs[idx])) {
+            ok = false;
+        }
+    }
+    kfree(reqs);
+    return ok;
+}
+
+#define IOSTAT_NAME_COL 8   // 名称一列的宽度
+#define IOSTAT_NUM_COL  9   // 各数值列的宽度
+
+// iostat 中一块盘或一个分区的快照
+struct iostat_snapshot {
+    const char* name;
+    bool is_part;
+    struct blk_stats stats;
+};
+
+// 把 val 补到 buf 中第 col 个数值列, val 为负表示该项不适用, 输出 "-"
+static void iostat_col(char* buf, uint32_t col, int32_t val) {
+    uint32_t len = strlen(buf);
+    while (len < IOSTAT_NAME_COL + 3 + col * IOSTAT_NUM_COL) {
+        buf[len++] = ' ';
+    }
+    if (val < 0) {
+        buf[len] = '-';
+    } else {
+        sprintf(buf + len, "%d", val);
+    }
+}
+
+// 输出一行读或写的统计, 平均等待和执行时间以微秒为单位
+static void iostat_print_row(struct iostat_snapshot* snap, bool write) {
+    struct blk_io_stat* st = &snap->stats.rw[write];
+    char buf[128];
+    memset(buf, 0, sizeof(buf));
+    uint32_t len = strlen(snap->name);
+    memcpy(buf, snap->name, len < IOSTAT_NAME_COL - 1 ? len : IOSTAT_NAME_COL - 1);
+    len = strlen(buf);
+    while (len < IOSTAT_NAME_COL) {
+        buf[len++] = ' ';
+    }
+    buf[len] = write ? 'W' : 'R';
+    iostat_col(buf, 0, st->ios);
+    iostat_col(buf, 1, st->sectors);
+    iostat_col(buf, 2, snap->is_part ? -1 : (int32_t)st->cmds);
+    iostat_col(buf, 3, st->errors);
+    iostat_col(buf, 4, snap->is_part ? (int32_t)st->meta_ios : -1);
+    iostat_col(buf, 5, snap->is_part ? (int32_t)st->meta_sectors : -1);
+    iostat_col(buf, 6, st->ios == 0 || tsc_khz == 0 ? -1 : (int32_t)div64_32(st->wait_us, st->ios, NULL));
+    iostat_col(buf, 7, st->ios == 0 || tsc_khz == 0 ? -1 : (int32_t)div64_32(st->service_us, st->ios, NULL));
+    buf[strlen(buf)] = '\n';
+    sys_write(stdout_no, buf, strlen(buf));
+}
+
+// 输出一行读或写的延迟直方图, 只列出非空的桶, 每项为 "<上界微秒:个数"
+static void iostat_print_hist(struct iostat_snapshot* snap, bool write) {
+    struct blk_io_stat* st = &snap->stats.rw[write];
+    char buf[BLK_LAT_BUCKETS * 24 + 16];
+    memset(buf, 0, sizeof(buf));
+    sprintf(buf, "  %s %c:", snap->name, write ? 'W' : 'R');
+    uint32_t bucket;
+    for (bucket = 0; bucket < BLK_LAT_BUCKETS; bucket++) {
+        if (st->hist[bucket] == 0) {
+            continue;
+        }
+        if (bucket == BLK_LAT_BUCKETS - 1) {
+            sprintf(buf + strlen(buf), " >=%dus:%d", 1 << bucket, st->hist[bucket]);
+        } else {
+            sprintf(buf + strlen(buf), " <%dus:%d", 1 << (bucket + 1), st->hist[bucket]);
+        }
+    }
+    buf[strlen(buf)] = '\n';
+    sys_write(stdout_no, buf, strlen(buf));
+}
+
+// 打印各盘及其分区的读写统计, hist 为 true 时再打印延迟直方图
+// 分区一行的 META 是落在超级块、位图和 inode 表上的请求, 其余为目录和文件数据
+void sys_iostat(bool hist) {
+    // 每块盘至多 4 个主分区和 8 个逻辑分区
+    struct iostat_snapshot* snaps = sys_malloc(13 * sizeof(struct iostat_snapshot));
+    if (snaps == NULL) {
+        printk("sys_iostat: sys_malloc for snapshot failed\n");
+        return;
+    }
+    char* title = "NAME    RW IOS      SECTORS  CMDS     ERRORS   META_IOS META_SEC WAIT_US  SVC_US\n";
+    sys_write(stdout_no, title, strlen(title));
+    uint32_t disk_idx;
+    struct disk* hd;
+    for (disk_idx = 0; (hd = blk_disk(disk_idx)) != NULL; disk_idx++) {
+        // 先在队列锁下把本盘及其分区的统计拷出来, 输出时不必持有锁
+        uint32_t cnt = 0, idx;
+        enum intr_status old_status = spin_lock_irqsave(&hd->queue.lock);
+        snaps[cnt].name = hd->name;
+        snaps[cnt].is_part = false;
+        snaps[cnt].stats = hd->stats;
+        cnt++;
+        for (idx = 0; idx < 12; idx++) {
+            struct partition* part = idx < 4 ? &hd->prim_parts[idx] : &hd->logic_parts[idx - 4];
+            if (part->sec_cnt != 0) {
+                snaps[cnt].name = part->name;
+                snaps[cnt].is_part = true;
+                snaps[cnt].stats = part->stats;
+                cnt++;
+            }
+        }
+        spin_unlock_irqrestore(&hd->queue.lock, old_status);
+
+        for (idx = 0; idx < cnt; idx++) {
+            iostat_print_row(&snaps[idx], false);
+            iostat_print_row(&snaps[idx], true);
+        }
+        if (!hist) {
+            continue;
+        }
+        for (idx = 0; idx < cnt; idx++) {
+            if (snaps[idx].stats.rw[0].ios != 0) {
+                iostat_print_hist(&snaps[idx], false);
+            }
+            if (snaps[idx].stats.rw[1].ios != 0) {
+                iostat_print_hist(&snaps[idx], true);
+            }
+        }
+    }
+    sys_free(snaps);
+}
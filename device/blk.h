@@ -0,0 +1,94 @@
+#ifndef __DEVICE_BLK_H
+#define __DEVICE_BLK_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "sync.h"
+
+#define SECTOR_SIZE        512
+#define BLK_REQ_MAX_SECS   8    // 单个请求的最大扇区数, 一页以内, 更大的读写拆成多个请求再由队列合并
+#define BLK_REQ_MAX_SEGS   2    // 不超过一页的缓冲区最多跨两个物理页
+#define BLK_MAX_DISKS      16   // 注册了请求队列的磁盘数上限
+#define BLK_LAT_BUCKETS    20   // 延迟直方图的桶数, 第 i 桶为 [2^i, 2^(i+1)) 微秒, 第 0 桶含不足 1 微秒的, 末桶含更长的
+
+struct disk;
+struct blk_request;
+
+// 请求完成时在派发线程中调用, 不能睡眠太久, 否则会耽误本盘后面的请求
+// 直接完成的设备上则在提交者调用 blk_submit 或 blk_unplug 时调用
+typedef void (*blk_end_io_func)(struct blk_request* req);
+
+// 一段物理上连续的内存
+struct blk_seg {
+    uint32_t paddr;
+    uint32_t len;
+};
+
+// 一个方向(读或写)的读写统计, 时间在 TSC 不可用时不统计
+struct blk_io_stat {
+    uint32_t ios;                     // 完成的请求数
+    uint32_t sectors;                 // 传输的扇区数
+    uint32_t cmds;                    // 合并后下发给设备的命令数, 只在磁盘上统计
+    uint32_t errors;                  // 失败的请求数
+    uint32_t meta_ios;                // 落在文件系统元数据区(数据区之前)的请求数, 只在分区上统计
+    uint32_t meta_sectors;
+    uint64_t wait_us;                 // 请求在队列中等待派发的累计微秒数, 32 位约 71 分钟就会回绕
+    uint64_t service_us;              // 设备执行请求的累计微秒数
+    uint32_t hist[BLK_LAT_BUCKETS];   // 等待加执行的总延迟的 log2 直方图
+};
+
+// 磁盘或分区的读写统计, rw 以 write 为下标, 由所属磁盘的 queue.lock 保护
+struct blk_stats {
+    struct blk_io_stat rw[2];
+};
+
+// 一个读写请求, 须位于内核内存中(栈上或 kmalloc), 派发线程要访问它
+// 缓冲区在提交时就换算成物理地址, 所以可以由任意线程完成传输
+struct blk_request {
+    struct disk* hd;
+    uint32_t lba;
+    uint32_t sec_cnt;
+    bool write;
+    bool ok;                              // 完成后表示是否成功
+    struct blk_seg segs[BLK_REQ_MAX_SEGS];
+    uint32_t seg_cnt;
+    struct list_elem tag;                 // 在 plug、磁盘队列或派发中的批次里的标记
+    struct semaphore done;                // 完成时 up, 设置了 end_io 时不用
+    blk_end_io_func end_io;               // 异步请求的完成回调, 为 NULL 时由 blk_wait 等待
+    void* private;                        // 供 end_io 使用
+    uint64_t queue_tsc;                   // 进入磁盘队列的时刻
+    uint64_t dispatch_tsc;                // 被派发线程取走的时刻
+};
+
+// 提交者私有的请求暂存处, 攒够一批后再一起放进磁盘队列, 便于合并
+struct blk_plug {
+    struct list reqs;
+};
+
+// 驱动完成一批 lba 相邻、方向相同的请求, 批次中的请求通过 tag 串在 batch 上
+typedef bool (*blk_transfer_func)(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write);
+
+// 每块硬盘的请求队列, 由本盘的派发线程按 C-LOOK 顺序取出处理
+// 能同时执行多条命令的设备有多个派发线程, 每个线程同一时刻只有一批请求在传输
+struct blk_queue {
+    struct spinlock lock;       // 保护 reqs、inflight 和 head_pos, 以及本盘和各分区的 stats
+    struct list reqs;           // 待处理的请求, 按 lba 升序排列
+    struct list inflight;       // 各派发线程正在传输的扇区范围, 与之重叠的请求要等它完成后才能派发
+    uint32_t head_pos;          // 上一次传输结束处的 lba, 下次从这里往高处找
+    struct wait_queue kick;     // 队列为空时派发线程睡在这里
+    blk_transfer_func transfer;
+    uint32_t max_secs;          // 合并后一次传输的扇区数上限, 由驱动根据命令的能力给出
+    uint32_t max_segs;          // 一次传输的物理段数上限, 如 DMA 描述符表的项数
+    bool direct;                // 没有派发线程, 请求提交时就在提交者的上下文中传输
+};
+
+void blk_queue_init(struct disk* hd, blk_transfer_func transfer, uint32_t max_secs, uint32_t max_segs, uint32_t depth);
+struct disk* blk_disk(uint32_t idx);
+void sys_iostat(bool hist);
+void blk_request_init(struct blk_request* req, struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt, bool write);
+void blk_plug_init(struct blk_plug* plug);
+void blk_submit(struct blk_plug* plug, struct blk_request* req);
+void blk_unplug(struct blk_plug* plug);
+bool blk_wait(struct blk_request* req);
+bool blk_rw(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt, bool write);
+#endif
@@ -7,7 +7,7 @@ static struct lock console_lock;    // 控制台锁
 
 /* 初始化终端 */
 void console_init() {
-  lock_init(&console_lock); 
+  lock_init(&console_lock, "console"); 
 }
 
 /* 获取终端 */
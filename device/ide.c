@@ -10,6 +10,9 @@
 #include "timer.h"
 #include "string.h"
 #include "list.h"
+#include "pci.h"
+#include "blk.h"
+#include "atomic.h"
 
 // 定义硬盘各寄存器的端口号
 #define reg_data(channel)	 (channel->port_base + 0)
@@ -24,10 +27,25 @@
 #define reg_alt_status(channel)  (channel->port_base + 0x206)
 #define reg_ctl(channel)	 reg_alt_status(channel)
 
+// 总线主控 DMA 各寄存器的端口号
+#define reg_bm_cmd(channel)	 (channel->bmide_base + 0)
+#define reg_bm_status(channel)	 (channel->bmide_base + 2)
+#define reg_bm_prdt(channel)	 (channel->bmide_base + 4)
+
 // reg_alt_status寄存器的一些关键位
 #define BIT_STAT_BSY	 0x80	      // 硬盘忙
 #define BIT_STAT_DRDY	 0x40	      // 驱动器准备好	 
 #define BIT_STAT_DRQ	 0x8	      // 数据传输准备好了
+#define BIT_STAT_ERR	 0x1	      // 上一条命令出错
+
+// 总线主控命令和状态寄存器的一些关键位
+#define BIT_BM_START	 0x1	      // 开始传输, 清 0 则停止
+#define BIT_BM_READ	 0x8	      // 方向为从硬盘读到内存
+#define BIT_BM_ACTIVE	 0x1	      // 传输进行中
+#define BIT_BM_ERR	 0x2	      // 传输出错, 写 1 清除
+#define BIT_BM_INTR	 0x4	      // 硬盘发出了中断, 写 1 清除
+
+#define PRD_EOT		 0x8000	      // PRD 表的最后一项
 
 // device寄存器的一些关键位
 #define BIT_DEV_MBS	0xa0	    // 第7位和第5位固定为1
@@ -38,9 +56,27 @@
 #define CMD_IDENTIFY	   0xec	    // identify指令
 #define CMD_READ_SECTOR	   0x20     // 读扇区指令
 #define CMD_WRITE_SECTOR   0x30	    // 写扇区指令
-
-// 定义可读写的最大扇区数,调试用的
-#define max_lba ((80*1024*1024/512) - 1)	// 只支持80MB硬盘
+#define CMD_READ_MULTIPLE  0xc4     // 多扇区模式读, 每块 multi_secs 个扇区只发一次中断
+#define CMD_WRITE_MULTIPLE 0xc5     // 多扇区模式写
+#define CMD_SET_MULTIPLE   0xc6     // 设置多扇区模式每块的扇区数
+#define CMD_READ_DMA	   0xc8     // DMA 读扇区指令
+#define CMD_WRITE_DMA	   0xca     // DMA 写扇区指令
+
+// LBA48 版本的读写指令, 扇区号 48 位, 扇区数 16 位
+#define CMD_READ_SECTOR_EXT   0x24
+#define CMD_READ_DMA_EXT      0x25
+#define CMD_READ_MULTIPLE_EXT 0x29
+#define CMD_WRITE_SECTOR_EXT  0x34
+#define CMD_WRITE_DMA_EXT     0x35
+#define CMD_WRITE_MULTIPLE_EXT 0x39
+
+// 等待硬盘时先忙等读多少次备用状态寄存器, 读一次端口约 1 微秒
+#define SPIN_POLL_CNT	   1000
+#define BUSY_WAIT_SECS	   30		// 硬盘一直忙时最多等多少秒
+
+#define LBA28_SECTORS	   0x10000000	// LBA28 能寻址的扇区数
+#define LBA28_MAX_SECS	   256		// LBA28 命令一次最多读写的扇区数
+#define LBA48_MAX_SECS	   2048		// LBA48 硬盘合并后一次传输的上限, 1MB
 
 uint8_t channel_cnt;	   // 按硬盘数计算的通道数
 struct ide_channel channels[2];	 // 有两个ide通道
@@ -85,11 +121,31 @@ static void select_disk(struct disk* hd) {
     outb(reg_dev(hd->my_channel), reg_device);
 }
 
+// 这次传输是否要用 LBA48 命令: 只在超出 LBA28 的寻址范围或扇区数时才用, LBA48 要多写一倍的端口
+static bool need_lba48(struct disk* hd, uint32_t lba, uint32_t sec_cnt) {
+    return hd->lba48 && (sec_cnt > LBA28_MAX_SECS || lba + sec_cnt > LBA28_SECTORS);
+}
+
 // 向硬盘控制器写入起始扇区地址及要读写的扇区数
-static void select_sector(struct disk* hd, uint32_t lba, uint8_t sec_cnt) {
-    ASSERT(lba <= max_lba);
+// LBA48 时扇区数和扇区号寄存器都是两字节深的 FIFO, 先写高字节再写低字节
+static void select_sector(struct disk* hd, uint32_t lba, uint32_t sec_cnt, bool lba48) {
+    ASSERT(lba + sec_cnt <= hd->sectors);
     struct ide_channel* channel = hd->my_channel;
 
+    if (lba48) {
+        ASSERT(sec_cnt <= 65536);  // 65536 写作 0
+        outb(reg_sect_cnt(channel), sec_cnt >> 8);
+        outb(reg_lba_l(channel), lba >> 24);
+        outb(reg_lba_m(channel), 0);   // 扇区号第 32~47 位, 32 位的 lba 用不到
+        outb(reg_lba_h(channel), 0);
+        outb(reg_sect_cnt(channel), sec_cnt);
+        outb(reg_lba_l(channel), lba);
+        outb(reg_lba_m(channel), lba >> 8);
+        outb(reg_lba_h(channel), lba >> 16);
+        outb(reg_dev(channel), BIT_DEV_MBS | BIT_DEV_LBA | (hd->dev_no == 1 ? BIT_DEV_DEV : 0));
+        return;
+    }
+    ASSERT(sec_cnt <= LBA28_MAX_SECS);    // 256 写作 0
     // 写入要读写的扇区数
     outb(reg_sect_cnt(channel), sec_cnt);
     // 写入扇区号
@@ -118,102 +174,219 @@ static void read_from_sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
     insw(reg_data(hd->my_channel), buf, size_in_byte / 2);
 }
 
-// 将 buf 中 sec_cnt 扇区的数据写入硬盘
-static void write2sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
-    uint32_t size_in_byte;
-    if (sec_cnt == 0) {
-        size_in_byte = 256 * 512;
-    } else {
-        size_in_byte = sec_cnt * 512;
+// 等待硬盘不忙, 最多等 BUSY_WAIT_SECS 秒, 不忙时返回是否可以传输数据
+// 命令的完成靠中断唤醒 disk_done, 这里只等中断之后或两块数据之间硬盘短暂的忙碌
+// 所以先在备用状态寄存器上忙等一小段时间, 读它不会清除硬盘的中断请求; 仍然忙再每次睡一个嘀嗒轮询
+static bool busy_wait(struct disk* hd) {
+    struct ide_channel* channel = hd->my_channel;
+    uint8_t status;
+    uint32_t spin;
+    for (spin = 0; spin < SPIN_POLL_CNT; spin++) {
+        status = inb(reg_alt_status(channel));
+        if (!(status & BIT_STAT_BSY)) {
+            return (status & BIT_STAT_DRQ) && !(status & BIT_STAT_ERR);
+        }
+        cpu_relax();
+    }
+    uint32_t start = ticks;
+    while (1) {
+        status = inb(reg_alt_status(channel));
+        if (!(status & BIT_STAT_BSY)) {
+            return (status & BIT_STAT_DRQ) && !(status & BIT_STAT_ERR);
+        }
+        if (ticks - start >= BUSY_WAIT_SECS * TIMER_HZ) {
+            return false;
+        }
+        mtime_sleep(1000 / TIMER_HZ);
     }
-    outsw(reg_data(hd->my_channel), buf, size_in_byte / 2);
 }
 
-// 等待 30 秒
-static bool busy_wait(struct disk* hd) {
-    struct ide_channel* channel = hd->my_channel;
-    uint16_t time_limit = 30 * 1000; // 可以等待 30000 毫秒
-    while (time_limit -= 10 >= 0) {
-        if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
-            return (inb(reg_status(channel)) & BIT_STAT_DRQ);
-        } else {
-            mtime_sleep(10); // 睡眠 10 毫秒
+// 用 batch 中各请求的物理段依次填写通道的 PRD 表
+static void prdt_build(struct ide_channel* channel, struct list* batch) {
+    struct prd* prd = channel->prdt;
+    struct list_elem* elem = batch->head.next;
+    while (elem != &batch->tail) {
+        struct blk_request* req = elem2entry(struct blk_request, tag, elem);
+        uint32_t seg_idx;
+        for (seg_idx = 0; seg_idx < req->seg_cnt; seg_idx++) {
+            prd->paddr = req->segs[seg_idx].paddr;
+            prd->byte_cnt = req->segs[seg_idx].len;
+            prd->flags = 0;
+            prd++;
         }
+        elem = elem->next;
     }
-    return false;
+    (prd - 1)->flags = PRD_EOT;
 }
 
-// 从硬盘读取 sec_cnt 个扇区到 buf
-void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    ASSERT(lba <= max_lba);
-    ASSERT(sec_cnt > 0);
-    lock_acquire(&hd->my_channel->lock);
+// 以 DMA 方式传输 batch, 从 lba 起共 sec_cnt 个扇区, sec_cnt 不超过 256
+// 调用者须持有通道锁, 传输期间阻塞在 disk_done 上, 由中断处理程序唤醒, 出错返回 false
+static bool dma_transfer(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write) {
+    struct ide_channel* channel = hd->my_channel;
+    uint8_t dir = write ? 0 : BIT_BM_READ;
+    prdt_build(channel, batch);
+
+    // 1. 停止上一次传输, 清除状态中的出错和中断位, 并设置 PRD 表和传输方向
+    outb(reg_bm_cmd(channel), 0);
+    outb(reg_bm_status(channel), inb(reg_bm_status(channel)) | BIT_BM_ERR | BIT_BM_INTR);
+    outl(reg_bm_prdt(channel), channel->prdt_paddr);
+    outb(reg_bm_cmd(channel), dir);
+
+    // 2. 向硬盘发出 DMA 命令, 再启动总线主控, 数据传完后硬盘才发中断
+    bool lba48 = need_lba48(hd, lba, sec_cnt);
+    select_sector(hd, lba, sec_cnt, lba48);
+    channel->dma_active = true;
+    if (lba48) {
+        cmd_out(channel, write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT);
+    } else {
+        cmd_out(channel, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+    }
+    outb(reg_bm_cmd(channel), dir | BIT_BM_START);
+    sema_down(&channel->disk_done);
 
-    // 1. 先选择操作的硬盘
-    select_disk(hd);
+    // 3. 醒来后停止总线主控, 根据中断时的状态判断是否成功
+    outb(reg_bm_cmd(channel), 0);
+    return !(channel->dma_status & (BIT_BM_ERR | BIT_BM_ACTIVE)) && \
+           !(inb(reg_alt_status(channel)) & (BIT_STAT_BSY | BIT_STAT_ERR));
+}
 
-    uint32_t secs_op; // 每次操作的扇区数
-    uint32_t secs_done = 0; // 已完成的扇区数
-    while (secs_done < sec_cnt) {
-        if ((secs_done + 256) <= sec_cnt) {
-            secs_op = 256;
+// PIO 传输时在 batch 各请求的物理段上前进的位置
+struct pio_cursor {
+    struct list_elem* elem; // 当前请求在 batch 中的结点
+    uint32_t seg_idx;       // 当前段
+    uint32_t seg_off;       // 段内已搬运的字节数
+};
+
+// 经数据端口在硬盘缓冲区和游标处的物理段之间搬运 byte_cnt 字节, 游标随之前进
+// 这些段可能属于别的进程的地址空间, 逐段用 kmap_atomic 临时映射后再访问
+static void pio_move(struct ide_channel* channel, struct pio_cursor* cur, uint32_t byte_cnt, bool write) {
+    while (byte_cnt > 0) {
+        struct blk_request* req = elem2entry(struct blk_request, tag, cur->elem);
+        struct blk_seg* seg = &req->segs[cur->seg_idx];
+        uint32_t size = seg->len - cur->seg_off;
+        if (size > byte_cnt) {
+            size = byte_cnt;
+        }
+        enum intr_status old_status = intr_disable();
+        void* addr = kmap_atomic(seg->paddr + cur->seg_off);
+        if (write) {
+            outsw(reg_data(channel), addr, size / 2);
         } else {
-            secs_op = sec_cnt - secs_done;
+            insw(reg_data(channel), addr, size / 2);
         }
-        // 2. 写入待读入的扇区数和起始扇区号
-        select_sector(hd, lba+secs_done, secs_op);
-        // 3. 执行的命令写入 reg_cmd 寄存器
-        cmd_out(hd->my_channel, CMD_READ_SECTOR); // 准备开始读数据
-        // 阻塞自己
-        sema_down(&hd->my_channel->disk_done);
-        // 4. 检测硬盘状态是否可读
-        if (!busy_wait(hd)) { // 若失败
-            char error[64];
-            sprintf(error, "%s read sector %d failed!!!!!\n", hd->name, lba);
-            PANIC(error);
+        intr_set_status(old_status);
+
+        byte_cnt -= size;
+        cur->seg_off += size;
+        if (cur->seg_off == seg->len) {
+            cur->seg_off = 0;
+            if (++cur->seg_idx == req->seg_cnt) {
+                cur->seg_idx = 0;
+                cur->elem = cur->elem->next;
+            }
         }
-        // 5. 把数据从硬盘的缓冲区中读出
-        read_from_sector(hd, (void*)((uint32_t)buf+secs_done*512), secs_op);
-        secs_done += secs_op;
     }
-    lock_release(&hd->my_channel->lock);
 }
 
-// 将 buf 中 sec_cnt 扇区数据写入硬盘
-void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    ASSERT(lba <= max_lba);
-    ASSERT(sec_cnt > 0);
-    lock_acquire(&hd->my_channel->lock);
-
-    // 1. 先选择操作的硬盘
-    select_disk(hd);
+// 以 PIO 方式传输 batch, 参数同 dma_transfer
+// 硬盘每准备好一个数据块(多扇区模式下为 multi_secs 个扇区, 否则为 1 个扇区)就置 DRQ,
+// 读时每块的数据就绪后发一次中断, 写时每块写完后发一次中断, 须逐块等待
+static bool pio_transfer(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write) {
+    struct ide_channel* channel = hd->my_channel;
+    struct pio_cursor cur = {batch->head.next, 0, 0};
+    uint32_t block_secs = hd->multi_secs;
+    bool lba48 = need_lba48(hd, lba, sec_cnt);
+    uint8_t cmd;
+    if (block_secs > 1) {
+        if (lba48) {
+            cmd = write ? CMD_WRITE_MULTIPLE_EXT : CMD_READ_MULTIPLE_EXT;
+        } else {
+            cmd = write ? CMD_WRITE_MULTIPLE : CMD_READ_MULTIPLE;
+        }
+    } else {
+        if (lba48) {
+            cmd = write ? CMD_WRITE_SECTOR_EXT : CMD_READ_SECTOR_EXT;
+        } else {
+            cmd = write ? CMD_WRITE_SECTOR : CMD_READ_SECTOR;
+        }
+    }
 
-    uint32_t secs_op; // 每次操作的扇区数
-    uint32_t secs_done = 0; // 已完成的扇区数
-    while (secs_done < sec_cnt) {
-        if ((secs_done + 256) <= sec_cnt) {
-            secs_op = 256;
+    // 1. 写入待读写的扇区数和起始扇区号, 再发出命令
+    select_sector(hd, lba, sec_cnt, lba48);
+    cmd_out(channel, cmd);
+
+    uint32_t secs_left = sec_cnt;
+    while (secs_left > 0) {
+        uint32_t secs_op = secs_left < block_secs ? secs_left : block_secs;
+        if (write) {
+            // 2. 写: 等 DRQ 后送出一块, 再阻塞到硬盘写完这一块的中断
+            if (!busy_wait(hd)) {
+                channel->expecting_intr = false; // 放弃这条命令, 之后的中断不是它的
+                return false;
+            }
+            channel->expecting_intr = true;
+            pio_move(channel, &cur, secs_op * 512, true);
+            sema_down(&channel->disk_done);
         } else {
-            secs_op = sec_cnt - secs_done;
+            // 2. 读: 阻塞到这一块就绪的中断, 检查状态后读出
+            // 读完后硬盘会立刻为下一块发中断, 所以要在读之前就表明在等待中断
+            sema_down(&channel->disk_done);
+            if (!busy_wait(hd)) {
+                channel->expecting_intr = false; // 放弃这条命令, 之后的中断不是它的
+                return false;
+            }
+            if (secs_left > secs_op) {
+                channel->expecting_intr = true;
+            }
+            pio_move(channel, &cur, secs_op * 512, false);
         }
-        // 2. 写入待写入的扇区数和起始扇区号
-        select_sector(hd, lba+secs_done, secs_op);
-        // 3. 执行的命令写入 reg_cmd 寄存器
-        cmd_out(hd->my_channel, CMD_WRITE_SECTOR);
-        // 4. 检测硬盘状态是否可读
-        if (!busy_wait(hd)) { // 若失败
-            char error[64];
-            sprintf(error, "%s write sector %d failed!!!!!\n", hd->name, lba);
-            PANIC(error);
+        secs_left -= secs_op;
+    }
+    // 3. 最后一块的中断之后硬盘应已空闲且没有出错
+    return !(inb(reg_alt_status(channel)) & (BIT_STAT_BSY | BIT_STAT_ERR));
+}
+
+// 块设备队列的传输回调, 由硬盘的派发线程调用, 一批请求对应一条 ata 命令
+// 能用 DMA 时用 DMA, 出错则本盘以后都退回 PIO, 这一批用 PIO 重做
+static bool ide_transfer(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write) {
+    ASSERT(sec_cnt > 0 && sec_cnt <= hd->queue.max_secs);
+    struct ide_channel* channel = hd->my_channel;
+    lock_acquire(&channel->lock);
+    select_disk(hd);
+    bool ok = false;
+    if (channel->bmide_base != 0 && hd->dma) {
+        ok = dma_transfer(hd, batch, lba, sec_cnt, write);
+        if (!ok) {
+            printk("%s dma %s sector %d failed, fall back to pio\n", hd->name, write ? "write" : "read", lba);
+            hd->dma = false;
+            select_disk(hd);
         }
-        // 5. 将数据写入硬盘
-        write2sector(hd, (void*)((uint32_t)buf+secs_done*512), secs_op);
-        // 在硬盘响应期间阻塞自己
-        sema_down(&hd->my_channel->disk_done);
-        secs_done += secs_op;
-    } 
-    // 醒来后开始释放锁
-    lock_release(&hd->my_channel->lock);
+    }
+    if (channel->bmide_base == 0 || !hd->dma) {
+        ok = pio_transfer(hd, batch, lba, sec_cnt, write);
+    }
+    lock_release(&channel->lock);
+    return ok;
+}
+
+// 从硬盘读取 sec_cnt 个扇区到 buf
+void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ASSERT(sec_cnt > 0 && lba < hd->sectors && sec_cnt <= hd->sectors - lba);
+    if (!blk_rw(hd, lba, buf, sec_cnt, false)) {
+        char error[64];
+        sprintf(error, "%s read sector %d failed!!!!!\n", hd->name, lba);
+        PANIC(error);
+    }
+}
+
+// 将 buf 中 sec_cnt 扇区数据写入硬盘
+void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ASSERT(sec_cnt > 0 && lba < hd->sectors && sec_cnt <= hd->sectors - lba);
+    if (!blk_rw(hd, lba, buf, sec_cnt, true)) {
+        char error[64];
+        sprintf(error, "%s write sector %d failed!!!!!\n", hd->name, lba);
+        PANIC(error);
+    }
 }
 
 // 将 dst 中 len 个相邻字节交换位置后存入 buf
@@ -227,6 +400,22 @@ static void swap_pairs_bytes(const char* dst, char* buf, uint32_t len) {
     buf[idx] = '\0';
 }
 
+// 让硬盘以每块 secs 个扇区的多扇区模式工作, 不支持或设置失败时退回每块 1 个扇区
+static void set_multiple(struct disk* hd, uint8_t secs) {
+    hd->multi_secs = 1;
+    if (secs <= 1) {
+        return;
+    }
+    struct ide_channel* channel = hd->my_channel;
+    select_disk(hd);
+    outb(reg_sect_cnt(channel), secs);
+    cmd_out(channel, CMD_SET_MULTIPLE);
+    sema_down(&channel->disk_done);
+    if (!(inb(reg_alt_status(channel)) & BIT_STAT_ERR)) {
+        hd->multi_secs = secs;
+    }
+}
+
 // 获得硬盘参数信息
 static void identify_disk(struct disk* hd) {
     char id_info[512];
@@ -242,6 +431,10 @@ static void identify_disk(struct disk* hd) {
         PANIC(error);
     }
     read_from_sector(hd, id_info, 1);
+    // 第 49 字的第 8 位表示支持 DMA
+    hd->dma = (*(uint16_t*)&id_info[49 * 2] & 0x100) != 0;
+    // 第 47 字的低 8 位是多扇区模式下每块最多的扇区数, 为 0 表示不支持
+    set_multiple(hd, id_info[47 * 2]);
 
     char buf[64];
     uint8_t sn_start = 10 * 2, sn_len = 20, md_start = 27 * 2, md_len = 40;
@@ -250,9 +443,20 @@ static void identify_disk(struct disk* hd) {
     memset(buf, 0, sizeof(buf));
     swap_pairs_bytes(&id_info[md_start], buf, md_len);
     printk("    MODULE: %s\n", buf);
-    uint32_t sectors = *(uint32_t*)&id_info[60 * 2];
-    printk("    SECTORS: %d\n", sectors);
-    printk("    CAPACITY: %dMB\n", sectors*512/1024/1024);
+    // 第 83 字的第 10 位表示支持 LBA48, 此时第 100~103 字是 48 位的扇区总数, 否则用第 60~61 字
+    // 内核中的 lba 是 32 位的, 超过 2TB 的部分用不到
+    hd->lba48 = (*(uint16_t*)&id_info[83 * 2] & 0x400) != 0;
+    if (hd->lba48) {
+        uint32_t high = *(uint32_t*)&id_info[102 * 2];
+        hd->sectors = high != 0 ? 0xffffffff : *(uint32_t*)&id_info[100 * 2];
+    } else {
+        hd->sectors = *(uint32_t*)&id_info[60 * 2];
+    }
+    printk("    SECTORS: %d\n", hd->sectors);
+    printk("    CAPACITY: %dMB\n", hd->sectors / 2048);
+    printk("    LBA48: %s\n", hd->lba48 ? "yes" : "no");
+    printk("    MULTIPLE: %d\n", hd->multi_secs);
+    printk("    DMA: %s\n", hd->dma && hd->my_channel->bmide_base != 0 ? "yes" : "no");
 }
 
 // 扫描硬盘 hd 中地址为 ext_lba 的扇区中的所有分区
@@ -297,6 +501,13 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
     sys_free(bs);
 }
 
+// 扫描 hd 上的全部分区, 加入 partition_list 并按 hd 的名字命名, 其它磁盘驱动也用它
+void disk_partition_scan(struct disk* hd) {
+    ext_lba_base = 0;
+    p_no = 0, l_no = 0;
+    partition_scan(hd, 0);
+}
+
 // 打印分区信息
 static bool partition_info(struct list_elem* pelem, int arg UNUSED) {
     struct partition* part = elem2entry(struct partition, part_tag, pelem);
@@ -314,6 +525,12 @@ void intr_hd_handler(uint8_t irq_no) {
     ASSERT(channel->irq_no == irq_no);
     if (channel->expecting_intr) {
         channel->expecting_intr = false;
+        if (channel->dma_active) {
+            // 记下总线主控状态, 写回原值即清除其中的出错和中断位
+            channel->dma_active = false;
+            channel->dma_status = inb(reg_bm_status(channel));
+            outb(reg_bm_status(channel), channel->dma_status);
+        }
         sema_up(&channel->disk_done);
         inb(reg_status(channel));
     }
@@ -330,6 +547,19 @@ void ide_init() {
     struct ide_channel* channel;
     uint8_t channel_no = 0, dev_no = 0;
 
+    // 找 pci 上的 ide 控制器, 编程接口第 7 位表示支持总线主控, 其寄存器在 BAR4 所指的 IO 端口
+    // 两个通道的总线主控寄存器各占 8 个端口, 找不到时 bmide_base 为 0, 读写都走 PIO
+    uint16_t bmide_base = 0;
+    struct pci_dev* pdev = pci_find_class(0x01, 0x01);
+    if (pdev != NULL && (pdev->prog_if & 0x80)) {
+        uint32_t bar4 = pci_bar(pdev, 4);
+        if ((bar4 & PCI_BAR_IO) && (bar4 & 0xfffc) != 0) {
+            bmide_base = bar4 & 0xfffc;
+            pci_enable_bus_master(pdev);
+            printk("  ide bus master at 0x%x\n", bmide_base);
+        }
+    }
+
     // 处理每个通道上的硬盘
     while (channel_no < channel_cnt) {
         channel = &channels[channel_no];
@@ -348,7 +578,14 @@ void ide_init() {
         }
 
         channel->expecting_intr = false; // 未向硬盘写入指令时不期待硬盘的中断
-        lock_init(&channel->lock);
+        channel->dma_active = false;
+        channel->bmide_base = 0;
+        if (bmide_base != 0) {
+            channel->prdt = get_kernel_pages(1);
+            channel->prdt_paddr = addr_v2p((uint32_t)channel->prdt);
+            channel->bmide_base = bmide_base + channel_no * 8;
+        }
+        lock_init(&channel->lock, channel->name);
 
         sema_init(&channel->disk_done, 0);
 
@@ -361,10 +598,12 @@ void ide_init() {
             hd->dev_no = dev_no;
             sprintf(hd->name, "sd%c", 'a'+channel_no*2+dev_no);
             identify_disk(hd); // 获取硬盘参数
+            // 之后的读写都经过本盘的请求队列, 一批的段数不能超过 PRD 表的项数
+            // 同一通道一次只能执行一条命令, 只需一个派发线程
+            blk_queue_init(hd, ide_transfer, hd->lba48 ? LBA48_MAX_SECS : LBA28_MAX_SECS, PG_SIZE / sizeof(struct prd), 1);
             if (dev_no != 0) { // 内核本身的裸硬盘(hd60M.img)不处理
-                partition_scan(hd, 0); // 扫描该硬盘上的分区
+                disk_partition_scan(hd); // 扫描该硬盘上的分区
             }
-            p_no = 0, l_no = 0;
             dev_no++;
         }
         dev_no = 0;
@@ -3,6 +3,8 @@
 #include "stdint.h"
 #include "sync.h"
 #include "bitmap.h"
+#include "blk.h"
+#include "workqueue.h"
 
 // 分区结构
 struct partition {
@@ -15,6 +17,16 @@ struct partition {
     struct bitmap block_bitmap; // 块位图
     struct bitmap inode_bitmap; // inode 位图
     struct list open_inodes;    // 本分区打开的 i 结点队列
+    // 以下三把读写锁按 dir_lock -> inode_lock -> bitmap_lock 的顺序获取
+    struct rwlock dir_lock;     // 保护目录内容, 查找路径时持读锁, 创建删除时持写锁
+    struct rwlock inode_lock;   // 保护 open_inodes
+    struct rwlock bitmap_lock;  // 保护 block_bitmap 和 inode_bitmap
+    // 位图改动后由 bitmap_sync 记下所在扇区, 再由 system_wq 中的 bitmap_work 推迟写回硬盘
+    struct work bitmap_work;
+    struct spinlock dirty_lock; // 保护下面两项
+    uint32_t dirty_first[2];    // 两种位图各自待写回的扇区范围, 下标为 enum bitmap_type, first > last 表示没有
+    uint32_t dirty_last[2];
+    struct blk_stats stats;     // 落在本分区内的读写统计
 };
 
 // 硬盘结构
@@ -22,10 +34,24 @@ struct disk {
     char name[8]; // 本硬盘的名称
     struct ide_channel* my_channel; // 此块硬盘归属于哪个 ide 通道
     uint8_t dev_no;                 // 本硬盘是主 0, 还是从 1
+    bool dma;                       // 硬盘是否支持 DMA 传输, 由 identify 的第 49 字得出
+    uint32_t sectors;               // 扇区总数, 由 identify 得出
+    bool lba48;                     // 是否支持 LBA48 寻址
+    uint8_t multi_secs;             // PIO 时每个数据块的扇区数, 大于 1 时用 READ/WRITE MULTIPLE
+    struct blk_queue queue;         // 本盘的请求队列
+    void* priv;                     // 非 ide 驱动的私有数据, 如 ahci 的端口
+    struct blk_stats stats;         // 本盘的读写统计
     struct partition prim_parts[4]; // 主分区顶多是 4 个
     struct partition logic_parts[8]; // 逻辑分区数量无限, 本内核支持 8 个
 };
 
+// 总线主控 DMA 的物理区域描述符, 描述一段物理上连续的内存
+struct prd {
+    uint32_t paddr;     // 内存区域的物理地址, 须 2 字节对齐
+    uint16_t byte_cnt;  // 区域的字节数, 0 表示 64KB, 区域不能跨越 64KB 边界
+    uint16_t flags;     // 最高位为 1 表示这是表中的最后一项
+} __attribute__ ((packed));
+
 // ata 通道结构
 struct ide_channel {
     char name[8];               // 本 ata 通道名称
@@ -34,6 +60,11 @@ struct ide_channel {
     struct lock lock;           // 通道锁
     bool expecting_intr;        // 表示等待硬盘的中断
     struct semaphore disk_done; // 用于阻塞、唤醒驱动程序
+    uint16_t bmide_base;        // 本通道总线主控寄存器的起始端口号, 为 0 表示没有控制器, 只能用 PIO
+    struct prd* prdt;           // 本通道的 PRD 表, 占一页, 物理上连续且不跨 64KB 边界
+    uint32_t prdt_paddr;        // PRD 表的物理地址
+    bool dma_active;            // 是否有 DMA 传输在进行, 由中断处理程序读取并清除总线主控状态
+    uint8_t dma_status;         // 中断时读到的总线主控状态
     struct disk devices[2];     // 一个通道上连接两个硬盘, 一主一从
 };
 
@@ -42,6 +73,7 @@ void ide_init(void);
 extern uint8_t channel_cnt;
 extern struct ide_channel channels[];
 extern struct list partition_list;
+void disk_partition_scan(struct disk* hd);
 void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
 void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
 #endif
@@ -5,8 +5,9 @@
 
 /* 初始化io队列ioq */
 void ioqueue_init(struct ioqueue* ioq) {
-   lock_init(&ioq->lock);     // 初始化io队列的锁
-   ioq->producer = ioq->consumer = NULL;  // 生产者和消费者置空
+   spin_init(&ioq->guard);
+   wait_queue_init(&ioq->not_full);
+   wait_queue_init(&ioq->not_empty);
    ioq->head = ioq->tail = 0; // 队列的首尾指针指向缓冲区数组第0个位置
 }
 
@@ -27,61 +28,58 @@ static bool ioq_empty(struct ioqueue* ioq) {
    return ioq->head == ioq->tail;
 }
 
-/* 使当前生产者或消费者在此缓冲区上等待 */
-static void ioq_wait(struct task_struct** waiter) {
-   ASSERT(*waiter == NULL && waiter != NULL);
-   *waiter = running_thread();
-   thread_block(TASK_BLOCKED);
-}
-
-/* 唤醒waiter */
-static void wakeup(struct task_struct** waiter) {
-   ASSERT(*waiter != NULL);
-   thread_unblock(*waiter); 
-   *waiter = NULL;
-}
-
 /* 消费者从ioq队列中获取一个字符 */
 char ioq_getchar(struct ioqueue* ioq) {
    ASSERT(intr_get_status() == INTR_OFF);
 
-/* 若缓冲区(队列)为空,把消费者ioq->consumer记为当前线程自己,
- * 目的是将来生产者往缓冲区里装商品后,生产者知道唤醒哪个消费者,
- * 也就是唤醒当前线程自己*/
+/* 若缓冲区(队列)为空, 就睡在 not_empty 上,
+ * 将来生产者往缓冲区里装商品后会唤醒其中一个消费者 */
+   spin_lock(&ioq->guard);
    while (ioq_empty(ioq)) {
-      lock_acquire(&ioq->lock);	 
-      ioq_wait(&ioq->consumer);
-      lock_release(&ioq->lock);
+      wait_queue_sleep(&ioq->not_empty, &ioq->guard);
    }
 
    char byte = ioq->buf[ioq->tail];	  // 从缓冲区中取出
    ioq->tail = next_pos(ioq->tail);	  // 把读游标移到下一位置
+   spin_unlock(&ioq->guard);
 
-   if (ioq->producer != NULL) {
-      wakeup(&ioq->producer);		  // 唤醒生产者
+   wait_queue_wake_one(&ioq->not_full);	  // 腾出了一个位置, 唤醒一个生产者
+   return byte; 
+}
+
+/* 同 ioq_getchar, 但等待可被进程退出中断, 取到字符返回 true, 被中断返回 false */
+bool ioq_getchar_interruptible(struct ioqueue* ioq, char* byte) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   spin_lock(&ioq->guard);
+   while (ioq_empty(ioq)) {
+      if (!wait_queue_sleep_interruptible(&ioq->not_empty, &ioq->guard)) {
+	 spin_unlock(&ioq->guard);
+	 return false;
+      }
    }
+   *byte = ioq->buf[ioq->tail];
+   ioq->tail = next_pos(ioq->tail);
+   spin_unlock(&ioq->guard);
 
-   return byte; 
+   wait_queue_wake_one(&ioq->not_full);
+   return true;
 }
 
 /* 生产者往ioq队列中写入一个字符byte */
 void ioq_putchar(struct ioqueue* ioq, char byte) {
    ASSERT(intr_get_status() == INTR_OFF);
 
-/* 若缓冲区(队列)已经满了,把生产者ioq->producer记为自己,
- * 为的是当缓冲区里的东西被消费者取完后让消费者知道唤醒哪个生产者,
- * 也就是唤醒当前线程自己*/
+/* 若缓冲区(队列)已经满了, 就睡在 not_full 上,
+ * 等消费者取走东西后唤醒其中一个生产者 */
+   spin_lock(&ioq->guard);
    while (ioq_full(ioq)) {
-      lock_acquire(&ioq->lock);
-      ioq_wait(&ioq->producer);
-      lock_release(&ioq->lock);
+      wait_queue_sleep(&ioq->not_full, &ioq->guard);
    }
    ioq->buf[ioq->head] = byte;      // 把字节放入缓冲区中
    ioq->head = next_pos(ioq->head); // 把写游标移到下一位置
+   spin_unlock(&ioq->guard);
 
-   if (ioq->consumer != NULL) {
-      wakeup(&ioq->consumer);          // 唤醒消费者
-   }
+   wait_queue_wake_one(&ioq->not_empty);  // 唤醒一个消费者
 }
 
 // 返回环形缓冲区中的数据长度
@@ -9,14 +9,14 @@
 /* 环形队列 */
 struct ioqueue {
 // 生产者消费者问题
-    struct lock lock;
+    struct spinlock guard;  // 保护缓冲区游标, 生产者可能在另一个 cpu 的中断中
  /* 生产者,缓冲区不满时就继续往里面放数据,
-  * 否则就睡眠,此项记录哪个生产者在此缓冲区上睡眠。*/
-    struct task_struct* producer;
+  * 否则就在此睡眠, 可以有多个生产者同时等待 */
+    struct wait_queue not_full;
 
  /* 消费者,缓冲区不空时就继续从往里面拿数据,
-  * 否则就睡眠,此项记录哪个消费者在此缓冲区上睡眠。*/
-    struct task_struct* consumer;
+  * 否则就在此睡眠, 可以有多个消费者同时等待 */
+    struct wait_queue not_empty;
     char buf[bufsize];			    // 缓冲区大小
     int32_t head;			    // 队首,数据往队首处写入
     int32_t tail;			    // 队尾,数据从队尾处读出
@@ -25,6 +25,7 @@ struct ioqueue {
 void ioqueue_init(struct ioqueue* ioq);
 bool ioq_full(struct ioqueue* ioq);
 char ioq_getchar(struct ioqueue* ioq);
+bool ioq_getchar_interruptible(struct ioqueue* ioq, char* byte);
 void ioq_putchar(struct ioqueue* ioq, char byte);
 uint32_t ioq_length(struct ioqueue* ioq);
 #endif
@@ -4,6 +4,8 @@
 #include "io.h"
 #include "global.h"
 #include "ioqueue.h"
+#include "sync.h"
+#include "softirq.h"
 
 #define KBD_BUF_PORT 0x60	 // 键盘buffer寄存器端口号为0x60
 
@@ -107,8 +109,15 @@ static char keymap[][2] = {
 /*其它按键暂不处理*/
 };
 
-/* 键盘中断处理程序 */
-static void intr_keyboard_handler(void) {
+#define KBD_RAW_SIZE 64	 // 中断处理程序暂存扫描码的环形缓冲区大小
+
+/* 中断处理程序只把扫描码放进 raw_codes, 由键盘软中断取出翻译, raw_lock 保护下面三项 */
+static uint8_t raw_codes[KBD_RAW_SIZE];
+static uint32_t raw_head, raw_tail;
+static struct spinlock raw_lock;
+
+/* 把一个扫描码翻译成字符放入 kbd_buf, 在键盘软中断中开着中断执行 */
+static void keyboard_decode(uint16_t scancode) {
 
 /* 这次中断发生前的上一次中断,以下任意三个键是否有按下 */
    bool ctrl_down_last = ctrl_status;	  
@@ -116,7 +125,6 @@ static void intr_keyboard_handler(void) {
    bool caps_lock_last = caps_lock_status;
 
    bool break_code;
-   uint16_t scancode = inb(KBD_BUF_PORT);
 
 /* 若扫描码是e0开头的,表示此键的按下将产生多个扫描码,
  * 所以马上结束此次中断处理函数,等待下一个扫描码进来*/ 
@@ -204,9 +212,11 @@ static void intr_keyboard_handler(void) {
       
    /* 若kbd_buf中未满并且待加入的cur_char不为0,
     * 则将其加入到缓冲区kbd_buf中 */
+	 enum intr_status old_status = intr_disable();
 	 if (!ioq_full(&kbd_buf)) {
 	    ioq_putchar(&kbd_buf, cur_char);
 	 }
+	 intr_set_status(old_status);
 	 return;
       }
 
@@ -227,10 +237,38 @@ static void intr_keyboard_handler(void) {
    }
 }
 
+/* 键盘中断处理程序, 关中断下只读出扫描码暂存起来, 翻译和唤醒读者留给软中断
+ * 暂存区满时丢弃, 与 kbd_buf 满时一样 */
+static void intr_keyboard_handler(void) {
+   uint8_t scancode = inb(KBD_BUF_PORT);
+   spin_lock(&raw_lock);
+   if (raw_head - raw_tail < KBD_RAW_SIZE) {
+      raw_codes[raw_head++ % KBD_RAW_SIZE] = scancode;
+   }
+   spin_unlock(&raw_lock);
+   raise_softirq(SOFTIRQ_KEYBOARD);
+}
+
+/* 键盘软中断, 逐个取出暂存的扫描码翻译 */
+static void keyboard_softirq(void) {
+   while (1) {
+      enum intr_status old_status = spin_lock_irqsave(&raw_lock);
+      if (raw_head == raw_tail) {
+	 spin_unlock_irqrestore(&raw_lock, old_status);
+	 return;
+      }
+      uint8_t scancode = raw_codes[raw_tail++ % KBD_RAW_SIZE];
+      spin_unlock_irqrestore(&raw_lock, old_status);
+      keyboard_decode(scancode);
+   }
+}
+
 /* 键盘初始化 */
 void keyboard_init() {
    put_str("keyboard init start\n");
    ioqueue_init(&kbd_buf);
+   spin_init(&raw_lock);
+   open_softirq(SOFTIRQ_KEYBOARD, keyboard_softirq);
    register_handler(0x21, intr_keyboard_handler);
    put_str("keyboard init done\n");
 }
@@ -0,0 +1,115 @@
+#include "pci.h"
+#include "io.h"
+#include "stdio-kernel.h"
+#include "debug.h"
+
+// 配置机制 1: 先向地址端口写入要访问的位置, 再经数据端口读写
+#define PCI_CONFIG_ADDR	 0xcf8
+#define PCI_CONFIG_DATA	 0xcfc
+#define PCI_ENABLE	 0x80000000
+
+#define PCI_MAX_BUS	 256
+#define PCI_MAX_DEV	 32
+#define PCI_MAX_FUNC	 8
+#define PCI_DEV_MAX	 32	// 最多记录的设备数
+
+static struct pci_dev pci_devs[PCI_DEV_MAX];
+static uint32_t pci_dev_cnt;
+
+static uint32_t pci_config_addr(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+   return PCI_ENABLE | (uint32_t)bus << 16 | (uint32_t)dev << 11 | (uint32_t)func << 8 | (offset & 0xfc);
+}
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+   outl(PCI_CONFIG_ADDR, pci_config_addr(bus, dev, func, offset));
+   return inl(PCI_CONFIG_DATA);
+}
+
+// 读 pdev 配置空间中 offset 处的双字, offset 须 4 字节对齐
+uint32_t pci_read_config(struct pci_dev* pdev, uint8_t offset) {
+   return pci_config_read(pdev->bus, pdev->dev, pdev->func, offset);
+}
+
+void pci_write_config(struct pci_dev* pdev, uint8_t offset, uint32_t value) {
+   outl(PCI_CONFIG_ADDR, pci_config_addr(pdev->bus, pdev->dev, pdev->func, offset));
+   outl(PCI_CONFIG_DATA, value);
+}
+
+// 记录一个功能, 厂商号为 0xffff 表示不存在
+static bool pci_probe(uint8_t bus, uint8_t dev, uint8_t func) {
+   uint32_t id = pci_config_read(bus, dev, func, PCI_VENDOR_ID);
+   if ((id & 0xffff) == 0xffff) {
+      return false;
+   }
+   if (pci_dev_cnt == PCI_DEV_MAX) {
+      return true;
+   }
+   struct pci_dev* pdev = &pci_devs[pci_dev_cnt++];
+   pdev->bus = bus;
+   pdev->dev = dev;
+   pdev->func = func;
+   pdev->vendor_id = id & 0xffff;
+   pdev->device_id = id >> 16;
+   uint32_t class = pci_config_read(bus, dev, func, PCI_CLASS);
+   pdev->class_code = class >> 24;
+   pdev->subclass = class >> 16;
+   pdev->prog_if = class >> 8;
+   pdev->irq_line = pci_config_read(bus, dev, func, PCI_INTERRUPT);
+   printk("   pci %d:%d.%d %x:%x class %x:%x irq %d\n", bus, dev, func, \
+          pdev->vendor_id, pdev->device_id, pdev->class_code, pdev->subclass, pdev->irq_line);
+   return true;
+}
+
+// 逐个总线、设备地枚举, 只有多功能设备才继续探测功能 1~7
+void pci_init(void) {
+   printk("pci_init start\n");
+   uint32_t bus, dev, func;
+   for (bus = 0; bus < PCI_MAX_BUS; bus++) {
+      for (dev = 0; dev < PCI_MAX_DEV; dev++) {
+         if (!pci_probe(bus, dev, 0)) {
+            continue;
+         }
+         if (!(pci_config_read(bus, dev, 0, PCI_HEADER_TYPE) & 0x800000)) {
+            continue;
+         }
+         for (func = 1; func < PCI_MAX_FUNC; func++) {
+            pci_probe(bus, dev, func);
+         }
+      }
+   }
+   printk("pci_init done\n");
+}
+
+// 找第一个类别为 class_code、子类别为 subclass 的设备, 没有则返回 NULL
+struct pci_dev* pci_find_class(uint8_t class_code, uint8_t subclass) {
+   uint32_t idx;
+   for (idx = 0; idx < pci_dev_cnt; idx++) {
+      if (pci_devs[idx].class_code == class_code && pci_devs[idx].subclass == subclass) {
+         return &pci_devs[idx];
+      }
+   }
+   return NULL;
+}
+
+// 找 from 之后第一个厂商号和设备号匹配的设备, from 为 NULL 时从头找, 没有则返回 NULL
+struct pci_dev* pci_find_device(uint16_t vendor_id, uint16_t device_id, struct pci_dev* from) {
+   uint32_t idx = from == NULL ? 0 : from - pci_devs + 1;
+   for (; idx < pci_dev_cnt; idx++) {
+      if (pci_devs[idx].vendor_id == vendor_id && pci_devs[idx].device_id == device_id) {
+         return &pci_devs[idx];
+      }
+   }
+   return NULL;
+}
+
+// 读第 bar_no 个基址寄存器的原始值, 调用者根据最低位区分 IO 和内存空间
+uint32_t pci_bar(struct pci_dev* pdev, uint8_t bar_no) {
+   ASSERT(bar_no < 6);
+   return pci_read_config(pdev, PCI_BAR0 + bar_no * 4);
+}
+
+// 打开设备的 IO、内存访问和总线主控, 只改命令寄存器, 写回时状态寄存器写 0 不影响其值
+void pci_enable_bus_master(struct pci_dev* pdev) {
+   uint32_t cmd = pci_read_config(pdev, PCI_COMMAND) & 0xffff;
+   pci_write_config(pdev, PCI_COMMAND, cmd | PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_MASTER);
+}
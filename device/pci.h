@@ -0,0 +1,42 @@
+#ifndef __DEVICE_PCI_H
+#define __DEVICE_PCI_H
+#include "stdint.h"
+#include "global.h"
+
+// 配置空间中常用寄存器的偏移
+#define PCI_VENDOR_ID	  0x00	// 低 16 位厂商号, 高 16 位设备号
+#define PCI_COMMAND	  0x04	// 低 16 位命令寄存器, 高 16 位状态寄存器
+#define PCI_CLASS	  0x08	// 高 8 位类别, 依次往下是子类别、编程接口和版本号
+#define PCI_HEADER_TYPE	  0x0c	// 第 16~23 位是头部类型, 其最高位表示多功能设备
+#define PCI_BAR0	  0x10	// 6 个基址寄存器依次排列, 每个 4 字节
+#define PCI_INTERRUPT	  0x3c	// 低 8 位是 BIOS 分配的中断线
+#define PCI_IRQ_LINES	  16	// 有效的中断线为 0~15, BIOS 未分配时为 0xff
+
+// 命令寄存器的位
+#define PCI_CMD_IO	  0x1	// 响应 IO 空间的访问
+#define PCI_CMD_MEM	  0x2	// 响应内存空间的访问
+#define PCI_CMD_MASTER	  0x4	// 允许设备作为总线主控发起 DMA
+
+#define PCI_BAR_IO	  0x1	// 基址寄存器最低位为 1 表示 IO 空间
+
+// 枚举时记录下的 pci 设备
+struct pci_dev {
+   uint8_t bus;
+   uint8_t dev;
+   uint8_t func;
+   uint16_t vendor_id;
+   uint16_t device_id;
+   uint8_t class_code;
+   uint8_t subclass;
+   uint8_t prog_if;
+   uint8_t irq_line;
+};
+
+void pci_init(void);
+uint32_t pci_read_config(struct pci_dev* pdev, uint8_t offset);
+void pci_write_config(struct pci_dev* pdev, uint8_t offset, uint32_t value);
+struct pci_dev* pci_find_class(uint8_t class_code, uint8_t subclass);
+struct pci_dev* pci_find_device(uint16_t vendor_id, uint16_t device_id, struct pci_dev* from);
+uint32_t pci_bar(struct pci_dev* pdev, uint8_t bar_no);
+void pci_enable_bus_master(struct pci_dev* pdev);
+#endif
@@ -0,0 +1,101 @@
+#include "ramdisk.h"
+#include "ide.h"
+#include "blk.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "string.h"
+#include "stdio-kernel.h"
+#include "debug.h"
+
+// 内存盘的默认扇区数, 可在编译时用 -DRAMDISK_SECS=n 改变, 为 0 且没有映像时不创建内存盘
+#ifndef RAMDISK_SECS
+#define RAMDISK_SECS	 4096	// 2MB
+#endif
+
+// loader 在物理地址 0x500 处留下的映像描述, 与 boot.inc 中的 RAMDISK_INFO_ADDR 一致
+// 低端 1MB 在内核空间中从 0xc0000000 起一一映射
+#define RAMDISK_INFO_ADDR 0xc0000500
+#define RAMDISK_MAGIC	  0x4b534452	// "RDSK"
+#define LOW_MEM_END	  0x100000
+
+// loader 预先读入内存的映像
+struct ramdisk_image {
+    uint32_t magic;
+    uint32_t paddr;	// 映像的物理地址, 在低端 1MB 内
+    uint32_t size;	// 映像的字节数
+};
+
+static struct disk ram_disk;		// 没有分区表, 整个内存盘就是第一个主分区
+static uint8_t* ram_base;		// 内存盘的存储区
+
+// 内存盘的传输回调, 在提交者的上下文中直接完成
+// 请求的段是物理地址, 逐段用 kmap_atomic 临时映射后与存储区之间复制
+static bool ramdisk_transfer(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write) {
+    ASSERT(sec_cnt > 0 && lba + sec_cnt <= hd->sectors);
+    uint8_t* addr = ram_base + lba * SECTOR_SIZE;
+    struct list_elem* elem = batch->head.next;
+    while (elem != &batch->tail) {
+        struct blk_request* req = elem2entry(struct blk_request, tag, elem);
+        uint32_t seg_idx;
+        for (seg_idx = 0; seg_idx < req->seg_cnt; seg_idx++) {
+            struct blk_seg* seg = &req->segs[seg_idx];
+            enum intr_status old_status = intr_disable();
+            void* buf = kmap_atomic(seg->paddr);
+            if (write) {
+                memcpy(addr, buf, seg->len);
+            } else {
+                memcpy(buf, addr, seg->len);
+            }
+            intr_set_status(old_status);
+            addr += seg->len;
+        }
+        elem = elem->next;
+    }
+    return true;
+}
+
+// 创建内存盘并把它作为分区 ram0 加入 partition_list, 由 filesys_init 格式化或挂载
+// loader 读入了映像时, 内存盘至少与映像一样大, 并以映像为初始内容
+void ramdisk_init(void) {
+    struct ramdisk_image* image = (struct ramdisk_image*)RAMDISK_INFO_ADDR;
+    uint32_t image_size = 0;
+    if (image->magic == RAMDISK_MAGIC && image->paddr < LOW_MEM_END && image->size <= LOW_MEM_END - image->paddr) {
+        image_size = image->size;
+    }
+    uint32_t sec_cnt = DIV_ROUND_UP(image_size, SECTOR_SIZE);
+    if (sec_cnt < RAMDISK_SECS) {
+        sec_cnt = RAMDISK_SECS;
+    }
+    if (sec_cnt == 0) {
+        return;
+    }
+    uint32_t pg_cnt = DIV_ROUND_UP(sec_cnt * SECTOR_SIZE, PG_SIZE);
+    ram_base = get_kernel_pages(pg_cnt);
+    if (ram_base == NULL) {
+        printk("ramdisk: alloc %d pages failed\n", pg_cnt);
+        return;
+    }
+    if (image_size != 0) {
+        memcpy(ram_base, (void*)(0xc0000000 + image->paddr), image_size);
+        image->magic = 0;
+    }
+
+    struct disk* hd = &ram_disk;
+    strcpy(hd->name, "ram");
+    hd->sectors = pg_cnt * (PG_SIZE / SECTOR_SIZE);
+    hd->dma = false;
+    hd->lba48 = false;
+    hd->multi_secs = 1;
+    hd->my_channel = NULL;
+    hd->dev_no = 0;
+    hd->priv = NULL;
+    blk_queue_init(hd, ramdisk_transfer, BLK_REQ_MAX_SECS, BLK_REQ_MAX_SEGS, 0);
+
+    struct partition* part = &hd->prim_parts[0];
+    part->start_lba = 0;
+    part->sec_cnt = hd->sectors;
+    part->my_disk = hd;
+    strcpy(part->name, "ram0");
+    list_append(&partition_list, &part->part_tag);
+    printk("ramdisk: %s %dKB%s\n", part->name, hd->sectors / 2, image_size != 0 ? ", preloaded" : "");
+}
@@ -0,0 +1,6 @@
+#ifndef __DEVICE_RAMDISK_H
+#define __DEVICE_RAMDISK_H
+#include "stdint.h"
+
+void ramdisk_init(void);
+#endif
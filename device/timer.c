@@ -4,20 +4,52 @@
 #include "interrupt.h"
 #include "thread.h"
 #include "debug.h"
+#include "list.h"
+#include "sync.h"
+#include "apic.h"
+#include "atomic.h"
+#include "smp.h"
+#include "softirq.h"
+#include "clone.h"
 
-#define IRQ0_FREQUENCY	   100
+#define IRQ0_FREQUENCY	   TIMER_HZ
 #define INPUT_FREQUENCY	   1193180
-#define COUNTER0_VALUE	   INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE	   (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 #define CONTRER0_PORT	   0x40
 #define COUNTER0_NO	   0
 #define COUNTER_MODE	   2
+#define ONESHOT_MODE	   0        // 计数到 0 时产生一次中断, 用于 idle 时的动态嘀嗒
 #define READ_WRITE_LATCH   3
 #define PIT_CONTROL_PORT   0x43
+#define COUNTER2_PORT	   0x42
+#define PIT_READ_BACK	   0xc0     // 回读命令, 下面两个位选择锁存的内容和计数器
+#define PIT_RB_NO_COUNT	   0x20     // 不锁存计数值, 只锁存状态
+#define PIT_RB_COUNTER0	   0x02
+#define PIT_STATUS_OUT	   0x80     // 状态字节中 OUT 引脚的电平
+#define PIT_GATE_PORT	   0x61     // bit0 为计数器 2 的门控, bit1 为扬声器, bit5 为计数器 2 的输出
+
+#define CALIBRATE_MS	   50       // 用计数器 2 定时 50 毫秒来校准 TSC
+#define CALIBRATE_LATCH	   (INPUT_FREQUENCY / (1000 / CALIBRATE_MS))
+
+// 计数器 0 是 16 位的, 单次模式下最多能覆盖的嘀嗒数
+#define MAX_ONESHOT_TICKS  (0xffff / COUNTER0_VALUE)
 
 #define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)
 
 uint32_t ticks;          // ticks是内核自中断开启以来总共的嘀嗒数
 
+static struct list sleep_list;     // 睡眠中的线程, 按唤醒时刻 wake_tick 升序排列
+static struct spinlock sleep_lock; // 保护 sleep_list, 各 cpu 都可能睡眠, 而只有 BSP 负责唤醒
+static bool lapic_tick;            // 是否以 BSP 的 local APIC 计时器代替 8253 作为嘀嗒源
+static uint32_t tick_counts = COUNTER0_VALUE;          // 嘀嗒源每个嘀嗒的计数值
+static uint32_t max_oneshot_ticks = MAX_ONESHOT_TICKS; // 嘀嗒源单次模式下最多能覆盖的嘀嗒数
+static bool oneshot_armed;         // idle 是否已把嘀嗒源编程为单次模式
+static uint32_t oneshot_ticks;     // 本次单次定时覆盖的嘀嗒数
+static uint32_t partial_counts;    // 提前唤醒时不足一个嘀嗒的计数值, 留待下次累加
+
+uint32_t tsc_khz;                  // TSC 每毫秒走过的周期数, 为 0 表示 TSC 不可用
+static uint64_t tsc_base;          // 校准完成时的 TSC 值, 作为单调时钟的零点
+
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
 static void frequency_set(uint8_t counter_port, \
 			  uint8_t counter_no, \
@@ -29,32 +61,266 @@ static void frequency_set(uint8_t counter_port, \
 /* 先写入counter_value的低8位 */
    outb(counter_port, (uint8_t)counter_value);
 /* 再写入counter_value的高8位 */
-   outb(counter_port, (uint8_t)counter_value >> 8);
+   outb(counter_port, (uint8_t)(counter_value >> 8));
+}
+
+/* 锁存并读出计数器 0 的当前计数值 */
+static uint16_t counter0_read(void) {
+   outb(PIT_CONTROL_PORT, (uint8_t)(COUNTER0_NO << 6));   // 锁存命令
+   uint8_t low = inb(CONTRER0_PORT);
+   uint8_t high = inb(CONTRER0_PORT);
+   return (uint16_t)(high << 8 | low);
+}
+
+// 64 位数除以 32 位数, 余数存入 remainder
+// 内核不链接 libgcc, 不能直接对 uint64_t 做除法, 需要时都用它
+uint64_t div64_32(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+   uint32_t high = (uint32_t)(dividend >> 32), low = (uint32_t)dividend;
+   uint32_t q_high = high / divisor;
+   uint32_t q_low, rem = high % divisor;
+   // 此时 rem < divisor, divl 的商必然不会溢出 32 位
+   asm ("divl %4" : "=a" (q_low), "=d" (rem) : "a" (low), "d" (rem), "rm" (divisor));
+   if (remainder != NULL) {
+      *remainder = rem;
+   }
+   return ((uint64_t)q_high << 32) | q_low;
+}
+
+// 用 PIT 计数器 2 定时 CALIBRATE_MS 毫秒, 测出 TSC 的频率
+static void tsc_calibrate(void) {
+   uint32_t eax, ebx, ecx, edx;
+   asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+   if (!(edx & 0x10)) {   // CPUID.1:EDX[4] 为 TSC 支持位
+      put_str("   no tsc, clock falls back to ticks\n");
+      return;
+   }
+   // 打开计数器 2 的门控, 关掉扬声器, 以单次模式装入计数值
+   outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+   outb(PIT_CONTROL_PORT, (uint8_t)(2 << 6 | READ_WRITE_LATCH << 4 | ONESHOT_MODE << 1));
+   outb(COUNTER2_PORT, (uint8_t)CALIBRATE_LATCH);
+   outb(COUNTER2_PORT, (uint8_t)(CALIBRATE_LATCH >> 8));
+
+   uint64_t start = rdtsc();
+   while (!(inb(PIT_GATE_PORT) & 0x20));   // 计数到 0 时 OUT2 变高
+   uint64_t cycles = rdtsc() - start;
+
+   tsc_khz = (uint32_t)div64_32(cycles, CALIBRATE_MS, NULL);
+   tsc_base = rdtsc();
+   put_str("   tsc khz: 0x"); put_int(tsc_khz); put_str("\n");
+}
+
+// 忙等 us 微秒, 用于 APIC 初始化等对时序有要求的场合
+void udelay(uint32_t us) {
+   if (tsc_khz == 0) {
+      // 没有 TSC 时用读端口 0x80 来延时, 每次约 1 微秒
+      while (us-- > 0) {
+	 inb(0x80);
+      }
+      return;
+   }
+   uint64_t end = rdtsc() + div64_32((uint64_t)tsc_khz * us, 1000, NULL);
+   while (rdtsc() < end) {
+      cpu_relax();
+   }
+}
+
+// 把 TSC 周期数换算成纳秒
+uint64_t cycles2ns(uint64_t cycles) {
+   ASSERT(tsc_khz != 0);
+   uint32_t rem;
+   uint64_t ms = div64_32(cycles, tsc_khz, &rem);
+   // rem < tsc_khz, 乘以 1000000 后仍在 64 位之内
+   return ms * 1000000 + div64_32((uint64_t)rem * 1000000, tsc_khz, NULL);
+}
+
+// 把 TSC 周期数换算成微秒, 超出 32 位的部分截断, 用于统计较短的时间间隔
+uint32_t cycles2us(uint64_t cycles) {
+   ASSERT(tsc_khz != 0);
+   uint32_t rem;
+   uint64_t ms = div64_32(cycles, tsc_khz, &rem);
+   return (uint32_t)ms * 1000 + (uint32_t)div64_32((uint64_t)rem * 1000, tsc_khz, NULL);
+}
+
+// 内核的单调纳秒时钟, TSC 不可用时退化为嘀嗒精度
+uint64_t clock_ns(void) {
+   if (tsc_khz == 0) {
+      return (uint64_t)ticks * mil_seconds_per_intr * 1000000;
+   }
+   return cycles2ns(rdtsc() - tsc_base);
+}
+
+// 获取 clock_id 时钟的当前时间存入 tp, 成功返回 0, 失败返回 -1
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   if (clock_id != CLOCK_MONOTONIC || tp == NULL) {
+      return -1;
+   }
+   uint32_t nsec;
+   tp->tv_sec = (uint32_t)div64_32(clock_ns(), 1000000000, &nsec);
+   tp->tv_nsec = nsec;
+   return 0;
 }
 
-/* 时钟的中断处理函数 */
+/* 把嘀嗒源恢复为周期模式 */
+static void tick_periodic(void) {
+   if (lapic_tick) {
+      lapic_timer_start(LAPIC_TIMER_VECTOR);
+   } else {
+      frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+   }
+}
+
+/* 把嘀嗒源编程为 tick_cnt 个嘀嗒后中断一次 */
+static void tick_oneshot(uint32_t tick_cnt) {
+   if (lapic_tick) {
+      lapic_timer_oneshot(LAPIC_TIMER_VECTOR, tick_cnt);
+   } else {
+      frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, tick_cnt * COUNTER0_VALUE);
+   }
+}
+
+/* 单次模式下嘀嗒源距离到期还剩的计数值 */
+static uint32_t tick_remaining(void) {
+   return lapic_tick ? lapic_timer_current() : counter0_read();
+}
+
+/* 单次定时是否已经到期. 8253 到期后计数器会从 0xffff 继续往下减, 剩余值不再可信,
+ * 要用回读命令锁存计数器 0 的状态, 看 OUT 引脚是否已变高; local APIC 计时器到期后停在 0 */
+static bool tick_expired(void) {
+   if (lapic_tick) {
+      return lapic_timer_current() == 0;
+   }
+   outb(PIT_CONTROL_PORT, PIT_READ_BACK | PIT_RB_NO_COUNT | PIT_RB_COUNTER0);
+   return (inb(CONTRER0_PORT) & PIT_STATUS_OUT) != 0;
+}
+
+/* 改用 BSP 的 local APIC 计时器作为嘀嗒源, 在 IO APIC 接管外部中断后调用
+ * 8253 的 IRQ0 已不再送达, 计数器 0 空转即可 */
+void timer_use_lapic(void) {
+   enum intr_status old_status = intr_disable();
+   lapic_tick = true;
+   tick_counts = lapic_timer_count;
+   // 留出余量, 使 partial_counts 加上一次单次定时的计数也不会溢出
+   max_oneshot_ticks = 0xffffffff / lapic_timer_count - 1;
+   tick_periodic();
+   intr_set_status(old_status);
+   put_str("   tick source: lapic timer\n");
+}
+
+/* 唤醒 sleep_list 中所有已到期的线程, 作为 SOFTIRQ_TIMER 软中断在时钟中断返回前执行 */
+static void wakeup_sleepers(void) {
+   enum intr_status old_status = spin_lock_irqsave(&sleep_lock);
+   while (!list_empty(&sleep_list)) {
+      struct task_struct* pthread = elem2entry(struct task_struct, general_tag, sleep_list.head.next);
+      if ((int32_t)(pthread->wake_tick - ticks) > 0) {
+	 break;   // 队列有序, 首个未到期则后面的都未到期
+      }
+      list_remove(&pthread->general_tag);
+      thread_unblock(pthread);
+   }
+   spin_unlock_irqrestore(&sleep_lock, old_status);
+}
+
+/* 时钟的中断处理函数, 8253 的 0x20 号和 local APIC 计时器的 0x30 号中断都由它处理
+ * 全局的 ticks 和睡眠线程只由 BSP 负责, 其余 cpu 只管自己的时间片 */
 static void intr_timer_handler(void) {
    struct task_struct* cur_thread = running_thread();
 
    ASSERT(cur_thread->stack_magic == 0x19870916);         // 检查栈是否溢出
 
    cur_thread->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
-   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+   if (this_cpu()->id == 0) {
+      if (oneshot_armed) {
+	 // idle 期间的单次定时到期, 一次补上期间的全部嘀嗒并恢复周期模式
+	 oneshot_armed = false;
+	 ticks += oneshot_ticks;
+	 tick_periodic();
+      } else {
+	 ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+      }
+      raise_softirq(SOFTIRQ_TIMER);
+   }
 
-   if (cur_thread->ticks == 0) {	  // 若进程时间片用完就开始调度新的进程上cpu
+   // 所在进程正在退出时, 被打断的若是用户态的线程就地结束它.
+   // 用户进程只有在系统调用中才持有大内核锁, 其余时间进入内核都是关中断的, 除了软中断
+   if (cur_thread->pgdir != NULL && !cur_thread->bkl_held && !this_cpu()->in_softirq &&
+       cur_thread->group_leader->group_exiting) {
+      kernel_lock();
+      thread_group_check();
+   }
+
+   // 正在执行软中断时不能换下当前任务, 时间片保持为 0, 下个嘀嗒再调度
+   if (cur_thread->ticks == 0 && !this_cpu()->in_softirq) {	  // 若进程时间片用完就开始调度新的进程上cpu
       schedule(); 
-   } else {				  // 将当前进程的时间片-1
+   } else if (cur_thread->ticks != 0) {	  // 将当前进程的时间片-1
       cur_thread->ticks--;
    }
 }
 
+// BSP 的 idle 停机前调用: 就绪队列为空时, 把嘀嗒源编程为单次模式,
+// 在最近的睡眠期限(最多 max_oneshot_ticks 个嘀嗒)到来时才产生中断
+void timer_idle_enter(void) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   if (oneshot_armed || thread_has_ready()) {
+      return;
+   }
+   uint32_t idle_ticks = max_oneshot_ticks;
+   spin_lock(&sleep_lock);
+   if (!list_empty(&sleep_list)) {
+      struct task_struct* first = elem2entry(struct task_struct, general_tag, sleep_list.head.next);
+      int32_t delta = (int32_t)(first->wake_tick - ticks);
+      if (delta < (int32_t)idle_ticks) {
+	 idle_ticks = delta > 0 ? delta : 0;
+      }
+   }
+   spin_unlock(&sleep_lock);
+   // 下一个嘀嗒之内就有期限到期, 保持周期模式即可
+   if (idle_ticks <= 1) {
+      return;
+   }
+   oneshot_ticks = idle_ticks;
+   oneshot_armed = true;
+   tick_oneshot(idle_ticks);
+}
+
+// idle 从 hlt 醒来后调用: 若是被其它中断提前唤醒,
+// 根据计数器剩余值补上已经过去的嘀嗒, 并恢复周期模式
+// 若单次定时恰好也已到期, 其中断还挂着, 留给时钟中断处理程序一次补上全部嘀嗒
+void timer_idle_exit(void) {
+   enum intr_status old_status = intr_disable();
+   if (oneshot_armed && !tick_expired()) {
+      oneshot_armed = false;
+      uint32_t total = oneshot_ticks * tick_counts;
+      uint32_t remaining = tick_remaining();
+      // 读剩余值前的一瞬间到期时剩余值同样不可信, 按整段已过去算
+      uint32_t elapsed = remaining <= total ? total - remaining : total;
+      partial_counts += elapsed;
+      ticks += partial_counts / tick_counts;
+      partial_counts %= tick_counts;
+      tick_periodic();
+      wakeup_sleepers();
+   }
+   intr_set_status(old_status);
+}
+
 // 以 tick 为单位的 sleep, 任何时间形式的 sleep 会转换此 ticks 形式
+// 线程按唤醒时刻插入 sleep_list 后阻塞, 由时钟中断到期唤醒
 static void ticks_to_sleep(uint32_t sleep_ticks) {
-   uint32_t start_tick = ticks;
-   // 若间隔的 ticks 数不够便让出 cpu
-   while (ticks - start_tick < sleep_ticks) {
-      thread_yield();
+   struct task_struct* cur = running_thread();
+   enum intr_status old_status = spin_lock_irqsave(&sleep_lock);
+   cur->wake_tick = ticks + sleep_ticks;
+
+   // 找到第一个比自己晚唤醒的线程, 插在它前面
+   struct list_elem* elem = sleep_list.head.next;
+   while (elem != &sleep_list.tail) {
+      struct task_struct* pthread = elem2entry(struct task_struct, general_tag, elem);
+      if ((int32_t)(pthread->wake_tick - cur->wake_tick) > 0) {
+	 break;
+      }
+      elem = elem->next;
    }
+   list_insert_before(elem, &cur->general_tag);
+   thread_block_locked(TASK_BLOCKED, &sleep_lock);
+   intr_set_status(old_status);
 }
 
 // 以毫秒为单位的 sleep
@@ -67,8 +333,13 @@ void mtime_sleep(uint32_t m_seconds) {
 /* 初始化PIT8253 */
 void timer_init() {
    put_str("timer_init start\n");
+   list_init(&sleep_list);
+   spin_init(&sleep_lock);
    /* 设置8253的定时周期,也就是发中断的周期 */
    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+   tsc_calibrate();
    register_handler(0x20, intr_timer_handler);
+   register_handler(LAPIC_TIMER_VECTOR, intr_timer_handler);
+   open_softirq(SOFTIRQ_TIMER, wakeup_sleepers);
    put_str("timer_init done\n");
 }
@@ -1,7 +1,34 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+
+#define TIMER_HZ 100       // 每秒的嘀嗒数
+#define CLOCK_MONOTONIC 1 // 自开机起单调递增的时钟
+
+// clock_gettime 返回的时间
+struct timespec {
+    uint32_t tv_sec;  // 秒
+    uint32_t tv_nsec; // 不足 1 秒的纳秒数
+};
+
+// 读取时间戳计数器
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+extern uint32_t tsc_khz;
+extern uint32_t ticks;
 void timer_init(void);
+void timer_use_lapic(void);
 void mtime_sleep(uint32_t m_seconds);
+void udelay(uint32_t us);
+void timer_idle_enter(void);
+void timer_idle_exit(void);
+uint64_t div64_32(uint64_t dividend, uint32_t divisor, uint32_t* remainder);
+uint64_t cycles2ns(uint64_t cycles);
+uint32_t cycles2us(uint64_t cycles);
+uint64_t clock_ns(void);
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp);
 #endif
-
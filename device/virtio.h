@@ -0,0 +1,63 @@
+#ifndef __DEVICE_VIRTIO_H
+#define __DEVICE_VIRTIO_H
+#include "stdint.h"
+
+#define VIRTIO_VENDOR_ID   0x1af4
+
+// 传统(legacy)接口的寄存器, 位于 BAR0 所指的 IO 端口
+#define VIRTIO_HOST_FEATURES  0x00	// 设备支持的特性
+#define VIRTIO_GUEST_FEATURES 0x04	// 驱动选用的特性
+#define VIRTIO_QUEUE_PFN      0x08	// 所选队列的物理页号, 写 0 表示停用
+#define VIRTIO_QUEUE_SIZE     0x0c	// 所选队列的描述符数, 由设备决定, 16 位
+#define VIRTIO_QUEUE_SEL      0x0e	// 选择队列, 16 位
+#define VIRTIO_QUEUE_NOTIFY   0x10	// 写入队列号通知设备有新请求, 16 位
+#define VIRTIO_STATUS         0x12	// 设备状态, 8 位, 写 0 复位
+#define VIRTIO_ISR            0x13	// 中断状态, 8 位, 读后清除并撤销中断
+#define VIRTIO_CONFIG         0x14	// 设备专有的配置, 未启用 MSI-X 时从这里开始
+
+// 设备状态的位, 按顺序置位
+#define VIRTIO_STATUS_ACK       0x1	// 驱动发现了设备
+#define VIRTIO_STATUS_DRIVER    0x2	// 驱动知道如何驱动它
+#define VIRTIO_STATUS_DRIVER_OK 0x4	// 驱动已准备好
+#define VIRTIO_STATUS_FAILED    0x80
+
+#define VIRTIO_ISR_QUEUE        0x1	// 队列中有请求完成
+
+#define VRING_ALIGN      4096	// 传统接口中已用环要按页对齐
+
+// 描述符, 一个请求由 next 串起的若干描述符组成
+#define VRING_DESC_F_NEXT  0x1	// next 有效
+#define VRING_DESC_F_WRITE 0x2	// 设备写入这段内存, 否则只读
+struct vring_desc {
+    uint64_t addr;	// 物理地址
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__ ((packed));
+
+// 可用环, 驱动在 ring 中放入请求的首个描述符号, 再增加 idx
+struct vring_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];
+} __attribute__ ((packed));
+
+struct vring_used_elem {
+    uint32_t id;	// 完成的请求的首个描述符号
+    uint32_t len;	// 设备写入的字节数
+} __attribute__ ((packed));
+
+// 已用环, 设备放入完成的请求再增加 idx
+struct vring_used {
+    uint16_t flags;
+    volatile uint16_t idx;
+    struct vring_used_elem ring[];
+} __attribute__ ((packed));
+
+// 描述符表、可用环和已用环依次排在物理上连续的内存中, 已用环从页边界开始, 返回总字节数
+static inline uint32_t vring_size(uint32_t num) {
+    uint32_t avail_end = sizeof(struct vring_desc) * num + sizeof(uint16_t) * (3 + num);
+    return ((avail_end + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1)) + \
+           sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * num;
+}
+#endif
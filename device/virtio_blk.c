@@ -0,0 +1,252 @@
+#include "virtio_blk.h"
+#include "virtio.h"
+#include "ide.h"
+#include "blk.h"
+#include "pci.h"
+#include "io.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "stdio.h"
+#include "stdio-kernel.h"
+#include "debug.h"
+#include "atomic.h"
+
+#define VIRTIO_BLK_DEVICE_ID  0x1001	// 传统接口的 virtio 块设备
+
+#define VIRTIO_BLK_F_SEG_MAX  0x4	// 配置中的 seg_max 有效
+
+// 块设备配置在 VIRTIO_CONFIG 处的偏移
+#define VIRTIO_BLK_CFG_CAPACITY 0	// 64 位的扇区总数
+#define VIRTIO_BLK_CFG_SEG_MAX  12	// 一个请求最多的数据段数
+
+#define VIRTIO_BLK_T_IN    0	// 读
+#define VIRTIO_BLK_T_OUT   1	// 写
+#define VIRTIO_BLK_S_OK    0	// 请求成功
+
+#define VIRTIO_BLK_MAX_SECS 2048	// 合并后一次传输的上限, 1MB
+#define STATUS_OFFSET       512	// 状态字节在请求头所在页中的偏移, 前面放各槽位的请求头
+
+// 每个请求开头的请求头, 设备只读
+struct virtio_blk_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__ ((packed));
+
+static struct virtio_blk vblks[VIRTIO_BLK_MAX_DISKS];
+static uint32_t vblk_cnt;
+
+// 块设备队列的传输回调, 由派发线程调用, 一批请求对应队列中的一个请求
+// 描述符链依次是请求头、各数据段和状态字节, 多个槽位的请求同时交给设备, 完成的先后不定
+static bool virtio_blk_transfer(struct disk* hd, struct list* batch, uint32_t lba, uint32_t sec_cnt, bool write) {
+    ASSERT(sec_cnt > 0 && sec_cnt <= hd->queue.max_secs && lba + sec_cnt <= hd->sectors);
+    struct virtio_blk* vblk = hd->priv;
+
+    // 1. 取一个空闲槽位, 派发线程数等于槽位数, 所以总能取到
+    enum intr_status old_status = spin_lock_irqsave(&vblk->lock);
+    ASSERT(vblk->free_slots != 0);
+    uint32_t slot = 0;
+    while (!(vblk->free_slots & (1 << slot))) {
+        slot++;
+    }
+    vblk->free_slots &= ~(1 << slot);
+    spin_unlock_irqrestore(&vblk->lock, old_status);
+
+    // 2. 槽位及其描述符归本线程所有, 填写时不必持锁
+    struct virtio_blk_hdr* hdr = &vblk->hdrs[slot];
+    hdr->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    hdr->reserved = 0;
+    hdr->sector = lba;
+    vblk->status[slot] = 0xff;
+
+    uint16_t head = slot * vblk->slot_descs;
+    struct vring_desc* desc = &vblk->desc[head];
+    desc->addr = vblk->hdr_paddr + slot * sizeof(struct virtio_blk_hdr);
+    desc->len = sizeof(struct virtio_blk_hdr);
+    desc->flags = VRING_DESC_F_NEXT;
+    desc->next = head + 1;
+    desc++;
+    struct list_elem* elem = batch->head.next;
+    while (elem != &batch->tail) {
+        struct blk_request* req = elem2entry(struct blk_request, tag, elem);
+        uint32_t seg_idx;
+        for (seg_idx = 0; seg_idx < req->seg_cnt; seg_idx++) {
+            desc->addr = req->segs[seg_idx].paddr;
+            desc->len = req->segs[seg_idx].len;
+            desc->flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+            desc->next = desc - vblk->desc + 1;
+            desc++;
+        }
+        elem = elem->next;
+    }
+    ASSERT((uint32_t)(desc - vblk->desc) < head + vblk->slot_descs);
+    desc->addr = vblk->hdr_paddr + STATUS_OFFSET + slot;
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+    desc->next = 0;
+
+    // 3. 先填好可用环中的表项再增加 idx, 然后通知设备, 阻塞到中断处理程序发现它完成
+    old_status = spin_lock_irqsave(&vblk->lock);
+    vblk->avail->ring[vblk->avail->idx % vblk->num] = head;
+    barrier();
+    vblk->avail->idx++;
+    spin_unlock_irqrestore(&vblk->lock, old_status);
+    outw(vblk->io_base + VIRTIO_QUEUE_NOTIFY, 0);
+    sema_down(&vblk->slot_done[slot]);
+
+    // 4. 取走结果, 归还槽位
+    bool ok = vblk->status[slot] == VIRTIO_BLK_S_OK;
+    old_status = spin_lock_irqsave(&vblk->lock);
+    vblk->free_slots |= 1 << slot;
+    spin_unlock_irqrestore(&vblk->lock, old_status);
+    if (!ok) {
+        printk("%s %s sector %d failed\n", hd->name, write ? "write" : "read", lba);
+    }
+    return ok;
+}
+
+// 收走已用环中新完成的请求, 按其首个描述符号找到槽位并唤醒
+static void virtio_blk_complete(struct virtio_blk* vblk) {
+    uint32_t done = 0;
+    spin_lock(&vblk->lock);
+    while (vblk->last_used != vblk->used->idx) {
+        barrier();
+        uint32_t id = vblk->used->ring[vblk->last_used % vblk->num].id;
+        done |= 1 << (id / vblk->slot_descs);
+        vblk->last_used++;
+    }
+    spin_unlock(&vblk->lock);
+
+    uint32_t slot;
+    for (slot = 0; slot < vblk->depth; slot++) {
+        if (done & (1 << slot)) {
+            sema_up(&vblk->slot_done[slot]);
+        }
+    }
+}
+
+// virtio 块设备的中断处理程序, 读 ISR 可得知是不是本设备的中断, 同时撤销中断
+static void intr_virtio_blk_handler(uint8_t vec_nr) {
+    uint32_t idx;
+    for (idx = 0; idx < vblk_cnt; idx++) {
+        struct virtio_blk* vblk = &vblks[idx];
+        if (0x20 + vblk->pdev->irq_line != vec_nr) {
+            continue;
+        }
+        if (inb(vblk->io_base + VIRTIO_ISR) & VIRTIO_ISR_QUEUE) {
+            virtio_blk_complete(vblk);
+        }
+    }
+}
+
+// 按传统接口的步骤初始化设备: 复位, 协商特性, 建立 0 号队列, 最后置 DRIVER_OK
+static bool virtio_blk_probe(struct virtio_blk* vblk, struct pci_dev* pdev) {
+    uint32_t bar0 = pci_bar(pdev, 0);
+    if (!(bar0 & PCI_BAR_IO)) {
+        return false;
+    }
+    vblk->pdev = pdev;
+    vblk->io_base = bar0 & 0xfffc;
+    pci_enable_bus_master(pdev);
+    uint16_t io_base = vblk->io_base;
+
+    outb(io_base + VIRTIO_STATUS, 0);
+    outb(io_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+    outb(io_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    uint32_t features = inl(io_base + VIRTIO_HOST_FEATURES) & VIRTIO_BLK_F_SEG_MAX;
+    outl(io_base + VIRTIO_GUEST_FEATURES, features);
+
+    outw(io_base + VIRTIO_QUEUE_SEL, 0);
+    vblk->num = inw(io_base + VIRTIO_QUEUE_SIZE);
+    if (vblk->num == 0 || inl(io_base + VIRTIO_QUEUE_PFN) != 0) {
+        outb(io_base + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    uint8_t* ring = get_kernel_pages_contig(DIV_ROUND_UP(vring_size(vblk->num), PG_SIZE));
+    vblk->hdrs = get_kernel_pages(1);
+    if (ring == NULL || vblk->hdrs == NULL) {
+        PANIC("virtio_blk: alloc memory failed!");
+    }
+    vblk->desc = (struct vring_desc*)ring;
+    vblk->avail = (struct vring_avail*)(ring + sizeof(struct vring_desc) * vblk->num);
+    uint32_t avail_end = sizeof(struct vring_desc) * vblk->num + sizeof(uint16_t) * (3 + vblk->num);
+    vblk->used = (struct vring_used*)(ring + ((avail_end + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1)));
+    vblk->last_used = 0;
+    vblk->status = (uint8_t*)vblk->hdrs + STATUS_OFFSET;
+    vblk->hdr_paddr = addr_v2p((uint32_t)vblk->hdrs);
+    outl(io_base + VIRTIO_QUEUE_PFN, addr_v2p((uint32_t)ring) >> 12);
+
+    // 描述符按槽位平分, 每个槽位除请求头和状态外至少要容纳一个请求的数据段
+    vblk->depth = VIRTIO_BLK_DEPTH;
+    while (vblk->depth > 1 && vblk->num / vblk->depth < BLK_REQ_MAX_SEGS + 2) {
+        vblk->depth--;
+    }
+    vblk->slot_descs = vblk->num / vblk->depth;
+    if (vblk->slot_descs < BLK_REQ_MAX_SEGS + 2) {
+        outb(io_base + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    // 一批的段数受槽位的描述符数和设备的 seg_max 限制
+    vblk->max_segs = vblk->slot_descs - 2;
+    uint32_t seg_max = inl(io_base + VIRTIO_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+    if ((features & VIRTIO_BLK_F_SEG_MAX) && seg_max >= BLK_REQ_MAX_SEGS && seg_max < vblk->max_segs) {
+        vblk->max_segs = seg_max;
+    }
+
+    struct disk* hd = &vblk->disk;
+    uint32_t cap_high = inl(io_base + VIRTIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4);
+    hd->sectors = cap_high != 0 ? 0xffffffff : inl(io_base + VIRTIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY);
+    hd->dma = true;
+    hd->lba48 = false;
+    hd->multi_secs = 1;
+    hd->my_channel = NULL;
+    hd->dev_no = 0;
+    hd->priv = vblk;
+
+    spin_init(&vblk->lock);
+    vblk->free_slots = (1 << vblk->depth) - 1;
+    uint32_t slot;
+    for (slot = 0; slot < vblk->depth; slot++) {
+        sema_init(&vblk->slot_done[slot], 0);
+    }
+    outb(io_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return true;
+}
+
+// 找出所有 virtio 块设备, 初始化后扫描其分区, 在 ahci_init 之后调用, 硬盘名为 vda, vdb...
+void virtio_blk_init(void) {
+    struct pci_dev* pdev = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, NULL);
+    if (pdev == NULL) {
+        return;
+    }
+    printk("virtio_blk_init start\n");
+    uint16_t irq_registered = 0;	// 已登记过处理函数的中断线
+    for (; pdev != NULL && vblk_cnt < VIRTIO_BLK_MAX_DISKS; \
+         pdev = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, pdev)) {
+        struct virtio_blk* vblk = &vblks[vblk_cnt];
+        sprintf(vblk->disk.name, "vd%c", 'a' + vblk_cnt);
+        // 没有可用的中断线就无法得知请求完成, 不启用设备
+        if (pdev->irq_line >= PCI_IRQ_LINES) {
+            printk("    %s has no usable irq line (%d), skipped\n", vblk->disk.name, pdev->irq_line);
+            continue;
+        }
+        if (!virtio_blk_probe(vblk, pdev)) {
+            printk("    %s probe failed\n", vblk->disk.name);
+            continue;
+        }
+        vblk_cnt++;
+        if (!(irq_registered & (1 << pdev->irq_line))) {
+            irq_registered |= 1 << pdev->irq_line;
+            pci_irq_register(pdev->irq_line, intr_virtio_blk_handler);
+        }
+        struct disk* hd = &vblk->disk;
+        printk("    disk %s info:\n", hd->name);
+        printk("    SECTORS: %d\n", hd->sectors);
+        printk("    CAPACITY: %dMB\n", hd->sectors / 2048);
+        printk("    QUEUE: %d descs, depth %d\n", vblk->num, vblk->depth);
+
+        blk_queue_init(hd, virtio_blk_transfer, VIRTIO_BLK_MAX_SECS, vblk->max_segs, vblk->depth);
+        disk_partition_scan(hd);
+    }
+    printk("virtio_blk_init done\n");
+}
@@ -0,0 +1,38 @@
+#ifndef __DEVICE_VIRTIO_BLK_H
+#define __DEVICE_VIRTIO_BLK_H
+#include "stdint.h"
+#include "global.h"
+#include "sync.h"
+#include "ide.h"
+#include "pci.h"
+#include "virtio.h"
+
+#define VIRTIO_BLK_MAX_DISKS 4
+#define VIRTIO_BLK_DEPTH     8	// 每块盘同时在途的请求数上限, 即派发线程数
+
+struct virtio_blk_hdr;
+
+// 一块 virtio 硬盘, 只有一个请求队列
+// 描述符表按槽位平分, 每个派发线程占一个槽位, 槽位内的描述符固定串成一条链
+struct virtio_blk {
+    struct pci_dev* pdev;
+    uint16_t io_base;                     // 传统接口寄存器的起始端口号
+    uint16_t num;                         // 队列的描述符数
+    struct vring_desc* desc;
+    struct vring_avail* avail;
+    struct vring_used* used;
+    uint16_t last_used;                   // 已处理到的已用环位置
+    uint32_t depth;                       // 槽位数
+    uint32_t slot_descs;                  // 每个槽位的描述符数
+    uint32_t max_segs;                    // 一个请求最多的数据段数
+    struct virtio_blk_hdr* hdrs;          // 各槽位的请求头
+    volatile uint8_t* status;             // 各槽位的完成状态, 由设备写入
+    uint32_t hdr_paddr;                   // hdrs 和 status 所在页的物理地址
+    struct spinlock lock;                 // 保护可用环、已用环和 free_slots, 中断处理程序也会获取
+    uint32_t free_slots;                  // 空闲槽位的位图
+    struct semaphore slot_done[VIRTIO_BLK_DEPTH];
+    struct disk disk;
+};
+
+void virtio_blk_init(void);
+#endif
@@ -165,7 +165,7 @@ bool sync_dir_entry(struct dir* parent_dir, struct dir_entry* p_de, void* io_buf
                 block_lba = block_bitmap_alloc(cur_part);
                 if (block_lba == -1) {
                     block_bitmap_idx = dir_inode->i_sectors[12] - cur_part->sb->data_start_lba;
-                    bitmap_set(&cur_part->block_bitmap, block_bitmap_idx, 0);
+                    bitmap_free(cur_part, block_bitmap_idx, BLOCK_BITMAP);
                     dir_inode->i_sectors[12] = 0;
                     printk("alloc block bitmap for sync_dir_entry failed\n");
                     return false;
@@ -274,7 +274,7 @@ bool delete_dir_entry(struct partition* part, struct dir* pdir, uint32_t inode_n
         if (dir_entry_cnt == 1 && !is_dir_first_block) {
             // a 在块位图中回收该块
             uint32_t block_bitmap_idx = all_blocks[block_idx] - part->sb->data_start_lba;
-            bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
+            bitmap_free(part, block_bitmap_idx, BLOCK_BITMAP);
             bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
 
             // b 将块地址从数组 i_sectors 或索引表中去掉
@@ -298,7 +298,7 @@ bool delete_dir_entry(struct partition* part, struct dir* pdir, uint32_t inode_n
                 } else { // 间接索引表中就当前这 1 个间接块, 直接把间接块索引表所在的块回收, 然后擦除间接索引表块地址
                     // 回收间接索引表所在的块
                     block_bitmap_idx = dir_inode->i_sectors[12] - part->sb->data_start_lba;
-                    bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
+                    bitmap_free(part, block_bitmap_idx, BLOCK_BITMAP);
                     bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
 
                     // 将间接索引表地址清 0
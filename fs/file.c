@@ -10,6 +10,8 @@
 #include "string.h"
 #include "super_block.h"
 #include "thread.h"
+#include "blk.h"
+#include "workqueue.h"
 
 // 文件表
 struct file file_table[MAX_FILE_OPEN];
@@ -33,7 +35,7 @@ int32_t get_free_slot_in_global(void) {
 // 将全局描述符下标安装到进程或线程自己的文件描述符数组fd_table中
 // 成功返回下标, 失败返回 -1
 int32_t pcb_fd_install(int32_t globa_fd_idx) {
-    struct task_struct* cur = running_thread();
+    struct task_struct* cur = running_thread()->group_leader;
     uint8_t local_fd_idx = 3;
     while (local_fd_idx < MAX_FILES_OPEN_PER_PROC) {
         if (cur->fd_table[local_fd_idx] == -1) {
@@ -51,46 +53,99 @@ int32_t pcb_fd_install(int32_t globa_fd_idx) {
 
 // 分配一个 inode, 返回 inode 号
 int32_t inode_bitmap_alloc(struct partition* part) {
+    write_lock(&part->bitmap_lock);
     int32_t bit_idx = bitmap_scan(&part->inode_bitmap, 1);
-    if (bit_idx == -1) {
-        return -1;
+    if (bit_idx != -1) {
+        bitmap_set(&part->inode_bitmap, bit_idx, 1);
     }
-    bitmap_set(&part->inode_bitmap, bit_idx, 1);
+    write_unlock(&part->bitmap_lock);
     return bit_idx;
 }
 
 // 分配 1 个扇区, 返回其扇区地址
 int32_t block_bitmap_alloc(struct partition* part) {
+    write_lock(&part->bitmap_lock);
     int32_t bit_idx = bitmap_scan(&part->block_bitmap, 1);
+    if (bit_idx != -1) {
+        bitmap_set(&part->block_bitmap, bit_idx, 1);
+    }
+    write_unlock(&part->bitmap_lock);
     if (bit_idx == -1) {
         return -1;
     }
-    bitmap_set(&part->block_bitmap, bit_idx, 1);
     // 和 inode_bitmap_malloc 不同, 此处返回的不是位索引
     // 而是具体可用的扇区地址
     return (part->sb->data_start_lba + bit_idx);
 }
 
-// 将内存中 bitmap 第 bit_idx 位所在的 512 字节同步到硬盘
+// 记下位图中第 bit_idx 位所在的扇区, 把 [*first, *last] 扩大到包含它
+static void bitmap_mark_dirty(uint32_t bit_idx, uint32_t* first, uint32_t* last) {
+    uint32_t sec = bit_idx / (BLOCK_SIZE * 8);
+    if (sec < *first) {
+        *first = sec;
+    }
+    if (sec > *last) {
+        *last = sec;
+    }
+}
+
+// 在 system_wq 中把 part 两种位图待写回的扇区写到硬盘, 每种位图的脏扇区范围一次写出
+static void bitmap_writeback(void* arg) {
+    struct partition* part = arg;
+    uint8_t btmp;
+    for (btmp = INODE_BITMAP; btmp <= BLOCK_BITMAP; btmp++) {
+        // 先取走范围再写, 写的期间又改动的扇区会重新提交本工作, 下次再写
+        enum intr_status old_status = spin_lock_irqsave(&part->dirty_lock);
+        uint32_t first = part->dirty_first[btmp], last = part->dirty_last[btmp];
+        part->dirty_first[btmp] = 0xffffffff;
+        part->dirty_last[btmp] = 0;
+        spin_unlock_irqrestore(&part->dirty_lock, old_status);
+        if (first > last) {
+            continue;
+        }
+
+        uint32_t sec_lba;
+        uint8_t* bits;
+        if (btmp == INODE_BITMAP) {
+            sec_lba = part->sb->inode_bitmap_lba;
+            bits = part->inode_bitmap.bits;
+        } else {
+            sec_lba = part->sb->block_bitmap_lba;
+            bits = part->block_bitmap.bits;
+        }
+        // 写盘期间别人只能读位图, 不能改动这些扇区
+        read_lock(&part->bitmap_lock);
+        ide_write(part->my_disk, sec_lba + first, bits + first * BLOCK_SIZE, last - first + 1);
+        read_unlock(&part->bitmap_lock);
+    }
+}
+
+// 挂载分区时初始化位图的推迟写回
+void bitmap_writeback_init(struct partition* part) {
+    work_init(&part->bitmap_work, bitmap_writeback, part);
+    spin_init(&part->dirty_lock);
+    part->dirty_first[INODE_BITMAP] = part->dirty_first[BLOCK_BITMAP] = 0xffffffff;
+    part->dirty_last[INODE_BITMAP] = part->dirty_last[BLOCK_BITMAP] = 0;
+}
+
+// 把内存中 bitmap 第 bit_idx 位所在的 512 字节记为待写回, 由 system_wq 推迟写到硬盘
+// 系统调用不再等位图写盘, 同一扇区在写回前的多次改动也只写一次
 void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp) {
-    // 本 inode 索引相对于位图的扇区偏移量
-    uint32_t off_sec = bit_idx / 4096;
-    // 本 inode 索引相对于位图的字节偏移量
-    uint32_t off_size = off_sec * BLOCK_SIZE;
-    uint32_t sec_lba;
-    uint8_t* bitmap_off;
-
-    switch (btmp) {
-        case INODE_BITMAP:
-            sec_lba = part->sb->inode_bitmap_lba + off_sec;
-            bitmap_off = part->inode_bitmap.bits + off_size;
-            break;
-        case BLOCK_BITMAP:
-            sec_lba = part->sb->block_bitmap_lba + off_sec;
-            bitmap_off = part->block_bitmap.bits + off_size;
-            break;
+    enum intr_status old_status = spin_lock_irqsave(&part->dirty_lock);
+    bitmap_mark_dirty(bit_idx, &part->dirty_first[btmp], &part->dirty_last[btmp]);
+    spin_unlock_irqrestore(&part->dirty_lock, old_status);
+    queue_work(system_wq, &part->bitmap_work);
+}
+
+// 回收 bitmap 的第 bit_idx 位, 只改内存, 需要时由调用者再 bitmap_sync
+void bitmap_free(struct partition* part, uint32_t bit_idx, uint8_t btmp) {
+    write_lock(&part->bitmap_lock);
+    if (btmp == INODE_BITMAP) {
+        bitmap_set(&part->inode_bitmap, bit_idx, 0);
+    } else {
+        bitmap_set(&part->block_bitmap, bit_idx, 0);
     }
-    ide_write(part->my_disk, sec_lba, bitmap_off, 1);
+    write_unlock(&part->bitmap_lock);
 }
 
 // 创建文件, 若成功则返回文件描述符, 否则返回 -1
@@ -160,8 +215,10 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
     bitmap_sync(cur_part, inode_no, INODE_BITMAP);
 
     // e 将创建的文件 inode 添加到 open_inodes 链表
+    write_lock(&cur_part->inode_lock);
     list_push(&cur_part->open_inodes, &new_file_inode->inode_tag);
     new_file_inode->i_open_cnts = 1;
+    write_unlock(&cur_part->inode_lock);
 
     sys_free(io_buf);
     return pcb_fd_install(fd_idx);
@@ -178,7 +235,7 @@ rollback:
         case 1:
             // 如果新文件的 inode 创建失败
             // 之前位图中分配的 inode_no 也要恢复
-            bitmap_set(&cur_part->inode_bitmap, inode_no, 0);
+            bitmap_free(cur_part, inode_no, INODE_BITMAP);
             break;
     }
     sys_free(io_buf);
@@ -227,6 +284,9 @@ int32_t file_close(struct file* file) {
 
 // 把 buf 中的 count 个字节写入 file, 成功则返回写入的字节数, 失败则返回 -1
 int32_t file_write(struct file* file, const void* buf, uint32_t count) {
+    if (count == 0) {
+        return 0;
+    }
     if ((file->fd_inode->i_size + count) > (BLOCK_SIZE * 140)) { // 文件目前最大只支持 512*140=71680 字节
         printk("exceed max file_size 71680 bytes, write file failed\n");
         return -1;
@@ -254,6 +314,7 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
     uint32_t chunk_size;	        // 每次写入硬盘的数据块大小
     int32_t indirect_block_table;   // 用来获取一级间接表地址
     uint32_t block_idx;		        // 块索引
+    uint32_t btmp_sec_first = 0xffffffff, btmp_sec_last = 0; // 块位图中被改动的扇区范围
 
     // 判断文件是否是第一次写, 如果是, 先为其分配一个块
     if (file->fd_inode->i_sectors[0] == 0) {
@@ -264,10 +325,10 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
         }
         file->fd_inode->i_sectors[0] = block_lba;
 
-        // 每分配一个块就将位图同步到硬盘
+        // 记下位图中被改动的扇区, 分配完后再统一同步到硬盘
         block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
         ASSERT(block_bitmap_idx != 0);
-        bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
+        bitmap_mark_dirty(block_bitmap_idx, &btmp_sec_first, &btmp_sec_last);
     }
     
     // 写入 count 个字节前, 该文件已经占用的块数
@@ -313,9 +374,9 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
                 ASSERT(file->fd_inode->i_sectors[block_idx] == 0);
                 file->fd_inode->i_sectors[block_idx] = all_blocks[block_idx] = block_lba;
 
-                // 每分配一个块就将位图同步到硬盘
+                // 记下位图中被改动的扇区
                 block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
+                bitmap_mark_dirty(block_bitmap_idx, &btmp_sec_first, &btmp_sec_last);
 
                 block_idx++; // 下一个分配的新扇区
             }
@@ -336,6 +397,7 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
             ASSERT(file->fd_inode->i_sectors[12] == 0);
             // 分配一级间接块索引表
             indirect_block_table = file->fd_inode->i_sectors[12] = block_lba;
+            bitmap_mark_dirty(block_lba - cur_part->sb->data_start_lba, &btmp_sec_first, &btmp_sec_last);
 
             block_idx = file_has_used_blocks;
             while (block_idx < file_will_use_blocks) {
@@ -352,9 +414,9 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
                     all_blocks[block_idx] = block_lba;
                 }
 
-                // 每分配一个块就将位图同步到硬盘
+                // 记下位图中被改动的扇区
                 block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
+                bitmap_mark_dirty(block_bitmap_idx, &btmp_sec_first, &btmp_sec_last);
 
                 block_idx++; // 下一个扇区
             }
@@ -376,32 +438,64 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
                 }
                 all_blocks[block_idx++] = block_lba;
 
-                // 每分配一个块就将位图同步到硬盘
+                // 记下位图中被改动的扇区
                 block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
+                bitmap_mark_dirty(block_bitmap_idx, &btmp_sec_first, &btmp_sec_last);
             }
             ide_write(cur_part->my_disk, indirect_block_table, all_blocks+12, 1); 
         }
     }
 
+    // 位图中被改动的扇区范围交给 system_wq 一次写回, 而不是每分配一个块写一次
+    if (btmp_sec_first != 0xffffffff) {
+        bitmap_sync(cur_part, btmp_sec_first * BLOCK_SIZE * 8, BLOCK_BITMAP);
+        bitmap_sync(cur_part, btmp_sec_last * BLOCK_SIZE * 8, BLOCK_BITMAP);
+    }
+
+    // 每个数据块用各自的缓冲区和请求, 全部提交后再一起等待, 相邻的块由请求队列合并成一条命令
+    uint32_t first_sec_idx = file->fd_inode->i_size / BLOCK_SIZE;
+    uint32_t data_blocks = (file->fd_inode->i_size + count - 1) / BLOCK_SIZE - first_sec_idx + 1;
+    uint8_t* data_buf = sys_malloc(data_blocks * BLOCK_SIZE);
+    struct blk_request* reqs = kmalloc(data_blocks * sizeof(struct blk_request));
+    if (data_buf == NULL || reqs == NULL) {
+        printk("file_write: malloc for data_buf failed\n");
+        if (data_buf != NULL) {
+            sys_free(data_buf);
+        }
+        if (reqs != NULL) {
+            kfree(reqs);
+        }
+        sys_free(all_blocks);
+        sys_free(io_buf);
+        return -1;
+    }
+    // 新分配的块和末块文件尾之后的部分都写 0, 不能把堆里残留的内容写进文件
+    memset(data_buf, 0, data_blocks * BLOCK_SIZE);
+    struct blk_plug plug;
+    blk_plug_init(&plug);
+
     bool first_write_block = true; // 含有剩余空间的扇区标识
     // 块地址已经收集到 all_blocks 中, 下面开始写数据
     file->fd_pos = file->fd_inode->i_size - 1;
     while (bytes_written < count) {
-        memset(io_buf, 0, BLOCK_SIZE);
         sec_idx = file->fd_inode->i_size / BLOCK_SIZE;
         sec_lba = all_blocks[sec_idx];
         sec_off_bytes = file->fd_inode->i_size % BLOCK_SIZE;
         sec_left_bytes = BLOCK_SIZE - sec_off_bytes;
+        uint8_t* block_buf = data_buf + (sec_idx - first_sec_idx) * BLOCK_SIZE;
 
         // 判断此次写入硬盘的数据大小
         chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes;
+        // 只有文件尾所在的块已有数据, 要先读出来; 文件尾恰在块边界时这是新块, 保持全 0
         if (first_write_block) {
-            ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
+            if (sec_off_bytes != 0) {
+                ide_read(cur_part->my_disk, sec_lba, block_buf, 1);
+            }
             first_write_block = false;
         }
-        memcpy(io_buf+sec_off_bytes, src, chunk_size);
-        ide_write(cur_part->my_disk, sec_lba, io_buf, 1);
+        memcpy(block_buf+sec_off_bytes, src, chunk_size);
+        blk_request_init(&reqs[sec_idx - first_sec_idx], cur_part->my_disk, sec_lba, block_buf, 1, true);
+        blk_submit(&plug, &reqs[sec_idx - first_sec_idx]);
         printk("file write at lba 0x%x\n", sec_lba);
 
         src += chunk_size; // 将指针推移到下个新数据
@@ -410,6 +504,14 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
         bytes_written += chunk_size;
         size_left -= chunk_size;
     }
+    blk_unplug(&plug);
+    for (block_idx = 0; block_idx < data_blocks; block_idx++) {
+        if (!blk_wait(&reqs[block_idx])) {
+            PANIC("file_write: write data block failed");
+        }
+    }
+    kfree(reqs);
+    sys_free(data_buf);
     inode_sync(cur_part, file->fd_inode, io_buf);
     sys_free(all_blocks);
     sys_free(io_buf);
@@ -16,6 +16,11 @@
 #include "super_block.h"
 #include "pipe.h"
 
+// 启动时挂载的分区, 可在编译时用 -DROOT_PART=\"ram0\" 改为内存盘等其它分区
+#ifndef ROOT_PART
+#define ROOT_PART "sdb1"
+#endif
+
 struct partition* cur_part; // 默认情况下操作的是哪个分区
 
 // 在分区链表中找到名为 part_name 的分区, 并将其指针赋值给 cur_part
@@ -61,6 +66,10 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
         ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);
 
         list_init(&cur_part->open_inodes);
+        rwlock_init(&cur_part->dir_lock, "dir_lock");
+        rwlock_init(&cur_part->inode_lock, "inode_lock");
+        rwlock_init(&cur_part->bitmap_lock, "bitmap_lock");
+        bitmap_writeback_init(cur_part);
         printk("mount %s done!\n", part->name);
 
         return true; // 使 list_traversal 停止遍历
@@ -212,6 +221,7 @@ int32_t path_depth_cnt(char* pathname) {
 }
 
 // 搜索文件 pathname, 若找到则返回其 inode 号, 否则返回 -1
+// 调用者须持有 cur_part->dir_lock, 只是查找时持读锁即可
 static int search_file(const char* pathname, struct path_search_record* searched_record) {
     // 如果待查找的是根目录, 为避免下面无用的查找, 直接返回已知根目录信息
     if (!strcmp(pathname, "/") || !strcmp(pathname, "/.") || 
@@ -278,8 +288,8 @@ static int search_file(const char* pathname, struct path_search_record* searched
     return dir_e.i_no;
 }
 
-// 打开或创建文件成功后, 返回文件描述符, 否则返回 -1
-int32_t sys_open(const char* pathname, uint8_t flags) {
+// sys_open 的实现, 调用者持有 dir_lock
+static int32_t open_locked(const char* pathname, uint8_t flags) {
     // 对目录要用 dir_open, 这里只有 open 文件
     if (pathname[strlen(pathname) - 1] == '/') {
         printk("can`t open a directory %s\n", pathname);
@@ -340,9 +350,26 @@ int32_t sys_open(const char* pathname, uint8_t flags) {
     return fd;
 }
 
+// 打开或创建文件成功后, 返回文件描述符, 否则返回 -1
+int32_t sys_open(const char* pathname, uint8_t flags) {
+    // 创建文件要在查找和添加目录项之间独占目录, 只是打开则与其它查找并行
+    int32_t fd;
+    if (flags & O_CREAT) {
+        write_lock(&cur_part->dir_lock);
+        fd = open_locked(pathname, flags);
+        write_unlock(&cur_part->dir_lock);
+    } else {
+        read_lock(&cur_part->dir_lock);
+        fd = open_locked(pathname, flags);
+        read_unlock(&cur_part->dir_lock);
+    }
+    return fd;
+}
+
 // 将文件描述符转化为文件表的下标
 uint32_t fd_local2global(uint32_t local_fd) {
-    struct task_struct* cur = running_thread();
+    // 同一进程的线程共用主线程的文件描述符数组
+    struct task_struct* cur = running_thread()->group_leader;
     int32_t global_fd = cur->fd_table[local_fd];
     ASSERT(global_fd >= 0 && global_fd < MAX_FILE_OPEN);
     return (uint32_t)global_fd;
@@ -363,7 +390,7 @@ int32_t sys_close(int32_t fd) {
         } else {
             ret = file_close(&file_table[global_fd]);
         }
-        running_thread()->fd_table[fd] = -1; // 使该文件描述符位可用
+        running_thread()->group_leader->fd_table[fd] = -1; // 使该文件描述符位可用
     }
     return ret;
 }
@@ -413,8 +440,8 @@ int32_t sys_read(int32_t fd, void* buf, uint32_t count) {
         } else {
             char* buffer = buf;
             uint32_t bytes_read = 0;
-            while (bytes_read < count) {
-                *buffer = ioq_getchar(&kbd_buf);
+            // 等键盘输入时所在进程若要退出就不再等, 由系统调用出口结束本线程
+            while (bytes_read < count && ioq_getchar_interruptible(&kbd_buf, buffer)) {
                 bytes_read++;
                 buffer++;
             }
@@ -460,8 +487,8 @@ int32_t sys_lseek(int32_t fd, int32_t offset, uint8_t whence) {
     return pf->fd_pos;
 }
 
-// 删除文件(非目录), 成功返回 0, 失败返回 -1
-int32_t sys_unlink(const char* pathname) {
+// sys_unlink 的实现, 调用者持有 dir_lock 的写锁
+static int32_t unlink_locked(const char* pathname) {
     ASSERT(strlen(pathname) < MAX_PATH_LEN);
 
     // 先检查待删除的文件是否存在
@@ -510,8 +537,16 @@ int32_t sys_unlink(const char* pathname) {
     return 0; // 成功删除文件
 }
 
-// 创建目录 pathname, 成功返回 0, 失败返回 -1
-int32_t sys_mkdir(const char* pathname) {
+// 删除文件(非目录), 成功返回 0, 失败返回 -1
+int32_t sys_unlink(const char* pathname) {
+    write_lock(&cur_part->dir_lock);
+    int32_t ret = unlink_locked(pathname);
+    write_unlock(&cur_part->dir_lock);
+    return ret;
+}
+
+// sys_mkdir 的实现, 调用者持有 dir_lock 的写锁
+static int32_t mkdir_locked(const char* pathname) {
     uint8_t rollback_step = 0; // 用于操作失败时回滚各资源状态
     void* io_buf = sys_malloc(SECTOR_SIZE*2);
     if (io_buf == NULL) {
@@ -617,7 +652,7 @@ int32_t sys_mkdir(const char* pathname) {
 rollback:
     switch (rollback_step) {
         case 2:
-            bitmap_set(&cur_part->inode_bitmap, inode_no, 0);
+            bitmap_free(cur_part, inode_no, INODE_BITMAP);
         case 1:
             dir_close(searched_record.parent_dir);
             break;
@@ -626,6 +661,14 @@ rollback:
     return -1;
 }
 
+// 创建目录 pathname, 成功返回 0, 失败返回 -1
+int32_t sys_mkdir(const char* pathname) {
+    write_lock(&cur_part->dir_lock);
+    int32_t ret = mkdir_locked(pathname);
+    write_unlock(&cur_part->dir_lock);
+    return ret;
+}
+
 // 目录打开成功后返回目录指针, 失败返回 NULL
 struct dir* sys_opendir(const char* name) {
     ASSERT(strlen(name) < MAX_PATH_LEN);
@@ -637,6 +680,7 @@ struct dir* sys_opendir(const char* name) {
     // 先检查待打开的目录是否存在
     struct path_search_record searched_record;
     memset(&searched_record, 0, sizeof(struct path_search_record));
+    read_lock(&cur_part->dir_lock);
     int inode_no = search_file(name, &searched_record);
     struct dir* ret = NULL;
     if (inode_no == -1) { // 找不到目录
@@ -649,6 +693,7 @@ struct dir* sys_opendir(const char* name) {
         }
     }
     dir_close(searched_record.parent_dir);
+    read_unlock(&cur_part->dir_lock);
     return ret;
 }
 
@@ -665,7 +710,10 @@ int32_t sys_closedir(struct dir* dir) {
 // 读取目录 dir 的 1 个目录项, 成功后返回其目录项地址, 到目录尾时或出错时返回 NULL
 struct dir_entry* sys_readdir(struct dir* dir) {
     ASSERT(dir != NULL);
-    return dir_read(dir);
+    read_lock(&cur_part->dir_lock);
+    struct dir_entry* dir_e = dir_read(dir);
+    read_unlock(&cur_part->dir_lock);
+    return dir_e;
 }
 
 // 把目录 dir 的指针 dir_pos 置 0
@@ -678,6 +726,7 @@ int32_t sys_rmdir(const char* pathname) {
     // 先检查待删除的文件是否存在
     struct path_search_record searched_record;
     memset(&searched_record, 0, sizeof(struct path_search_record));
+    write_lock(&cur_part->dir_lock);
     int inode_no = search_file(pathname, &searched_record);
     ASSERT(inode_no != 0);
     int retval = -1; // 默认返回值
@@ -699,6 +748,7 @@ int32_t sys_rmdir(const char* pathname) {
         }
     }
     dir_close(searched_record.parent_dir);
+    write_unlock(&cur_part->dir_lock);
     return retval;
 }
 
@@ -768,7 +818,7 @@ char* sys_getcwd(char* buf, uint32_t size) {
         return NULL;
     }
 
-    struct task_struct* cur_thread = running_thread();
+    struct task_struct* cur_thread = running_thread()->group_leader;
     int32_t parent_inode_nr = 0;
     int32_t child_inode_nr = cur_thread->cwd_inode_nr;
     ASSERT(child_inode_nr >= 0 && child_inode_nr < 4096); // 最大支持 4096 个 inode
@@ -785,14 +835,17 @@ char* sys_getcwd(char* buf, uint32_t size) {
 
     // 从下往上逐层找父目录, 直到找到根目录为止
     // 当 child_inode_nr 为 0 时停止
+    read_lock(&cur_part->dir_lock);
     while (child_inode_nr) {
         parent_inode_nr = get_parent_dir_inode_nr(child_inode_nr, io_buf);
         if (get_child_dir_name(parent_inode_nr, child_inode_nr, full_path_reverse, io_buf) == -1) {
+            read_unlock(&cur_part->dir_lock);
             sys_free(io_buf);
             return NULL;
         }
         child_inode_nr = parent_inode_nr;
     }
+    read_unlock(&cur_part->dir_lock);
     ASSERT(strlen(full_path_reverse) <= size);
     // 至此 full_path_reverse 中的路径是反着的
     char* last_slash; // 字符串中最后一个斜杆地址
@@ -811,16 +864,18 @@ int32_t sys_chdir(const char* path) {
     int32_t ret = -1;
     struct path_search_record searched_record;
     memset(&searched_record, 0, sizeof(struct path_search_record));
+    read_lock(&cur_part->dir_lock);
     int inode_no = search_file(path, &searched_record);
     if (inode_no != -1) {
         if (searched_record.file_type == FT_DIRECTORY) {
-            running_thread()->cwd_inode_nr = inode_no;
+            running_thread()->group_leader->cwd_inode_nr = inode_no;
             ret = 0;
         } else {
             printk("sys_chdir: %s is regular file or other!\n", path);
         }
     }
     dir_close(searched_record.parent_dir);
+    read_unlock(&cur_part->dir_lock);
     return ret;
 }
 
@@ -837,6 +892,7 @@ int32_t sys_stat(const char* path, struct stat* buf) {
     int32_t ret = -1; // 默认返回值
     struct path_search_record searched_record;
     memset(&searched_record, 0, sizeof(struct path_search_record));
+    read_lock(&cur_part->dir_lock);
     int inode_no = search_file(path, &searched_record);
     if (inode_no != -1) {
         struct inode* obj_inode = inode_open(cur_part, inode_no);
@@ -849,6 +905,7 @@ int32_t sys_stat(const char* path, struct stat* buf) {
         printk("sys_stat: %s not found\n", path);
     }
     dir_close(searched_record.parent_dir);
+    read_unlock(&cur_part->dir_lock);
     return ret;
 }
 
@@ -868,16 +925,36 @@ void sys_help(void) {
        rm: remove a regular file\n\
        pwd: show current work directory\n\
        ps: show process information\n\
+       lockstat: show lock and rwlock contention and priority inheritance statistics\n\
+       iostat: show disk and partition i/o statistics, -h for latency histograms\n\
        clear: clear screen\n\
  shortcut key:\n\
        ctrl+l: clear screen\n\
        ctrl+u: clear input\n\n");
 }
 
+// 检查分区上是否有文件系统, 没有就格式化, arg 为读超级块用的缓冲区
+// 返回 false 是为了让 list_traversal 继续遍历
+static bool partition_check_fs(struct list_elem* pelem, int arg) {
+    struct partition* part = elem2entry(struct partition, part_tag, pelem);
+    struct super_block* sb_buf = (struct super_block*)arg;
+    memset(sb_buf, 0, SECTOR_SIZE);
+    // 读出分区的超级块, 根据魔数是否正确来判断是否存在文件系统
+    ide_read(part->my_disk, part->start_lba+1, sb_buf, 1);
+
+    if (sb_buf->magic == 0x19590318) {
+        printk("%s has filesystem\n", part->name);
+    } else { // 其它文件系统不支持, 一律按无文件系统处理
+        printk("formatting %s's partition %s......\n",
+            part->my_disk->name, part->name);
+        partition_format(part);
+    }
+    return false;
+}
+
 // 在磁盘上搜索文件系统, 若没有则格式化分区创建文件系统
+// partition_list 中是各磁盘驱动扫描到的分区, 内核所在的裸盘不在其中
 void filesys_init() {
-    uint8_t channel_no = 0, dev_no, part_idx = 0;
-
     // sb_buf 用来存储从硬盘上读入的超级块
     struct super_block* sb_buf = (struct super_block*)sys_malloc(SECTOR_SIZE);
 
@@ -885,43 +962,11 @@ void filesys_init() {
         PANIC("alloc memory failed!");
     }
     printk("searching filesystem......\n");
-    while (channel_no < channel_cnt) {
-        dev_no = 0;
-        while (dev_no < 2) {
-            if (dev_no == 0) { // 跳过裸盘 hd60M.img
-                dev_no++;
-                continue;
-            }
-            struct disk* hd = &channels[channel_no].devices[dev_no];
-            struct partition* part = hd->prim_parts;
-            while (part_idx < 12) { // 4 个主分区 + 8 个逻辑分区
-                if (part_idx == 4) { // 开始处理逻辑分区
-                    part = hd->logic_parts;
-                }
-                if (part->sec_cnt != 0) { // 如果分区存在
-                    memset(sb_buf, 0, SECTOR_SIZE);
-                    // 读出分区的超级块, 根据魔数是否正确来判断是否存在文件系统
-                    ide_read(hd, part->start_lba+1, sb_buf, 1);
-
-                    if (sb_buf->magic == 0x19590318) {
-                        printk("%s has filesystem\n", part->name);
-                    } else { // 其它文件系统不支持, 一律按无文件系统处理
-                        printk("formatting %s's partition %s......\n",
-                            hd->name, part->name);
-                        partition_format(part);
-                    }
-                }
-                part_idx++;
-                part++; // 下一分区
-            }
-            dev_no++; // 下一磁盘
-        }
-        channel_no++; // 下一通道
-    }
+    list_traversal(&partition_list, partition_check_fs, (int)sb_buf);
     sys_free(sb_buf);
 
     // 确定默认操作的分区
-    char default_part[8] = "sdb1";
+    char default_part[8] = ROOT_PART;
     // 挂载分区
     list_traversal(&partition_list, mount_partition, (int)default_part);
 
@@ -9,6 +9,7 @@
 #include "stdio-kernel.h"
 #include "string.h"
 #include "super_block.h"
+#include "atomic.h"
 
 // 用来存储 inode 位置
 struct inode_position {
@@ -82,19 +83,37 @@ void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
     }
 }
 
-// 根据 i 结点号返回相应的 i 结点
-struct inode* inode_open(struct partition* part, uint32_t inode_no) {
-    // 先在已打开的 inode 链表中找 inode, 此链表是为提速创建的缓冲区
+// 在已打开的 inode 链表中找 inode_no 号 inode, 调用者须持有 inode_lock
+static struct inode* inode_lookup(struct partition* part, uint32_t inode_no) {
     struct list_elem* elem = part->open_inodes.head.next;
-    struct inode* inode_found;
     while (elem != &part->open_inodes.tail) {
-        inode_found = elem2entry(struct inode, inode_tag, elem);
+        struct inode* inode_found = elem2entry(struct inode, inode_tag, elem);
         if (inode_found->i_no == inode_no) {
-            inode_found->i_open_cnts++;
             return inode_found;
         }
         elem = elem->next;
     }
+    return NULL;
+}
+
+// 释放 inode_open 在内核内存池中分配的 inode
+static void inode_free(struct inode* inode) {
+    kfree(inode);
+}
+
+// 根据 i 结点号返回相应的 i 结点
+struct inode* inode_open(struct partition* part, uint32_t inode_no) {
+    // 先在已打开的 inode 链表中找 inode, 此链表是为提速创建的缓冲区
+    // 只持读锁, 多个线程可以同时查找, 打开计数用原子加
+    read_lock(&part->inode_lock);
+    struct inode* inode_found = inode_lookup(part, inode_no);
+    if (inode_found != NULL) {
+        atomic_inc(&inode_found->i_open_cnts);
+    }
+    read_unlock(&part->inode_lock);
+    if (inode_found != NULL) {
+        return inode_found;
+    }
 
     // 由于 open_inodes 链表中找不到, 从硬盘读入此 inode 并加入此链表
     struct inode_position inode_pos;
@@ -103,15 +122,9 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
     // 包括 inode 所在扇区地址和扇区内的字节偏移量
     inode_locate(part, inode_no, &inode_pos);
 
-    // 为使通过 sys_malloc 创建的新 inode 被所有任务共享
-    // 需要将 inode 置于内核空间, 故需要临时将 cur_pbc->pgdir 置为 NULL
-    struct task_struct* cur = running_thread();
-    uint32_t* cur_pagedir_bak = cur->pgdir;
-    cur->pgdir = NULL;
-    // 以上三行代码完成后下面分配的内存将位于内核区
-    inode_found = (struct inode*)sys_malloc(sizeof(struct inode));
-    // 恢复 pgdir
-    cur->pgdir = cur_pagedir_bak;
+    // 新 inode 要被所有任务共享, 须分配在内核堆中
+    // 不能再靠临时把 pgdir 置为 NULL 来做: 期间若被调度, 会被当成内核线程而沿用别人的页目录
+    inode_found = (struct inode*)kmalloc(sizeof(struct inode));
 
     char* inode_buf;
     if (inode_pos.two_sec) { // 跨扇区的情况
@@ -123,31 +136,42 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
         ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
     }
     memcpy(inode_found, inode_buf+inode_pos.off_size, sizeof(struct inode));
-    
-    list_push(&part->open_inodes, &inode_found->inode_tag);
-    inode_found->i_open_cnts = 1;
-
     sys_free(inode_buf);
+
+    // 读盘时没有持锁, 别人可能已经把同一个 inode 加入了链表
+    write_lock(&part->inode_lock);
+    struct inode* inode_raced = inode_lookup(part, inode_no);
+    if (inode_raced != NULL) {
+        inode_raced->i_open_cnts++;
+    } else {
+        list_push(&part->open_inodes, &inode_found->inode_tag);
+        inode_found->i_open_cnts = 1;
+    }
+    write_unlock(&part->inode_lock);
+
+    if (inode_raced != NULL) {
+        inode_free(inode_found);
+        return inode_raced;
+    }
     return inode_found;
 }
 
 // 关闭 inode 或减少 inode 的打开数
 void inode_close(struct inode* inode) {
     // 若没有进程再打开此文件, 将此 inode 去掉并释放空间
-    enum intr_status old_status = intr_disable();
-    if (--inode->i_open_cnts == 0) { 
+    write_lock(&cur_part->inode_lock);
+    bool last = --inode->i_open_cnts == 0;
+    if (last) { 
         // 将 inode 结点从 part->open_inodes 中去掉
         list_remove(&inode->inode_tag);
+    }
+    write_unlock(&cur_part->inode_lock);
+    if (last) {
         // inode_open 时为实现 inode 被所有进程共享
         // 已经在 sys_malloc 为 inode 分配了内核空间
         // 释放 inode 时也要确保释放的是内核内存池
-        struct task_struct* cur = running_thread();
-        uint32_t* cur_pagedir_bak = cur->pgdir;
-        cur->pgdir = NULL;
-        sys_free(inode);
-        cur->pgdir = cur_pagedir_bak;
+        inode_free(inode);
     }
-    intr_set_status(old_status);
 }
 
 // 将硬盘分区 part 上的 inode 清空
@@ -199,7 +223,7 @@ void inode_release(struct partition* part, uint32_t inode_no) {
         // 回收一级间接块表占用的扇区
         block_bitmap_idx = inode_to_del->i_sectors[12] - part->sb->data_start_lba;
         ASSERT(block_bitmap_idx > 0);
-        bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
+        bitmap_free(part, block_bitmap_idx, BLOCK_BITMAP);
         bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
     }
 
@@ -210,14 +234,14 @@ void inode_release(struct partition* part, uint32_t inode_no) {
             block_bitmap_idx = 0;
             block_bitmap_idx = all_blocks[block_idx] - part->sb->data_start_lba;
             ASSERT(block_bitmap_idx > 0);
-            bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
+            bitmap_free(part, block_bitmap_idx, BLOCK_BITMAP);
             bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
         }
         block_idx++;
     }
 
 // 2 回收该 inode 所占用的 inode
-    bitmap_set(&part->inode_bitmap, inode_no, 0);
+    bitmap_free(part, inode_no, INODE_BITMAP);
     bitmap_sync(cur_part, inode_no, INODE_BITMAP);
 
     void* io_buf = sys_malloc(1024);
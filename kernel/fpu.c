@@ -0,0 +1,187 @@
+#include "fpu.h"
+#include "thread.h"
+#include "interrupt.h"
+#include "smp.h"
+#include "print.h"
+#include "debug.h"
+
+/* 浮点/SSE 寄存器的惰性切换
+ * 任务切换时不保存也不恢复浮点状态, 只置上 CR0.TS, 新任务第一次执行浮点或 SSE 指令时
+ * 触发 #NM 异常, 才在异常处理中把它的状态装入寄存器. 这样在都不用浮点的任务之间切换没有额外开销.
+ * 任务换下时若本次运行用过浮点, 就把寄存器存回它的 task_struct, 使它迁移到别的 cpu 后仍能恢复;
+ * 寄存器中的副本继续保留, 若它回到同一 cpu 且期间无人改动寄存器, 连恢复也可省掉 */
+
+#define CR0_MP 0x00000002   // 配合 TS 使 wait/fwait 也触发 #NM
+#define CR0_EM 0x00000004   // 置位时浮点指令一律触发 #NM, 须清掉
+#define CR0_TS 0x00000008   // 任务切换标志, 置位时浮点和 SSE 指令触发 #NM
+#define CR0_NE 0x00000020   // 浮点错误以 #MF 异常报告, 而非经 8259A 的 IRQ13
+#define CR4_OSFXSR 0x00000200     // 操作系统支持 fxsave/fxrstor, 打开后才能执行 SSE 指令
+#define CR4_OSXMMEXCPT 0x00000400 // 操作系统处理 SIMD 浮点异常 #XM
+
+#define CPUID_FXSR 0x01000000  // CPUID.1:EDX[24]
+#define CPUID_SSE 0x02000000   // CPUID.1:EDX[25]
+#define MXCSR_DEFAULT 0x1f80   // 屏蔽全部 SIMD 浮点异常, 就近舍入
+
+#define NM_VECTOR 0x07
+
+static bool fpu_has_fxsr;  // 是否支持 fxsave/fxrstor
+bool fpu_has_sse;          // 是否支持并已打开 SSE
+
+static inline uint32_t cr0_read(void) {
+    uint32_t cr0;
+    asm volatile ("movl %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void cr0_write(uint32_t cr0) {
+    asm volatile ("movl %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+static inline void clts(void) {
+    asm volatile ("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+    cr0_write(cr0_read() | CR0_TS);
+}
+
+// 把本 cpu 的浮点寄存器存入 fpu
+static void fpu_save(struct fpu_state* fpu) {
+    if (fpu_has_fxsr) {
+        asm volatile ("fxsave %0" : "=m" (*fpu));
+    } else {
+        // fnsave 存完后会重新初始化 fpu, 再装回去使寄存器仍可复用
+        asm volatile ("fnsave %0; frstor %0" : "+m" (*fpu));
+    }
+}
+
+// 从 fpu 恢复本 cpu 的浮点寄存器
+static void fpu_restore(struct fpu_state* fpu) {
+    if (fpu_has_fxsr) {
+        asm volatile ("fxrstor %0" : : "m" (*fpu));
+    } else {
+        asm volatile ("frstor %0" : : "m" (*fpu));
+    }
+}
+
+// 把浮点寄存器置为初始状态, 供任务第一次使用
+static void fpu_clean(void) {
+    asm volatile ("fninit");
+    if (fpu_has_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        asm volatile ("ldmxcsr %0" : : "m" (mxcsr));
+    }
+}
+
+// #NM 异常的处理函数: 把当前任务的浮点状态装入本 cpu 的寄存器
+static void intr_nm_handler(uint8_t vec_nr UNUSED) {
+    struct cpu* c = this_cpu();
+    struct task_struct* cur = running_thread();
+    clts();
+    if (c->fpu_owner == cur && cur->fpu_cpu == c->id) {
+        // 寄存器中仍是它的状态
+        return;
+    }
+    // 寄存器中其它任务的状态在其换下时已存回, 可以直接覆盖
+    if (cur->fpu_used) {
+        fpu_restore(&cur->fpu);
+    } else {
+        fpu_clean();
+        cur->fpu_used = true;
+    }
+    c->fpu_owner = cur;
+    cur->fpu_cpu = c->id;
+}
+
+/* 任务切换时由 schedule 在关中断下调用 */
+void fpu_switch(struct task_struct* cur, struct task_struct* next) {
+    struct cpu* c = this_cpu();
+    if (!(cr0_read() & CR0_TS)) {
+        // TS 已被清, 说明 cur 本次运行用过浮点, 寄存器中是它的最新状态
+        ASSERT(c->fpu_owner == cur);
+        fpu_save(&cur->fpu);
+    }
+    if (c->fpu_owner == next && next->fpu_cpu == c->id) {
+        clts();   // 寄存器中的副本仍有效, 免去一次 #NM
+    } else {
+        stts();
+    }
+}
+
+/* 确保 pthread 的浮点状态已存入其 task_struct, 须在关中断下调用
+ * fork 复制 pcb 前用它把父进程寄存器中的状态落到内存 */
+void fpu_sync(struct task_struct* pthread) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct cpu* c = this_cpu();
+    if (c->fpu_owner == pthread && !(cr0_read() & CR0_TS)) {
+        fpu_save(&pthread->fpu);
+    }
+}
+
+/* 丢弃 pthread 的浮点状态, 下次使用时从初始状态开始, 用于 exec */
+void fpu_reset(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    struct cpu* c = this_cpu();
+    if (c->fpu_owner == pthread) {
+        c->fpu_owner = NULL;
+        if (pthread == running_thread()) {
+            stts();
+        }
+    }
+    pthread->fpu_used = false;
+    pthread->fpu_cpu = NO_FPU_CPU;
+    intr_set_status(old_status);
+}
+
+/* 内核中使用浮点或 SSE 指令的代码须夹在 kernel_fpu_begin 和 kernel_fpu_end 之间
+ * 期间关中断, 不可睡眠; 当前任务的用户态浮点状态先被存回, 结束后由 #NM 重新装入 */
+static enum intr_status kernel_fpu_status[MAX_CPUS];
+
+void kernel_fpu_begin(void) {
+    enum intr_status old_status = intr_disable();
+    struct cpu* c = this_cpu();
+    struct task_struct* cur = running_thread();
+    fpu_sync(cur);
+    c->fpu_owner = NULL;
+    clts();
+    kernel_fpu_status[c->id] = old_status;
+}
+
+void kernel_fpu_end(void) {
+    struct cpu* c = this_cpu();
+    stts();
+    intr_set_status(kernel_fpu_status[c->id]);
+}
+
+/* 打开本 cpu 的浮点和 SSE 支持, 每个 cpu 都要调用一次 */
+void fpu_cpu_init(void) {
+    uint32_t cr0 = cr0_read();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    cr0_write(cr0);
+    if (fpu_has_fxsr) {
+        uint32_t cr4;
+        asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_OSFXSR;
+        if (fpu_has_sse) {
+            cr4 |= CR4_OSXMMEXCPT;
+        }
+        asm volatile ("movl %0, %%cr4" : : "r" (cr4));
+    }
+    fpu_clean();
+    stts();   // 寄存器中不属于任何任务, 第一次使用时由 #NM 装入
+}
+
+/* 检测 fxsave 和 SSE 支持, 注册 #NM 处理函数, 并打开 BSP 的浮点支持 */
+void fpu_init(void) {
+    put_str("fpu_init start\n");
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+    fpu_has_fxsr = (edx & CPUID_FXSR) != 0;
+    fpu_has_sse = fpu_has_fxsr && (edx & CPUID_SSE);
+    register_handler(NM_VECTOR, intr_nm_handler);
+    fpu_cpu_init();
+    put_str("   fxsr: "); put_int(fpu_has_fxsr);
+    put_str(" sse: "); put_int(fpu_has_sse); put_str("\n");
+    put_str("fpu_init done\n");
+}
@@ -0,0 +1,24 @@
+#ifndef __KERNEL_FPU_H
+#define __KERNEL_FPU_H
+#include "stdint.h"
+#include "global.h"
+
+#define NO_FPU_CPU 0xff // fpu_cpu 的无效值, 表示任何 cpu 的寄存器中都没有该任务的浮点状态
+
+// fxsave/fxrstor 的 512 字节保存区, 要求 16 字节对齐
+// 不支持 fxsave 时退回 fnsave, 只用到其中前 108 字节
+struct fpu_state {
+    uint8_t regs[512];
+} __attribute__ ((aligned (16)));
+
+struct task_struct;
+
+extern bool fpu_has_sse;
+void fpu_init(void);
+void fpu_cpu_init(void);
+void fpu_switch(struct task_struct* cur, struct task_struct* next);
+void fpu_sync(struct task_struct* pthread);
+void fpu_reset(struct task_struct* pthread);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+#endif
@@ -10,6 +10,14 @@
 #include "syscall-init.h"
 #include "ide.h"
 #include "fs.h"
+#include "smp.h"
+#include "fpu.h"
+#include "futex.h"
+#include "workqueue.h"
+#include "pci.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "ramdisk.h"
 
 // 初始化所有模块
 void init_all() {
@@ -18,11 +26,20 @@ void init_all() {
     mem_init();         // 初始化内存管理系统
     thread_init();      // 初始化线程相关结构
     timer_init();       // 初始化 PIT
+    smp_init();         // 解析 MP 表, 初始化 APIC
+    fpu_init();         // 打开浮点和 SSE 支持
     console_init();     // 控制台初始化
     keyboard_init();    // 键盘初始化
     tss_init();         // tss 初始化
     syscall_init();     // 初始化系统调用
+    futex_init();       // 初始化用户态同步用的 futex
+    workqueue_init();   // 创建内核工作线程
+    pci_init();         // 枚举 pci 设备
     intr_enable();      // 后面的 ide_init 需要打开中断
     ide_init();         // 初始化硬盘
+    ahci_init();        // 初始化 sata 硬盘
+    virtio_blk_init();  // 初始化 virtio 硬盘
+    ramdisk_init();     // 创建内存盘
     filesys_init();     // 初始化文件系统
+    smp_boot_aps();     // 启动其它处理器
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include "global.h"
 #include "io.h"
 #include "print.h"
+#include "apic.h"
+#include "debug.h"
 
 #define PIC_M_CTRL 0x20 // 可编程中断控制器是 8259A, 主片的控制端口是 0x20
 #define PIC_M_DATA 0x21 // 主片的数据端口是 0x21
@@ -25,6 +27,11 @@ struct gate_desc {
     uint16_t func_offset_high_word;
 };
 
+#define PCI_IRQ_SHARE_MAX 4 // 一条 pci 中断线上最多共用的设备数
+
+static uint8_t irq_apic_id; // APIC 模式下外部中断送往的 cpu
+static intr_handler pci_irq_handlers[16][PCI_IRQ_SHARE_MAX]; // 各 pci 中断线上的设备处理函数
+
 // 静态函数声明, 非必须
 static void make_idt_desc(struct gate_desc* p_gdesc, uint8_t attr, intr_handler function);
 static struct gate_desc idt[IDT_DESC_CNT]; // idt 是中断描述符表
@@ -55,6 +62,58 @@ static void pic_init(void) {
     put_str("pic_init done\n");
 }
 
+// 改用 APIC 的中断路径: 屏蔽 8259A, 由 IO APIC 把键盘和两个硬盘通道的中断送给 BSP
+// 中断向量号与 8259A 下的相同, 已注册的处理函数不用改动
+// isa_irq_pin 为各 ISA irq 接在 IO APIC 上的引脚号
+void apic_intr_init(const uint8_t* isa_irq_pin, uint8_t bsp_apic_id) {
+    static const uint8_t irqs[] = {1, 14, 15}; // 键盘, ide0, ide1
+    uint32_t i;
+
+    outb(PIC_M_DATA, 0xff);
+    outb(PIC_S_DATA, 0xff);
+    for (i = 0; i < sizeof(irqs); i++) {
+        ioapic_route(isa_irq_pin[irqs[i]], 0x20 + irqs[i], bsp_apic_id);
+    }
+    irq_apic_id = bsp_apic_id;
+    apic_irq_mode = true;
+    put_str("apic_intr_init done\n");
+}
+
+// pci 中断线可能由几个设备共用, 线上来了中断就依次调用各设备的处理函数, 由它们自己检查是否有事
+static void pci_intr_dispatch(uint8_t vec_nr) {
+    uint8_t irq = vec_nr - 0x20;
+    uint32_t idx;
+    for (idx = 0; idx < PCI_IRQ_SHARE_MAX && pci_irq_handlers[irq][idx] != NULL; idx++) {
+        ((void (*)(uint8_t))pci_irq_handlers[irq][idx])(vec_nr);
+    }
+}
+
+// 为 pci 设备登记中断线 irq 上的处理函数并打开该中断线, 向量号为 0x20 + irq
+// 8259A 下 BIOS 已把 pci 中断线设成电平触发, 解除屏蔽即可
+// APIC 模式下按 QEMU 的 MP 表, 中断线 irq 接在 IO APIC 的同号引脚上, 电平触发
+void pci_irq_register(uint8_t irq, intr_handler function) {
+    ASSERT(irq < 16);
+    uint32_t idx = 0;
+    while (pci_irq_handlers[irq][idx] != NULL) {
+        idx++;
+        ASSERT(idx < PCI_IRQ_SHARE_MAX);
+    }
+    enum intr_status old_status = intr_disable();
+    pci_irq_handlers[irq][idx] = function;
+    register_handler(0x20 + irq, pci_intr_dispatch);
+    intr_set_status(old_status);
+    if (idx > 0) {
+        return;
+    }
+    if (apic_irq_mode) {
+        ioapic_route_level(irq, 0x20 + irq, irq_apic_id);
+    } else if (irq < 8) {
+        outb(PIC_M_DATA, inb(PIC_M_DATA) & ~(1 << irq));
+    } else {
+        outb(PIC_S_DATA, inb(PIC_S_DATA) & ~(1 << (irq - 8)));
+    }
+}
+
 // 创建中断门描述符
 static void make_idt_desc(struct gate_desc* p_gdesc, uint8_t attr, intr_handler function) {
     p_gdesc->func_offset_low_word = (uint32_t)function & 0x0000FFFF;
@@ -180,6 +239,12 @@ void register_handler(uint8_t vector_no, intr_handler function) {
     idt_table[vector_no] = function;
 }
 
+// 加载 idt, 各 cpu 共用同一张 idt, AP 启动时也要调用
+void idt_load(void) {
+    uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
+    asm volatile("lidt %0" : : "m" (idt_operand));
+}
+
 // 完成有关中断的所有初始化工作
 void idt_init() {
     put_str("idt_init start\n");
@@ -187,8 +252,6 @@ void idt_init() {
     exception_init(); // 异常名初始化并注册通常的中断处理函数
     pic_init();      // 初始化 8259A
 
-    // 加载 idt
-    uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
-    asm volatile("lidt %0" : : "m" (idt_operand));
+    idt_load();
     put_str("idt_init done\n");
 }
\ No newline at end of file
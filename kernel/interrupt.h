@@ -3,6 +3,8 @@
 #include "stdint.h"
 typedef void* intr_handler;
 void idt_init(void);
+void idt_load(void);
+void apic_intr_init(const uint8_t* isa_irq_pin, uint8_t bsp_apic_id);
 
 // 中断状态
 enum intr_status {
@@ -15,4 +17,5 @@ enum intr_status intr_set_status(enum intr_status);
 enum intr_status intr_enable(void);
 enum intr_status intr_disable(void);
 void register_handler(uint8_t vector_no, intr_handler function);
+void pci_irq_register(uint8_t irq, intr_handler function);
 #endif
\ No newline at end of file
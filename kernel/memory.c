@@ -7,10 +7,13 @@
 #include "string.h"
 #include "sync.h"
 #include "interrupt.h"
+#include "smp.h"
+#include "aio.h"
 
 #define MEM_BITMAP_BASE 0xc009a000 // 位图地址
 
 #define K_HEAP_START 0xc0100000 // 内核虚拟地址
+#define MMIO_START   0xe0000000 // 设备寄存器所在的物理地址都在此之上, 与内核堆不重叠
 
 #define PDE_IDX(addr) ((addr & 0xffc00000) >> 22) // 获取页目录表下标
 #define PTE_IDX(addr) ((addr & 0x003ff000) >> 12) // 获取页表下标
@@ -35,6 +38,7 @@ struct arena {
 struct mem_block_desc k_block_descs[DESC_CNT]; // 内核内存块描述符数组
 struct pool kernel_pool, user_pool;
 struct virtual_addr kernel_vaddr;
+static uint32_t kmap_base; // kmap_atomic 所用窗口的起始虚拟地址, 第 n 页归 n 号 cpu
 
 // 在 pf 表示的虚拟内存池中申请 pg_cnt 个虚拟页
 // 成功则返回虚拟页的起始地址, 失败则返回 NULL
@@ -175,6 +179,29 @@ void* get_kernel_pages(uint32_t pg_cnt) {
     return vaddr;
 }
 
+// 从内核物理内存池中申请 pg_cnt 个物理地址也连续的页, 供要求整块连续物理内存的设备使用
+// 成功则返回其虚拟地址, 失败则返回 NULL, 用 mfree_page 释放
+void* get_kernel_pages_contig(uint32_t pg_cnt) {
+    ASSERT(pg_cnt > 0);
+    lock_acquire(&kernel_pool.lock);
+    void* vaddr_start = NULL;
+    int bit_idx = bitmap_scan(&kernel_pool.pool_bitmap, pg_cnt);
+    if (bit_idx != -1) {
+        vaddr_start = vaddr_get(PF_KERNEL, pg_cnt);
+    }
+    if (vaddr_start != NULL) {
+        uint32_t cnt;
+        for (cnt = 0; cnt < pg_cnt; cnt++) {
+            bitmap_set(&kernel_pool.pool_bitmap, bit_idx + cnt, 1);
+            page_table_add((void*)((uint32_t)vaddr_start + cnt * PG_SIZE), \
+                (void*)(kernel_pool.phy_addr_start + (bit_idx + cnt) * PG_SIZE));
+        }
+        memset(vaddr_start, 0, pg_cnt * PG_SIZE);
+    }
+    lock_release(&kernel_pool.lock);
+    return vaddr_start;
+}
+
 // 在用户空间中申请 4k 内存, 并返回其虚拟地址
 void* get_user_pages(uint32_t pg_cnt) {
     lock_acquire(&user_pool.lock);
@@ -271,8 +298,8 @@ static void mem_pool_init(uint32_t all_mem) {
     bitmap_init(&kernel_pool.pool_bitmap);
     bitmap_init(&user_pool.pool_bitmap);
 
-    lock_init(&kernel_pool.lock);
-    lock_init(&user_pool.lock);
+    lock_init(&kernel_pool.lock, "kernel_pool");
+    lock_init(&user_pool.lock, "user_pool");
 
     // 初始化内核虚拟地址的位图
     kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;
@@ -292,25 +319,20 @@ static struct arena* block2arena(struct mem_block* b) {
     return (struct arena*)((uint32_t)b & 0xfffff000);
 }
 
-// 在堆中申请 size 字节内存
-void* sys_malloc(uint32_t size) {
-    enum pool_flags PF;
+// 在 PF 表示的堆中申请 size 字节内存
+static void* heap_alloc(enum pool_flags PF, uint32_t size) {
     struct pool* mem_pool;
     uint32_t pool_size;
     struct mem_block_desc* descs;
-    struct task_struct* cur_thread = running_thread();
 
-    // 判断用哪个内存池
-    if (cur_thread->pgdir == NULL) { // 若为内核线程
-        PF = PF_KERNEL;
+    if (PF == PF_KERNEL) {
         pool_size = kernel_pool.pool_size;
         mem_pool = &kernel_pool;
         descs = k_block_descs;
     } else { // 用户进程 pcb 中的 pgdir 会在为其分配页表时创建
-        PF = PF_USER;
         pool_size = user_pool.pool_size;
         mem_pool = &user_pool;
-        descs = cur_thread->u_block_desc;
+        descs = running_thread()->group_leader->u_block_desc; // 同一进程的线程共用一个堆
     }
 
     // 若申请的内存不在内存池容量范围内则直接返回 NULL
@@ -387,6 +409,17 @@ void* sys_malloc(uint32_t size) {
     }
 }
 
+// 在堆中申请 size 字节内存, 内核线程用内核堆, 进程用自己的用户堆
+void* sys_malloc(uint32_t size) {
+    return heap_alloc(running_thread()->pgdir == NULL ? PF_KERNEL : PF_USER, size);
+}
+
+// 在内核堆中申请 size 字节内存, 进程上下文中也一样
+// 用于要被所有任务访问的内核数据结构, 如共享的 inode 和交给其它线程处理的 io 请求
+void* kmalloc(uint32_t size) {
+    return heap_alloc(PF_KERNEL, size);
+}
+
 // 将物理地址 pg_phy_addr 回收到物理内存池
 void pfree(uint32_t pg_phy_addr) {
     struct pool* mem_pool;
@@ -405,7 +438,8 @@ void pfree(uint32_t pg_phy_addr) {
 static void page_table_pte_remove(uint32_t vaddr) {
     uint32_t* pte = pte_ptr(vaddr);
     *pte &= ~PG_P_1; // 将页表项 pte 的 P 位置 0
-    asm volatile ("invlpg %0" : : "m" (vaddr) : "memory"); // 更新 tlb
+    // 更新 tlb, invlpg 的操作数是待刷新的地址本身
+    asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
 }
 
 // 释放以虚拟地址 vaddr 为起始的 cnt 个物理页框
@@ -452,22 +486,20 @@ void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
         // 清空虚拟地址的位图中的相应位
         vaddr_remove(pf, _vaddr, pg_cnt);
     }
+    // 其它 cpu 的 tlb 中可能还缓存着这些映射, 虚拟地址被重新分配后会访问到旧页框
+    tlb_shootdown((uint32_t)_vaddr, pg_cnt);
 }
 
-// 回收内存 ptr
-void sys_free(void* ptr) {
+// 把 ptr 回收到 PF 表示的堆中
+static void heap_free(enum pool_flags PF, void* ptr) {
     ASSERT(ptr != NULL);
     if (ptr != NULL) {
-        enum pool_flags PF;
         struct pool* mem_pool;
 
-        // 判断是线程, 还是进程
-        if (running_thread()->pgdir == NULL) {
+        if (PF == PF_KERNEL) {
             ASSERT((uint32_t)ptr >= K_HEAP_START);
-            PF = PF_KERNEL;
             mem_pool = &kernel_pool;
         } else {
-            PF = PF_USER;
             mem_pool = &user_pool;
         }
 
@@ -475,6 +507,15 @@ void sys_free(void* ptr) {
         struct mem_block* b = ptr;
         struct arena* a = block2arena(b); // 把 mem_block 转换成 arena, 获取元信息
         ASSERT(a->large == 0 || a->large == 1);
+        // 要归还进程的页时, 先等本进程在途的异步 io 完成, 否则设备会读写已归还给别人的页框
+        // 等待时不能持有 mem_pool->lock, 醒来后 arena 的状态可能已变, 重新判断
+        struct task_struct* leader = running_thread()->group_leader;
+        while (PF == PF_USER && aio_inflight(leader) && \
+               ((a->desc == NULL && a->large == true) || a->cnt + 1 == a->desc->blocks_per_arena)) {
+            lock_release(&mem_pool->lock);
+            aio_drain(leader);
+            lock_acquire(&mem_pool->lock);
+        }
         if (a->desc == NULL && a->large ==true) { // 大于 1024 的内存
             mfree_page(PF, a, a->cnt);
         } else { // 小于等于 1024 的内存块
@@ -495,6 +536,16 @@ void sys_free(void* ptr) {
     }
 }
 
+// 回收内存 ptr, 判断是线程还是进程的堆
+void sys_free(void* ptr) {
+    heap_free(running_thread()->pgdir == NULL ? PF_KERNEL : PF_USER, ptr);
+}
+
+// 回收 kmalloc 分配的内存
+void kfree(void* ptr) {
+    heap_free(PF_KERNEL, ptr);
+}
+
 void block_desc_init(struct mem_block_desc* desc_array) {
     uint16_t desc_idx, block_size = 16;
 
@@ -537,6 +588,33 @@ void free_a_phy_page(uint32_t pg_phy_addr) {
     bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
 }
 
+// 把物理地址 paddr 起的 pg_cnt 页设备寄存器映射到内核空间同值的虚拟地址上, 并禁用缓存
+// 这些地址位于内核页目录项 769~1022 的范围内, 其页表由 loader 建好, 为所有进程共享
+void* mmio_map(uint32_t paddr, uint32_t pg_cnt) {
+    ASSERT((paddr % PG_SIZE) == 0 && paddr >= MMIO_START);
+    uint32_t vaddr = paddr;
+    while (pg_cnt-- > 0) {
+        ASSERT(*pde_ptr(vaddr) & PG_P_1);
+        uint32_t* pte = pte_ptr(vaddr);
+        if (!(*pte & PG_P_1)) {
+            *pte = vaddr | PG_PCD_1 | PG_PWT_1 | PG_US_S | PG_RW_W | PG_P_1;
+        }
+        vaddr += PG_SIZE;
+    }
+    return (void*)paddr;
+}
+
+// 把物理地址 paddr 所在的页映射到本 cpu 专用的内核虚拟页上, 返回 paddr 对应的虚拟地址
+// 用于访问不在当前地址空间中的页, 如替别的进程搬运 io 数据
+// 调用者须关中断, 映射只在本 cpu 上、下次调用 kmap_atomic 之前有效
+void* kmap_atomic(uint32_t paddr) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    uint32_t vaddr = kmap_base + this_cpu()->id * PG_SIZE;
+    *pte_ptr(vaddr) = (paddr & 0xfffff000) | PG_US_S | PG_RW_W | PG_P_1;
+    asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
+    return (void*)(vaddr + (paddr & 0xfff));
+}
+
 // 内存管理初始化入口
 void mem_init() {
     put_str("mem_init start\n");
@@ -545,5 +623,7 @@ void mem_init() {
     mem_pool_init(mem_bytes_total);
     // 初始化 mem_block_desc 数组 descs, 为 malloc 做准备
     block_desc_init(k_block_descs);
+    // 为 kmap_atomic 给每个 cpu 留一页内核虚拟地址, 物理页在使用时才映射
+    kmap_base = (uint32_t)vaddr_get(PF_KERNEL, MAX_CPUS);
     put_str("mem_init done\n");
 }
@@ -17,6 +17,8 @@ enum pool_flags {
 #define PG_RW_W 2 // R/W 属性位值, 读/写/执行
 #define PG_US_S 0 // U/S 属性位值, 系统级
 #define PG_US_U 4 // U/S 属性位值, 用户级
+#define PG_PWT_1 8 // 写直通, 用于设备寄存器
+#define PG_PCD_1 16 // 禁用缓存, 用于设备寄存器
 
 // 虚拟地址池
 struct virtual_addr {
@@ -36,11 +38,13 @@ struct mem_block_desc {
     struct list free_list; // 目前可用的 mem_block 链表
 };
 
+#define KERNEL_PGDIR_PADDR 0x100000 // 内核页目录的物理地址, 内核线程原本使用的页目录
 #define DESC_CNT 7 // 内存块描述符个数
 
 extern struct pool kernel_pool, user_pool;
 void mem_init(void);
 void* get_kernel_pages(uint32_t pg_cnt);
+void* get_kernel_pages_contig(uint32_t pg_cnt);
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void malloc_init(void);
 uint32_t* pte_ptr(uint32_t vaddr);
@@ -50,9 +54,13 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 void* get_user_pages(uint32_t pg_cnt);
 void block_desc_init(struct mem_block_desc* desc_array);
 void* sys_malloc(uint32_t size);
+void* kmalloc(uint32_t size);
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 void pfree(uint32_t pg_phy_addr);
 void sys_free(void* ptr);
+void kfree(void* ptr);
 void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
 void free_a_phy_page(uint32_t pg_phy_addr);
+void* mmio_map(uint32_t paddr, uint32_t pg_cnt);
+void* kmap_atomic(uint32_t paddr);
 #endif
@@ -0,0 +1,372 @@
+#include "smp.h"
+#include "apic.h"
+#include "thread.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "tss.h"
+#include "string.h"
+#include "print.h"
+#include "debug.h"
+#include "atomic.h"
+#include "io.h"
+#include "fpu.h"
+
+#define AP_START_PADDR 0x80000	 // AP 启动代码被复制到的物理地址, 原是 kernel.bin 的缓冲区, 启动后已无用
+#define LOW_MEM_VADDR(paddr) ((uint32_t)(paddr) + 0xc0000000)	 // 低端 1MB 在内核空间中的地址
+#define TLB_FLUSH_ALL 32	 // 超过此页数就直接重新加载 cr3
+
+#define MP_PROC		0	 // MP 配置表中的处理器项
+#define MP_BUS		1	 // MP 配置表中的总线项
+#define MP_IOAPIC	2	 // MP 配置表中的 IO APIC 项
+#define MP_IOINTR	3	 // MP 配置表中的 IO 中断分配项
+#define MP_INTR_INT	0	 // 普通的向量中断
+#define MP_IMCR_PRESENT 0x80	 // feature[1] 的第 7 位: 有 IMCR, 开机时处于 PIC 模式
+#define IMCR_ADDR_PORT	0x22
+#define IMCR_DATA_PORT	0x23
+#define MP_PROC_ENABLED 0x1
+#define MP_PROC_BSP	0x2
+
+// MP 浮点结构, BIOS 用它给出 MP 配置表的位置
+struct mp_fps {
+   char signature[4];	   // "_MP_"
+   uint32_t config_paddr;  // MP 配置表的物理地址
+   uint8_t length;	   // 以 16 字节为单位的长度
+   uint8_t spec_rev;
+   uint8_t checksum;
+   uint8_t feature[5];	   // feature[0] 不为 0 表示采用默认配置, 没有配置表
+} __attribute__ ((packed));
+
+// MP 配置表表头, 其后紧跟 entry_cnt 个表项
+struct mp_config {
+   char signature[4];	   // "PCMP"
+   uint16_t length;
+   uint8_t spec_rev;
+   uint8_t checksum;
+   char oem_id[8];
+   char product_id[12];
+   uint32_t oem_table;
+   uint16_t oem_table_size;
+   uint16_t entry_cnt;
+   uint32_t lapic_paddr;   // local APIC 寄存器的物理地址
+   uint16_t ext_length;
+   uint8_t ext_checksum;
+   uint8_t reserved;
+} __attribute__ ((packed));
+
+// 处理器表项, 20 字节
+struct mp_proc {
+   uint8_t type;
+   uint8_t apic_id;
+   uint8_t apic_ver;
+   uint8_t flags;
+   uint32_t signature;
+   uint32_t features;
+   uint32_t reserved[2];
+} __attribute__ ((packed));
+
+// 总线表项, 8 字节
+struct mp_bus {
+   uint8_t type;
+   uint8_t bus_id;
+   char bus_type[6];	   // 如 "ISA   ", "PCI   "
+} __attribute__ ((packed));
+
+// IO APIC 表项, 8 字节
+struct mp_ioapic {
+   uint8_t type;
+   uint8_t apic_id;
+   uint8_t ver;
+   uint8_t flags;
+   uint32_t paddr;
+} __attribute__ ((packed));
+
+// IO 中断分配表项, 8 字节, 说明某总线上的 irq 接在 IO APIC 的哪个引脚上
+struct mp_iointr {
+   uint8_t type;
+   uint8_t intr_type;
+   uint16_t flags;
+   uint8_t src_bus;
+   uint8_t src_irq;
+   uint8_t dst_ioapic;
+   uint8_t dst_pin;
+} __attribute__ ((packed));
+
+struct cpu cpus[MAX_CPUS];
+uint8_t cpu_cnt = 1;	   // MP 表中登记的可用 cpu 数, 至少有 BSP
+
+static struct spinlock tlb_lock;	// 同一时刻只允许一个 cpu 发起 TLB 刷新
+static volatile uint32_t tlb_vaddr;	// 待刷新的起始虚拟地址
+static volatile uint32_t tlb_pg_cnt;	// 待刷新的页数
+static volatile uint32_t tlb_drop_pgdir;	// 非 0 时表示请求借用着此页目录的 cpu 换回内核页目录
+
+// 定义在 ap_start.S 中, 需复制到 AP_START_PADDR 处执行
+extern uint8_t ap_start[], ap_start_end[], ap_boot_stack[];
+
+// 当前 cpu 的私有数据, 编号记录在正在运行的任务的 pcb 中
+struct cpu* this_cpu(void) {
+   return &cpus[running_thread()->cpu_id];
+}
+
+// 校验和: 所有字节之和为 0
+static bool mp_checksum(uint8_t* addr, uint32_t len) {
+   uint8_t sum = 0;
+   while (len-- > 0) {
+      sum += *addr++;
+   }
+   return sum == 0;
+}
+
+// 在物理地址 paddr 起 len 字节的范围内按 16 字节对齐查找 MP 浮点结构
+static struct mp_fps* mp_search_range(uint32_t paddr, uint32_t len) {
+   uint8_t* addr = (uint8_t*)LOW_MEM_VADDR(paddr);
+   uint32_t off;
+   for (off = 0; off + sizeof(struct mp_fps) <= len; off += 16) {
+      if (memcmp(addr + off, "_MP_", 4) == 0 && mp_checksum(addr + off, sizeof(struct mp_fps))) {
+	 return (struct mp_fps*)(addr + off);
+      }
+   }
+   return NULL;
+}
+
+// 按 MP 规范依次在 EBDA 的第一个 1KB、基本内存的最后 1KB、BIOS ROM 中查找
+static struct mp_fps* mp_search(void) {
+   struct mp_fps* fps;
+   uint16_t ebda_seg = *(uint16_t*)LOW_MEM_VADDR(0x40e);
+   if (ebda_seg != 0 && (fps = mp_search_range((uint32_t)ebda_seg << 4, 1024)) != NULL) {
+      return fps;
+   }
+   uint16_t base_kb = *(uint16_t*)LOW_MEM_VADDR(0x413);
+   if ((fps = mp_search_range(((uint32_t)base_kb - 1) * 1024, 1024)) != NULL) {
+      return fps;
+   }
+   return mp_search_range(0xf0000, 0x10000);
+}
+
+// 刷新本 cpu 上 tlb_vaddr 起 tlb_pg_cnt 页的 TLB
+static void tlb_flush_local(void) {
+   if (tlb_drop_pgdir != 0) {
+      struct cpu* c = this_cpu();
+      // 到这里之前本 cpu 可能已经换到了别的页目录
+      if (c->cr3 == tlb_drop_pgdir) {
+	 asm volatile ("movl %0, %%cr3" : : "r" (KERNEL_PGDIR_PADDR) : "memory");
+	 c->cr3 = KERNEL_PGDIR_PADDR;
+      }
+      return;
+   }
+   uint32_t vaddr = tlb_vaddr, pg_cnt = tlb_pg_cnt;
+   if (pg_cnt > TLB_FLUSH_ALL) {
+      uint32_t cr3;
+      asm volatile ("movl %%cr3, %0; movl %0, %%cr3" : "=r" (cr3) : : "memory");
+      return;
+   }
+   while (pg_cnt-- > 0) {
+      asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
+      vaddr += PG_SIZE;
+   }
+}
+
+// 若有发给本 cpu 的 TLB 刷新请求就处理并应答
+// 除 IPI 外, 关中断自旋的地方也会调用, 以免发起者一直等待
+void smp_tlb_poll(void) {
+   if (cpu_cnt == 1) {
+      return;
+   }
+   struct cpu* c = this_cpu();
+   if (c->tlb_pending) {
+      tlb_flush_local();
+      barrier();
+      c->tlb_pending = false;
+   }
+}
+
+// 向 cpu c 发出刷新请求, 须持有 tlb_lock
+static void tlb_request(struct cpu* c) {
+   c->tlb_pending = true;
+   lapic_send_ipi(c->apic_id, IPI_TLB_VECTOR);
+}
+
+// 等待各 cpu 处理完刷新请求, 须持有 tlb_lock
+static void tlb_wait_all(void) {
+   uint8_t i;
+   for (i = 0; i < cpu_cnt; i++) {
+      while (cpus[i].tlb_pending) {
+	 cpu_relax();
+      }
+   }
+}
+
+// 页表项 vaddr 起 pg_cnt 页的映射已被去掉, 让其它 cpu 也刷新 TLB
+// 本 cpu 的 TLB 由调用者自行刷新
+void tlb_shootdown(uint32_t vaddr, uint32_t pg_cnt) {
+   if (cpu_cnt == 1) {
+      return;
+   }
+   enum intr_status old_status = spin_lock_irqsave(&tlb_lock);
+   struct cpu* self = this_cpu();
+   tlb_vaddr = vaddr;
+   tlb_pg_cnt = pg_cnt;
+   uint8_t i;
+   for (i = 0; i < cpu_cnt; i++) {
+      struct cpu* c = &cpus[i];
+      if (c != self && c->started) {
+	 tlb_request(c);
+      }
+   }
+   tlb_wait_all();
+   spin_unlock_irqrestore(&tlb_lock, old_status);
+}
+
+/* 物理地址为 pgdir_paddr 的页目录即将被回收, 让仍在借用它的 cpu 都换回内核页目录
+ * 只有它的属主进程会把它装入 cr3, 属主已不再运行, 所以不会有 cpu 在此之后新借用它 */
+void pgdir_unload(uint32_t pgdir_paddr) {
+   enum intr_status old_status = spin_lock_irqsave(&tlb_lock);
+   struct cpu* self = this_cpu();
+   if (self->cr3 == pgdir_paddr) {
+      asm volatile ("movl %0, %%cr3" : : "r" (KERNEL_PGDIR_PADDR) : "memory");
+      self->cr3 = KERNEL_PGDIR_PADDR;
+   }
+   tlb_drop_pgdir = pgdir_paddr;
+   uint8_t i;
+   for (i = 0; i < cpu_cnt; i++) {
+      struct cpu* c = &cpus[i];
+      if (c != self && c->started && c->cr3 == pgdir_paddr) {
+	 tlb_request(c);
+      }
+   }
+   tlb_wait_all();
+   tlb_drop_pgdir = 0;
+   spin_unlock_irqrestore(&tlb_lock, old_status);
+}
+
+// 唤醒停在 hlt 中的 cpu c, 使其重新调度
+void smp_send_reschedule(struct cpu* c) {
+   if (lapic_enabled) {
+      lapic_send_ipi(c->apic_id, IPI_RESCHEDULE_VECTOR);
+   }
+}
+
+// 重新调度 IPI 只是为了把 cpu 从 hlt 中唤醒, idle 醒来后自会调度
+static void intr_reschedule_handler(void) {
+}
+
+static void intr_tlb_handler(void) {
+   smp_tlb_poll();
+}
+
+// local APIC 的伪中断, 不需要处理也不需要 EOI
+static void intr_spurious_handler(void) {
+}
+
+// 解析 MP 配置表, 登记各 cpu 并初始化 BSP 的 local APIC 和 IO APIC
+void smp_init(void) {
+   put_str("smp_init start\n");
+   struct mp_fps* fps = mp_search();
+   // 配置表位于低端 1MB 之外时无法直接访问, 实际的 BIOS 都把它放在 1MB 以内
+   if (fps == NULL || fps->feature[0] != 0 || fps->config_paddr == 0 || fps->config_paddr >= 0x100000) {
+      put_str("   no mp config table, uniprocessor\n");
+      return;
+   }
+   struct mp_config* conf = (struct mp_config*)LOW_MEM_VADDR(fps->config_paddr);
+   if (memcmp(conf->signature, "PCMP", 4) != 0 || !mp_checksum((uint8_t*)conf, conf->length)) {
+      put_str("   bad mp config table, uniprocessor\n");
+      return;
+   }
+
+   uint32_t ioapic_paddr = 0;
+   uint8_t isa_bus = 0xff;
+   uint8_t isa_irq_pin[16];   // ISA 的各 irq 接在 IO APIC 的哪个引脚上, 表中未列出的按同号引脚处理
+   uint8_t* entry = (uint8_t*)(conf + 1);
+   uint16_t i;
+   for (i = 0; i < 16; i++) {
+      isa_irq_pin[i] = i;
+   }
+   for (i = 0; i < conf->entry_cnt; i++) {
+      if (*entry == MP_PROC) {
+	 struct mp_proc* proc = (struct mp_proc*)entry;
+	 // BSP 固定为 0 号, AP 按表中的顺序依次编号
+	 if ((proc->flags & MP_PROC_ENABLED) && !(proc->flags & MP_PROC_BSP) && cpu_cnt < MAX_CPUS) {
+	    cpus[cpu_cnt++].apic_id = proc->apic_id;
+	 }
+	 entry += sizeof(struct mp_proc);
+      } else {
+	 if (*entry == MP_IOAPIC && ioapic_paddr == 0) {
+	    ioapic_paddr = ((struct mp_ioapic*)entry)->paddr;
+	 } else if (*entry == MP_BUS && memcmp(((struct mp_bus*)entry)->bus_type, "ISA", 3) == 0) {
+	    isa_bus = ((struct mp_bus*)entry)->bus_id;
+	 } else if (*entry == MP_IOINTR) {
+	    // 总线项都排在中断分配项之前
+	    struct mp_iointr* intr = (struct mp_iointr*)entry;
+	    if (intr->intr_type == MP_INTR_INT && intr->src_bus == isa_bus && intr->src_irq < 16) {
+	       isa_irq_pin[intr->src_irq] = intr->dst_pin;
+	    }
+	 }
+	 entry += sizeof(struct mp_ioapic);   // 其余类型的表项都是 8 字节
+      }
+   }
+
+   register_handler(IPI_RESCHEDULE_VECTOR, intr_reschedule_handler);
+   register_handler(IPI_TLB_VECTOR, intr_tlb_handler);
+   register_handler(SPURIOUS_VECTOR, intr_spurious_handler);
+   lapic_map(conf->lapic_paddr);
+   lapic_init(true);
+   cpus[0].apic_id = lapic_id();
+   lapic_timer_calibrate();
+   if (ioapic_paddr != 0) {
+      ioapic_init(ioapic_paddr);
+      // 有 IMCR 的机器开机时 8259A 直连 BSP, 要先切换到经过 APIC 的对称模式
+      if (fps->feature[1] & MP_IMCR_PRESENT) {
+	 outb(IMCR_ADDR_PORT, 0x70);
+	 outb(IMCR_DATA_PORT, inb(IMCR_DATA_PORT) | 0x01);
+      }
+      apic_intr_init(isa_irq_pin, cpus[0].apic_id);
+      timer_use_lapic();
+   } else {
+      put_str("   no ioapic, keep 8259A\n");
+   }
+   put_str("   cpus: 0x"); put_int(cpu_cnt); put_str("\n");
+   put_str("smp_init done\n");
+}
+
+// 逐个启动 AP, 每个 AP 以自己的 idle 线程 pcb 所在页作为启动栈
+void smp_boot_aps(void) {
+   if (cpu_cnt == 1) {
+      return;
+   }
+   uint32_t code_size = ap_start_end - ap_start;
+   memcpy((void*)LOW_MEM_VADDR(AP_START_PADDR), ap_start, code_size);
+   // 启动代码中存放栈顶的位置
+   uint32_t* stack_slot = (uint32_t*)(LOW_MEM_VADDR(AP_START_PADDR) + (ap_boot_stack - ap_start));
+
+   uint8_t i;
+   for (i = 1; i < cpu_cnt; i++) {
+      struct cpu* c = &cpus[i];
+      c->idle_thread = thread_ap_idle_create(i);
+      *stack_slot = (uint32_t)c->idle_thread + PG_SIZE;
+      lapic_start_ap(c->apic_id, AP_START_PADDR);
+      // 最多等 100 毫秒, 上一个 AP 用完启动栈之前不能启动下一个
+      uint32_t ms = 0;
+      while (!c->started && ms++ < 100) {
+	 udelay(1000);
+      }
+      if (!c->started) {
+	 // 它若迟些才启动会与下一个 AP 共用启动栈, 不再启动后面的 AP
+	 put_str("   ap 0x"); put_int(c->apic_id); put_str(" failed to start\n");
+	 cpu_cnt = i;
+	 break;
+      }
+   }
+   put_str("   cpus online: 0x"); put_int(cpu_cnt); put_str("\n");
+}
+
+// AP 的 C 语言入口, 由 ap_start.S 在开启分页后跳转过来
+// 此时已运行在本 cpu 的 idle 线程的栈上
+void ap_main(void) {
+   struct cpu* c = this_cpu();
+   tss_load();
+   idt_load();
+   lapic_init(false);
+   fpu_cpu_init();
+   lapic_timer_start(LAPIC_TIMER_VECTOR);
+   c->started = true;
+   cpu_idle();
+}
@@ -0,0 +1,38 @@
+#ifndef __KERNEL_SMP_H
+#define __KERNEL_SMP_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "sync.h"
+
+#define MAX_CPUS 8
+
+// 每个处理器私有的数据
+struct cpu {
+    uint8_t id;                       // 逻辑编号, BSP 为 0
+    uint8_t apic_id;                  // local APIC 的 ID, 发送 IPI 时使用
+    volatile bool started;            // AP 是否已完成初始化
+    volatile bool idling;             // 是否正停在 idle 的 hlt 中, 有新任务时需用 IPI 唤醒
+    volatile bool tlb_pending;        // 是否有待处理的 TLB 刷新请求
+    volatile uint32_t cr3;            // 当前加载的页目录的物理地址, 内核线程沿用上一个任务的页目录
+    struct task_struct* idle_thread;  // 本 cpu 专属的 idle 线程, 不进入就绪队列
+    struct spinlock rq_lock;          // 保护 ready_list 和 ready_cnt
+    struct list ready_list;           // 本 cpu 的就绪队列
+    volatile uint32_t ready_cnt;      // 就绪队列长度, 供其它 cpu 无锁地窥探
+    struct task_struct* fpu_owner;    // 本 cpu 浮点寄存器中保存的是哪个任务的状态
+    uint32_t softirq_pending;         // 待处理的软中断位图, 只由本 cpu 在关中断下修改
+    bool in_softirq;                  // 是否正在执行软中断, 期间不抢占当前任务
+};
+
+extern struct cpu cpus[MAX_CPUS];
+extern uint8_t cpu_cnt;
+
+struct cpu* this_cpu(void);
+void smp_init(void);
+void smp_boot_aps(void);
+void ap_main(void);
+void smp_send_reschedule(struct cpu* c);
+void smp_tlb_poll(void);
+void tlb_shootdown(uint32_t vaddr, uint32_t pg_cnt);
+void pgdir_unload(uint32_t pgdir_paddr);
+#endif
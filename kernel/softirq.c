@@ -0,0 +1,57 @@
+#include "softirq.h"
+#include "interrupt.h"
+#include "smp.h"
+#include "global.h"
+#include "debug.h"
+
+/* 软中断即中断的下半部
+ * 中断处理程序在关中断下只做必须立即做的事, 其余用 raise_softirq 标记到本 cpu 上,
+ * 由 kernel.S 在外部中断返回前调用 do_softirq 开着中断执行.
+ * 软中断处理函数运行在被中断任务的栈上, 不能阻塞, 不能获取大内核锁和 struct lock,
+ * 其用到的自旋锁在别处也必须以关中断的方式获取. 需要睡眠的工作应交给工作队列 */
+
+#define SOFTIRQ_RESTART_MAX 8  // 一次 do_softirq 最多处理几轮新产生的软中断, 剩下的留到下次中断
+
+static softirq_func* softirq_vec[SOFTIRQ_CNT];
+
+// 注册 nr 号软中断的处理函数, 在初始化阶段调用
+void open_softirq(enum softirq_nr nr, softirq_func* func) {
+    ASSERT(nr < SOFTIRQ_CNT);
+    softirq_vec[nr] = func;
+}
+
+// 在本 cpu 上标记 nr 号软中断待处理, 通常在中断处理程序中调用
+void raise_softirq(enum softirq_nr nr) {
+    enum intr_status old_status = intr_disable();
+    this_cpu()->softirq_pending |= 1 << nr;
+    intr_set_status(old_status);
+}
+
+// 执行本 cpu 上待处理的软中断, 由外部中断的出口在关中断下调用
+void do_softirq(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct cpu* c = this_cpu();
+    // 软中断执行期间又来了中断时不重入, 新标记的软中断由外层的循环处理
+    if (c->softirq_pending == 0 || c->in_softirq) {
+        return;
+    }
+    c->in_softirq = true;
+    uint32_t restart = 0;
+    uint32_t pending;
+    while ((pending = c->softirq_pending) != 0 && restart++ < SOFTIRQ_RESTART_MAX) {
+        c->softirq_pending = 0;
+        intr_enable();
+        uint32_t nr = 0;
+        while (pending != 0) {
+            if ((pending & 1) && softirq_vec[nr] != NULL) {
+                softirq_vec[nr]();
+            }
+            pending >>= 1;
+            nr++;
+        }
+        intr_disable();
+    }
+    // in_softirq 期间时钟中断不会换下当前任务, 所以仍在同一个 cpu 上
+    ASSERT(this_cpu() == c);
+    c->in_softirq = false;
+}
@@ -0,0 +1,17 @@
+#ifndef __KERNEL_SOFTIRQ_H
+#define __KERNEL_SOFTIRQ_H
+#include "stdint.h"
+
+// 软中断号, 编号小的先执行
+enum softirq_nr {
+    SOFTIRQ_TIMER,   // 唤醒到期的睡眠线程
+    SOFTIRQ_KEYBOARD, // 翻译键盘中断暂存的扫描码
+    SOFTIRQ_CNT
+};
+
+typedef void softirq_func(void);
+
+void open_softirq(enum softirq_nr nr, softirq_func* func);
+void raise_softirq(enum softirq_nr nr);
+void do_softirq(void);
+#endif
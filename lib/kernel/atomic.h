@@ -0,0 +1,50 @@
+#ifndef __LIB_KERNEL_ATOMIC_H
+#define __LIB_KERNEL_ATOMIC_H
+#include "stdint.h"
+
+/* 原子地把 *ptr 置为 val, 返回 *ptr 的原值
+ * xchg 指令访问内存时自带 lock 语义 */
+static inline uint32_t atomic_xchg(volatile uint32_t* ptr, uint32_t val) {
+   asm volatile ("xchgl %0, %1" : "+r" (val), "+m" (*ptr) : : "memory");
+   return val;
+}
+
+/* 若 *ptr 等于 old 则将其置为 new, 返回 *ptr 的原值
+ * 返回值等于 old 表示交换成功 */
+static inline uint32_t atomic_cmpxchg(volatile uint32_t* ptr, uint32_t old, uint32_t new) {
+   uint32_t prev;
+   asm volatile ("lock cmpxchgl %2, %1" : "=a" (prev), "+m" (*ptr) : "r" (new), "0" (old) : "memory");
+   return prev;
+}
+
+/* 原子地给 *ptr 加上 delta, 返回相加后的值 */
+static inline uint32_t atomic_add_return(volatile uint32_t* ptr, int32_t delta) {
+   uint32_t val = delta;
+   asm volatile ("lock xaddl %0, %1" : "+r" (val), "+m" (*ptr) : : "memory");
+   return val + delta;
+}
+
+static inline void atomic_inc(volatile uint32_t* ptr) {
+   asm volatile ("lock incl %0" : "+m" (*ptr) : : "memory");
+}
+
+static inline void atomic_dec(volatile uint32_t* ptr) {
+   asm volatile ("lock decl %0" : "+m" (*ptr) : : "memory");
+}
+
+/* 编译器屏障, 阻止编译器跨越此处重排内存访问 */
+static inline void barrier(void) {
+   asm volatile ("" : : : "memory");
+}
+
+/* 全内存屏障: x86 允许后面的读越过前面的写, 带 lock 前缀的指令可以阻止这种重排
+ * mfence 需要 SSE2, 这里用对栈顶加 0 代替 */
+static inline void smp_mb(void) {
+   asm volatile ("lock; addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+/* 自旋等待时调用, pause 可降低忙等的功耗并避免退出循环时的流水线惩罚 */
+static inline void cpu_relax(void) {
+   asm volatile ("pause" : : : "memory");
+}
+#endif
@@ -48,4 +48,28 @@ static inline void insw(uint16_t port, void* addr, uint32_t word_cnt) {
 /******************************************************/
 }
 
+/* 向端口port写入一个字 */
+static inline void outw(uint16_t port, uint16_t data) {
+   asm volatile ( "outw %w0, %w1" : : "a" (data), "Nd" (port));
+}
+
+/* 向端口port写入一个双字 */
+static inline void outl(uint16_t port, uint32_t data) {
+   asm volatile ( "outl %0, %w1" : : "a" (data), "Nd" (port));
+}
+
+/* 将从端口port读入的一个字返回 */
+static inline uint16_t inw(uint16_t port) {
+   uint16_t data;
+   asm volatile ("inw %w1, %w0" : "=a" (data) : "Nd" (port));
+   return data;
+}
+
+/* 将从端口port读入的一个双字返回 */
+static inline uint32_t inl(uint16_t port) {
+   uint32_t data;
+   asm volatile ("inl %w1, %0" : "=a" (data) : "Nd" (port));
+   return data;
+}
+
 #endif
@@ -174,6 +174,11 @@ pid_t wait(int32_t* status) {
     return _syscall1(SYS_WAIT, status);
 }
 
+// 等待 pid 号子进程退出, pid 为 -1 时等待任一子进程, options 可取 WNOHANG
+pid_t waitpid(pid_t pid, int32_t* status, uint32_t options) {
+    return _syscall3(SYS_WAITPID, pid, status, options);
+}
+
 // 生成管道, pipefd[0] 负责读入管道, pipefd[1] 负责写入管道
 int32_t pipe(int32_t pipefd[2]) {
     return _syscall1(SYS_PIPE, pipefd);
@@ -188,3 +193,48 @@ void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd) {
 void help(void) {
     _syscall0(SYS_HELP);
 }
+
+// 获取 clock_id 时钟的当前时间, 存入 tp
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp) {
+    return _syscall2(SYS_CLOCK_GETTIME, clock_id, tp);
+}
+
+// 在用户地址 uaddr 上等待或唤醒, op 取 FUTEX_WAIT 或 FUTEX_WAKE
+int32_t futex(uint32_t* uaddr, uint32_t op, uint32_t val) {
+    return _syscall3(SYS_FUTEX, uaddr, op, val);
+}
+
+// 打印内核锁的争用统计和优先级继承记录
+void lockstat(void) {
+    _syscall0(SYS_LOCKSTAT);
+}
+
+// 在当前进程中创建线程, 从 entry 处开始执行, 用户栈顶为 stack_top
+pid_t clone(void* entry, void* stack_top) {
+    return _syscall2(SYS_CLONE, entry, stack_top);
+}
+
+// 等待本进程的线程 tid 结束, 其返回值存入 value
+int32_t thread_join(pid_t tid, int32_t* value) {
+    return _syscall2(SYS_THREAD_JOIN, tid, value);
+}
+
+// 以返回值 value 结束当前线程
+void exit_thread(int32_t value) {
+    _syscall1(SYS_THREAD_EXIT, value);
+}
+
+// 提交 cbs 中的 nr 个异步读写请求, 返回成功提交的个数
+int32_t aio_submit(struct aiocb* cbs, uint32_t nr) {
+    return _syscall2(SYS_AIO_SUBMIT, cbs, nr);
+}
+
+// 取回至少 min_nr、至多 max_nr 个已完成的异步请求, 返回取回的个数
+int32_t aio_reap(struct aio_event* events, uint32_t min_nr, uint32_t max_nr) {
+    return _syscall3(SYS_AIO_REAP, events, min_nr, max_nr);
+}
+
+// 打印各盘及分区的读写统计, hist 为 true 时附带延迟直方图
+void iostat(bool hist) {
+    _syscall1(SYS_IOSTAT, hist);
+}
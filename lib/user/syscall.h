@@ -3,6 +3,10 @@
 #include "stdint.h"
 #include "fs.h"
 #include "thread.h"
+#include "timer.h"
+#include "futex.h"
+#include "wait.h"
+#include "aio.h"
 enum SYSCALL_NR {
    SYS_GETPID,
    SYS_WRITE,
@@ -31,7 +35,17 @@ enum SYSCALL_NR {
    SYS_WAIT,
    SYS_PIPE,
    SYS_FD_REDIRECT,
-   SYS_HELP
+   SYS_HELP,
+   SYS_CLOCK_GETTIME,
+   SYS_FUTEX,
+   SYS_LOCKSTAT,
+   SYS_WAITPID,
+   SYS_CLONE,
+   SYS_THREAD_JOIN,
+   SYS_THREAD_EXIT,
+   SYS_AIO_SUBMIT,
+   SYS_AIO_REAP,
+   SYS_IOSTAT
 };
 uint32_t getpid(void);
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
@@ -58,7 +72,17 @@ void ps(void);
 int execv(const char* pathname, char** argv);
 void exit(int32_t status);
 pid_t wait(int32_t* status);
+pid_t waitpid(pid_t pid, int32_t* status, uint32_t options);
 int32_t pipe(int32_t pipefd[2]);
 void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd);
 void help(void);
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp);
+int32_t futex(uint32_t* uaddr, uint32_t op, uint32_t val);
+void lockstat(void);
+pid_t clone(void* entry, void* stack_top);
+int32_t thread_join(pid_t tid, int32_t* value);
+void exit_thread(int32_t value);
+int32_t aio_submit(struct aiocb* cbs, uint32_t nr);
+int32_t aio_reap(struct aio_event* events, uint32_t min_nr, uint32_t max_nr);
+void iostat(bool hist);
 #endif
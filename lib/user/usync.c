@@ -0,0 +1,74 @@
+#include "usync.h"
+#include "syscall.h"
+#include "atomic.h"
+#include "futex.h"
+
+#define FUTEX_WAKE_ALL 0x7fffffff
+
+void umutex_init(struct umutex* m) {
+   m->state = 0;
+}
+
+/* 加锁, 锁被占用时把 state 置为 2 并睡在 futex 上 */
+void umutex_lock(struct umutex* m) {
+   uint32_t c = atomic_cmpxchg(&m->state, 0, 1);
+   if (c == 0) {
+      return;   // 快路径, 无竞争
+   }
+   // 有竞争: 标记为 2, 让解锁者知道要进内核唤醒
+   if (c != 2) {
+      c = atomic_xchg(&m->state, 2);
+   }
+   while (c != 0) {
+      futex((uint32_t*)&m->state, FUTEX_WAIT, 2);
+      c = atomic_xchg(&m->state, 2);
+   }
+}
+
+/* 尝试加锁, 成功返回 0, 锁被占用返回 -1 */
+int32_t umutex_trylock(struct umutex* m) {
+   return atomic_cmpxchg(&m->state, 0, 1) == 0 ? 0 : -1;
+}
+
+/* 解锁, 只有可能有人在等时才进内核唤醒一个 */
+void umutex_unlock(struct umutex* m) {
+   if (atomic_xchg(&m->state, 0) == 2) {
+      futex((uint32_t*)&m->state, FUTEX_WAKE, 1);
+   }
+}
+
+void ucond_init(struct ucond* c) {
+   c->seq = 0;
+   c->waiters = 0;
+}
+
+/* 释放 m 并等待 c 被通知, 返回前重新持有 m
+ * 醒来不代表条件成立, 调用者应在循环中重新检查 */
+void ucond_wait(struct ucond* c, struct umutex* m) {
+   uint32_t seq = c->seq;
+   atomic_inc(&c->waiters);
+   umutex_unlock(m);
+   // 若期间已有 signal, seq 已变, futex 立即返回
+   futex((uint32_t*)&c->seq, FUTEX_WAIT, seq);
+   atomic_dec(&c->waiters);
+   // 醒来时可能还有别的等待者, 按有竞争的方式加锁, 使解锁时能唤醒它们
+   while (atomic_xchg(&m->state, 2) != 0) {
+      futex((uint32_t*)&m->state, FUTEX_WAIT, 2);
+   }
+}
+
+/* 唤醒一个等待者 */
+void ucond_signal(struct ucond* c) {
+   atomic_inc(&c->seq);
+   if (c->waiters != 0) {
+      futex((uint32_t*)&c->seq, FUTEX_WAKE, 1);
+   }
+}
+
+/* 唤醒全部等待者 */
+void ucond_broadcast(struct ucond* c) {
+   atomic_inc(&c->seq);
+   if (c->waiters != 0) {
+      futex((uint32_t*)&c->seq, FUTEX_WAKE, FUTEX_WAKE_ALL);
+   }
+}
@@ -0,0 +1,25 @@
+#ifndef __LIB_USER_USYNC_H
+#define __LIB_USER_USYNC_H
+#include "stdint.h"
+
+/* 用户态互斥锁, 无竞争时加锁解锁都只是一条原子指令, 不进入内核
+ * state: 0 空闲, 1 已加锁且无人等待, 2 已加锁且可能有人睡在 futex 上 */
+struct umutex {
+   volatile uint32_t state;
+};
+
+/* 用户态条件变量, 与 umutex 配合使用 */
+struct ucond {
+   volatile uint32_t seq;      // 每次 signal/broadcast 加 1, 等待者据此判断是否错过了唤醒
+   volatile uint32_t waiters;  // 正在等待的线程数, 为 0 时 signal 不进入内核
+};
+
+void umutex_init(struct umutex* m);
+void umutex_lock(struct umutex* m);
+int32_t umutex_trylock(struct umutex* m);
+void umutex_unlock(struct umutex* m);
+void ucond_init(struct ucond* c);
+void ucond_wait(struct ucond* c, struct umutex* m);
+void ucond_signal(struct ucond* c);
+void ucond_broadcast(struct ucond* c);
+#endif
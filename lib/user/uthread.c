@@ -0,0 +1,47 @@
+#include "uthread.h"
+#include "syscall.h"
+
+/* 新线程从这里开始执行, 栈上按 cdecl 的布局放好了 func 和 arg
+ * func 返回后以其返回值结束线程 */
+static void uthread_entry(uthread_func* func, void* arg) {
+   uthread_exit(func(arg));
+}
+
+/* 在当前进程中创建线程执行 func(arg), 成功返回 0, 失败返回 -1 */
+int32_t uthread_create(struct uthread* t, uthread_func* func, void* arg) {
+   t->stack = malloc(UTHREAD_STACK_SIZE);
+   if (t->stack == NULL) {
+      return -1;
+   }
+   // 栈顶依次是 uthread_entry 的返回地址(不会用到)、func 和 arg
+   uint32_t* stack_top = (uint32_t*)((uint32_t)t->stack + UTHREAD_STACK_SIZE) - 3;
+   stack_top[0] = 0;
+   stack_top[1] = (uint32_t)func;
+   stack_top[2] = (uint32_t)arg;
+   t->tid = clone(uthread_entry, stack_top);
+   if (t->tid == -1) {
+      free(t->stack);
+      t->stack = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+/* 等待线程 t 结束, 其返回值存入 retval, 成功返回 0, 失败返回 -1 */
+int32_t uthread_join(struct uthread* t, void** retval) {
+   int32_t ret;
+   if (thread_join(t->tid, &ret) == -1) {
+      return -1;
+   }
+   if (retval != NULL) {
+      *retval = (void*)ret;
+   }
+   free(t->stack);
+   t->stack = NULL;
+   return 0;
+}
+
+/* 结束当前线程, 在主线程中调用等同于 exit */
+void uthread_exit(void* retval) {
+   exit_thread((int32_t)retval);
+}
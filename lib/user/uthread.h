@@ -0,0 +1,18 @@
+#ifndef __LIB_USER_UTHREAD_H
+#define __LIB_USER_UTHREAD_H
+#include "stdint.h"
+
+#define UTHREAD_STACK_SIZE 16000   // 每个线程的用户栈大小, 从堆中分配
+
+typedef void* uthread_func(void* arg);
+
+/* 用户态线程的句柄, 由调用者分配, uthread_join 之前不能释放 */
+struct uthread {
+   int16_t tid;   // 线程 id, 即其 pid
+   void* stack;   // 用户栈, uthread_join 时释放
+};
+
+int32_t uthread_create(struct uthread* t, uthread_func* func, void* arg);
+int32_t uthread_join(struct uthread* t, void** retval);
+void uthread_exit(void* retval);
+#endif
@@ -0,0 +1,6 @@
+#ifndef __LIB_WAIT_H
+#define __LIB_WAIT_H
+// 内核和用户程序共用的 waitpid 选项
+
+#define WNOHANG 1 // 没有已退出的子进程时不阻塞, 立即返回 0
+#endif
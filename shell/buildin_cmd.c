@@ -202,6 +202,26 @@ void buildin_ps(uint32_t argc, char** argv UNUSED) {
     ps();
 }
 
+// lockstat 命令内建函数
+void buildin_lockstat(uint32_t argc, char** argv UNUSED) {
+    if (argc != 1) {
+        printf("lockstat: no argument support!\n");
+        return;
+    }
+    lockstat();
+}
+
+// iostat 命令内建函数, -h 时附带各盘和分区的延迟直方图
+void buildin_iostat(uint32_t argc, char** argv) {
+    if (argc == 1) {
+        iostat(false);
+    } else if (argc == 2 && !strcmp(argv[1], "-h")) {
+        iostat(true);
+    } else {
+        printf("iostat: only support -h\n");
+    }
+}
+
 // clear 命令内建函数
 void buildin_clear(uint32_t argc, char** argv UNUSED) {
     if (argc != 1) {
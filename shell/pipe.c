@@ -75,7 +75,7 @@ uint32_t pipe_write(int32_t fd, const void* buf, uint32_t count) {
 
 // 将文件描述符 old_local_fd 重定向为 new_local_fd
 void sys_fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd) {
-    struct task_struct* cur = running_thread();
+    struct task_struct* cur = running_thread()->group_leader;
     // 针对恢复标准描述符
     if (new_local_fd < 3) {
         cur->fd_table[old_local_fd] = new_local_fd;
@@ -123,6 +123,10 @@ static void cmd_execute(uint32_t argc, char** argv) {
         buildin_pwd(argc, argv);
     } else if (!strcmp("ps", argv[0])) {
         buildin_ps(argc, argv);
+    } else if (!strcmp("lockstat", argv[0])) {
+        buildin_lockstat(argc, argv);
+    } else if (!strcmp("iostat", argv[0])) {
+        buildin_iostat(argc, argv);
     } else if (!strcmp("clear", argv[0])) {
         buildin_clear(argc, argv);
     } else if (!strcmp("mkdir", argv[0])){
@@ -0,0 +1,124 @@
+#include "futex.h"
+#include "sync.h"
+#include "thread.h"
+#include "memory.h"
+#include "list.h"
+#include "global.h"
+#include "debug.h"
+#include "print.h"
+#include "process.h"
+
+/* 用户态同步的内核部分
+ * 用户态的锁只在有竞争时才进入内核, 在某个用户地址上睡眠或唤醒睡在上面的线程.
+ * 等待者按用户地址对应的物理地址归类, 不同进程映射到同一物理页的地址也能互相唤醒 */
+
+#define FUTEX_HASH_SIZE 64
+
+// 睡在某个 futex 上的线程, 节点放在其内核栈上
+struct futex_waiter {
+    uint32_t paddr;            // futex 的物理地址
+    struct task_struct* thread;
+    struct list_elem tag;      // 用于加入 futex_bucket 的 waiters
+};
+
+// 按物理地址散列的等待队列
+struct futex_bucket {
+    struct spinlock guard;     // 保护 waiters
+    struct list waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
+
+static struct futex_bucket* futex_hash(uint32_t paddr) {
+    return &futex_table[(paddr >> 2) % FUTEX_HASH_SIZE];
+}
+
+// 检查 uaddr 是否为 4 字节对齐、已映射的用户地址, 是则返回其物理地址, 否则返回 0
+static uint32_t futex_paddr(uint32_t* uaddr) {
+    uint32_t vaddr = (uint32_t)uaddr;
+    if ((vaddr & 3) || vaddr < USER_VADDR_START || vaddr >= 0xc0000000) {
+        return 0;
+    }
+    // 先确认页目录项和页表项都存在, 否则访问 *uaddr 会引发缺页
+    uint32_t* pde = pde_ptr(vaddr);
+    if (!(*pde & PG_P_1)) {
+        return 0;
+    }
+    uint32_t* pte = pte_ptr(vaddr);
+    if (!(*pte & PG_P_1) || !(*pte & PG_US_U)) {
+        return 0;
+    }
+    return addr_v2p(vaddr);
+}
+
+// 若 *uaddr 等于 val 则睡眠, 被唤醒返回 0; *uaddr 已不等于 val 返回 -1, 调用者应重新检查
+// 睡眠可被进程退出中断, 此时也返回 -1
+static int32_t futex_wait(uint32_t* uaddr, uint32_t paddr, uint32_t val) {
+    struct futex_bucket* bucket = futex_hash(paddr);
+    struct futex_waiter waiter;
+    waiter.paddr = paddr;
+    waiter.thread = running_thread();
+
+    enum intr_status old_status = spin_lock_irqsave(&bucket->guard);
+    // 持有 guard 后再比较, 用户态在修改 *uaddr 后调用 FUTEX_WAKE 时必然能看到本线程
+    if (*(volatile uint32_t*)uaddr != val || thread_kill_pending(waiter.thread)) {
+        spin_unlock_irqrestore(&bucket->guard, old_status);
+        return -1;
+    }
+    list_append(&bucket->waiters, &waiter.tag);
+    waiter.thread->intr_guard = &bucket->guard;
+    waiter.thread->intr_elem = &waiter.tag;
+    thread_block_locked(TASK_BLOCKED, &bucket->guard);
+    intr_set_status(old_status);
+    return thread_kill_pending(waiter.thread) ? -1 : 0;
+}
+
+// 唤醒最多 cnt 个睡在物理地址 paddr 上的线程, 返回唤醒的个数
+static int32_t futex_wake(uint32_t paddr, uint32_t cnt) {
+    struct futex_bucket* bucket = futex_hash(paddr);
+    int32_t woken = 0;
+
+    enum intr_status old_status = spin_lock_irqsave(&bucket->guard);
+    struct list_elem* elem = bucket->waiters.head.next;
+    while (elem != &bucket->waiters.tail && (uint32_t)woken < cnt) {
+        struct list_elem* next = elem->next;
+        struct futex_waiter* waiter = elem2entry(struct futex_waiter, tag, elem);
+        if (waiter->paddr == paddr) {
+            list_remove(elem);
+            waiter->thread->intr_guard = NULL;
+            thread_unblock(waiter->thread);
+            woken++;
+        }
+        elem = next;
+    }
+    spin_unlock_irqrestore(&bucket->guard, old_status);
+    return woken;
+}
+
+/* futex 系统调用, op 为 FUTEX_WAIT 时 val 是期望值, 为 FUTEX_WAKE 时 val 是最多唤醒的个数
+ * 失败返回 -1 */
+int32_t sys_futex(uint32_t* uaddr, uint32_t op, uint32_t val) {
+    uint32_t paddr = futex_paddr(uaddr);
+    if (paddr == 0) {
+        return -1;
+    }
+    switch (op) {
+        case FUTEX_WAIT:
+            return futex_wait(uaddr, paddr, val);
+        case FUTEX_WAKE:
+            return futex_wake(paddr, val);
+        default:
+            return -1;
+    }
+}
+
+// 初始化 futex 的散列表
+void futex_init(void) {
+    put_str("futex_init start\n");
+    uint32_t i;
+    for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spin_init(&futex_table[i].guard);
+        list_init(&futex_table[i].waiters);
+    }
+    put_str("futex_init done\n");
+}
@@ -0,0 +1,13 @@
+#ifndef __THREAD_FUTEX_H
+#define __THREAD_FUTEX_H
+#include "stdint.h"
+
+// futex 系统调用的操作
+enum futex_op {
+    FUTEX_WAIT, // 若 *uaddr 仍等于 val 就睡眠, 直到被 FUTEX_WAKE 唤醒
+    FUTEX_WAKE  // 唤醒最多 val 个睡在 uaddr 上的线程
+};
+
+void futex_init(void);
+int32_t sys_futex(uint32_t* uaddr, uint32_t op, uint32_t val);
+#endif
@@ -3,59 +3,376 @@
 #include "global.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "atomic.h"
+#include "smp.h"
+#include "string.h"
+#include "timer.h"
+#include "stdio-kernel.h"
+#include "stdio.h"
+#include "memory.h"
+#include "fs.h"
+#include "file.h"
+
+// 大内核锁: 系统调用执行期间持有, 使文件系统等原本依靠
+// "系统调用期间关中断" 来互斥的代码在多处理器上依然串行执行.
+// 持有者阻塞时由 schedule 代为释放, 重新换上 cpu 时再重新获取
+static struct spinlock big_kernel_lock;
+
+// 保护各线程的 priority、blocked_on 以及锁的 holder, 使优先级继承的链式传递一致
+// 没有竞争、也不涉及借来的优先级时, 持有者只改自己的 held_locks 和锁的 holder, 不必获取它
+static struct spinlock pi_lock;
+static struct pi_stat pi_stat;
+static struct pi_event pi_events[PI_TRACE_CNT];
+static uint32_t pi_event_idx;
+
+// 全部已初始化的锁, 供 lockstat 遍历. 锁都是静态或常驻的, 初始化后不会被销毁.
+// mem_init 中的 lock_init 早于任何初始化代码执行, 所以队列用静态初始化而非 list_init
+static struct list lock_list = {
+    {NULL, &lock_list.tail},
+    {&lock_list.head, NULL}
+};
+// 全部已初始化的读写锁, 同样常驻不销毁
+static struct list rwlock_list = {
+    {NULL, &rwlock_list.tail},
+    {&rwlock_list.head, NULL}
+};
+static struct spinlock lock_list_guard;   // 保护 lock_list 和 rwlock_list
+
+// 初始化自旋锁
+void spin_init(struct spinlock* plock) {
+    plock->locked = 0;
+}
+
+// 获取自旋锁, 获取不到就忙等
+void spin_lock(struct spinlock* plock) {
+    while (atomic_xchg(&plock->locked, 1) != 0) {
+        // 只读地等待, 避免 xchg 反复锁总线
+        while (plock->locked) {
+            cpu_relax();
+            // 自旋期间可能处于关中断状态, 在此响应别的 cpu 发来的 TLB 刷新请求,
+            // 否则发起者若正持有本 cpu 等待的锁就会互相等待
+            smp_tlb_poll();
+        }
+    }
+}
+
+// 尝试获取自旋锁, 成功返回 true, 不等待
+bool spin_trylock(struct spinlock* plock) {
+    return atomic_xchg(&plock->locked, 1) == 0;
+}
+
+// 释放自旋锁
+void spin_unlock(struct spinlock* plock) {
+    ASSERT(plock->locked);
+    barrier();
+    plock->locked = 0;
+}
+
+// 关中断并获取自旋锁, 返回关中断前的中断状态
+// 会在中断处理程序中获取的锁必须用此接口, 否则同一 cpu 上会死锁
+enum intr_status spin_lock_irqsave(struct spinlock* plock) {
+    enum intr_status old_status = intr_disable();
+    spin_lock(plock);
+    return old_status;
+}
+
+// 释放自旋锁并恢复中断状态
+void spin_unlock_irqrestore(struct spinlock* plock, enum intr_status old_status) {
+    spin_unlock(plock);
+    intr_set_status(old_status);
+}
+
+// 系统调用入口处获取大内核锁
+void kernel_lock(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    ASSERT(!cur->bkl_held);
+    spin_lock(&big_kernel_lock);
+    cur->bkl_held = true;
+}
+
+// 系统调用返回前释放大内核锁
+void kernel_unlock(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->bkl_held);
+    cur->bkl_held = false;
+    spin_unlock(&big_kernel_lock);
+}
+
+// 换下 cpu 前临时释放大内核锁, 供 schedule 调用
+void kernel_lock_drop(struct task_struct* cur) {
+    if (cur->bkl_held) {
+        spin_unlock(&big_kernel_lock);
+    }
+}
+
+// 重新换上 cpu 后恢复大内核锁, 供 schedule 调用
+void kernel_lock_resume(struct task_struct* cur) {
+    if (cur->bkl_held) {
+        spin_lock(&big_kernel_lock);
+    }
+}
+
+// 初始化等待队列
+void wait_queue_init(struct wait_queue* wq) {
+    list_init(&wq->waiters);
+    spin_init(&wq->guard);
+}
+
+/* 在 wq 上睡眠, 直到被 wait_queue_wake_one/all 唤醒
+ * 调用者须关中断并持有保护所等条件的自旋锁 held, 本函数在把当前线程挂入 wq 后才释放 held,
+ * 醒来后重新持有 held 返回. 醒来不代表条件成立, 调用者应在循环中重新检查 */
+void wait_queue_sleep(struct wait_queue* wq, struct spinlock* held) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    spin_lock(&wq->guard);
+    ASSERT(!elem_find(&wq->waiters, &cur->general_tag));
+    list_append(&wq->waiters, &cur->general_tag);
+    spin_unlock(held);
+    thread_block_locked(TASK_BLOCKED, &wq->guard);
+    spin_lock(held);
+}
+
+/* 同 wait_queue_sleep, 但所在进程退出时可被 thread_interrupt 提前唤醒
+ * 进程已在退出时不再睡眠. 返回 false 表示因进程退出而放弃等待, 调用者应返回错误,
+ * 由系统调用出口结束本线程 */
+bool wait_queue_sleep_interruptible(struct wait_queue* wq, struct spinlock* held) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    if (thread_kill_pending(cur)) {
+        return false;
+    }
+    spin_lock(&wq->guard);
+    ASSERT(!elem_find(&wq->waiters, &cur->general_tag));
+    list_append(&wq->waiters, &cur->general_tag);
+    cur->intr_guard = &wq->guard;
+    cur->intr_elem = &cur->general_tag;
+    spin_unlock(held);
+    thread_block_locked(TASK_BLOCKED, &wq->guard);
+    spin_lock(held);
+    return !thread_kill_pending(cur);
+}
+
+/* 把可中断睡眠中的 pthread 从所在的等待队列摘下并唤醒, 不在可中断睡眠中则什么也不做
+ * 用于进程退出时叫醒其余线程. 调用者持有大内核锁, pthread 不会同时在另一个系统调用中入睡 */
+void thread_interrupt(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    struct spinlock* guard = pthread->intr_guard;
+    if (guard != NULL) {
+        spin_lock(guard);
+        // 加锁前可能刚被正常唤醒
+        if (pthread->intr_guard == guard) {
+            list_remove(pthread->intr_elem);
+            pthread->intr_guard = NULL;
+            thread_unblock(pthread);
+        }
+        spin_unlock(guard);
+    }
+    intr_set_status(old_status);
+}
+
+// 唤醒 wq 上等得最久的一个线程, 有线程被唤醒则返回 true
+bool wait_queue_wake_one(struct wait_queue* wq) {
+    bool woken = false;
+    enum intr_status old_status = spin_lock_irqsave(&wq->guard);
+    if (!list_empty(&wq->waiters)) {
+        struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, list_pop(&wq->waiters));
+        thread_blocked->intr_guard = NULL;
+        thread_unblock(thread_blocked);
+        woken = true;
+    }
+    spin_unlock_irqrestore(&wq->guard, old_status);
+    return woken;
+}
+
+// 唤醒 wq 上的全部线程, 返回唤醒的个数
+uint32_t wait_queue_wake_all(struct wait_queue* wq) {
+    uint32_t woken = 0;
+    enum intr_status old_status = spin_lock_irqsave(&wq->guard);
+    while (!list_empty(&wq->waiters)) {
+        struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, list_pop(&wq->waiters));
+        thread_blocked->intr_guard = NULL;
+        thread_unblock(thread_blocked);
+        woken++;
+    }
+    spin_unlock_irqrestore(&wq->guard, old_status);
+    return woken;
+}
 
 // 初始化信号量
-void sema_init(struct semaphore* psema, uint8_t value) {
+void sema_init(struct semaphore* psema, uint32_t value) {
     psema->value = value;
-    list_init(&psema->waiters);
+    psema->waiter_cnt = 0;
+    wait_queue_init(&psema->wq);
 }
 
-// 初始化锁 plock
-void lock_init(struct lock* plock) {
+// 初始化锁 plock, name 用于在 lockstat 中标识这把锁
+void lock_init(struct lock* plock, const char* name) {
+    plock->name = name;
     plock->holder = NULL;
     plock->holder_repeat_nr = 0;
     sema_init(&plock->semaphore, 1); // 锁的信号量初值为 1
+    memset(&plock->stat, 0, sizeof(plock->stat));
+    enum intr_status old_status = spin_lock_irqsave(&lock_list_guard);
+    list_append(&lock_list, &plock->stat_tag);
+    spin_unlock_irqrestore(&lock_list_guard, old_status);
+}
+
+// 若 value 大于 0 就用 cmpxchg 将其减 1, 成功返回 true
+static bool sema_trydown(struct semaphore* psema) {
+    uint32_t value = psema->value;
+    while (value != 0) {
+        uint32_t prev = atomic_cmpxchg(&psema->value, value, value - 1);
+        if (prev == value) {
+            return true;
+        }
+        value = prev; // 被别人抢先修改了, 用新值重试
+    }
+    return false;
 }
 
 // 信号量 down 操作
 void sema_down(struct semaphore* psema) {
-    // 关中断来保证原子操作
-    enum intr_status old_status = intr_disable();
-    while(psema->value == 0) { // value 为0, 表示已经被别人持有
-        ASSERT(!elem_find(&psema->waiters, &running_thread()->general_tag));
-        if(elem_find(&psema->waiters, &running_thread()->general_tag)) {
+    // 快路径: 信号量可用时一条 cmpxchg 即可拿到
+    if (sema_trydown(psema)) {
+        return;
+    }
+
+    // 慢路径: 关中断并持有等待队列的 guard, 准备阻塞
+    struct task_struct* cur = running_thread();
+    enum intr_status old_status = spin_lock_irqsave(&psema->wq.guard);
+    // 先登记为等待者再重新检查 value, 与 sema_up 中先加 value 再查 waiter_cnt 的顺序配对,
+    // 两边至少有一方能看到对方的修改, 不会出现 value 已加而无人被唤醒的情况
+    atomic_inc(&psema->waiter_cnt);
+    while(!sema_trydown(psema)) { // value 为0, 表示已经被别人持有
+        ASSERT(!elem_find(&psema->wq.waiters, &cur->general_tag));
+        if(elem_find(&psema->wq.waiters, &cur->general_tag)) {
             PANIC("sema_down: thread blocked has been in waiters_list\n");
         }
-        // 若信号量等于 0, 则当前线程把自己加入该锁的等待队列, 然后阻塞自己
-        list_append(&psema->waiters, &running_thread()->general_tag);
-        thread_block(TASK_BLOCKED); // 阻塞线程, 直到被唤醒
+        // 若信号量等于 0, 则当前线程把自己加入该信号量的等待队列, 然后阻塞自己
+        list_append(&psema->wq.waiters, &cur->general_tag);
+        // 阻塞线程, 直到被唤醒. guard 在阻塞前才释放, 使 sema_up 不会错过本线程
+        thread_block_locked(TASK_BLOCKED, &psema->wq.guard);
+        spin_lock(&psema->wq.guard);
     }
-    // 若 value 为 1 或被唤醒后, 会执行下面的代码, 也就是获得了锁
-    psema->value--;
-    ASSERT(psema->value == 0);
-    intr_set_status(old_status);
+    atomic_dec(&psema->waiter_cnt);
+    spin_unlock_irqrestore(&psema->wq.guard, old_status);
 }
 
 // 信号量 up 操作
 void sema_up(struct semaphore* psema) {
-    // 关中断保证原子操作
-    enum intr_status old_status = intr_disable();
-    ASSERT(psema->value == 0);
-    if(!list_empty(&psema->waiters)) {
-        struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, list_pop(&psema->waiters));
-        thread_unblock(thread_blocked);
+    // lock 前缀的加法同时是全屏障, 保证下面读到的 waiter_cnt 不早于这次加法
+    atomic_inc(&psema->value);
+    // 快路径: 没有等待者就不必碰 guard
+    if (psema->waiter_cnt == 0) {
+        return;
+    }
+    // 慢路径: 唤醒一个等待者, 它醒来后再去争抢 value
+    wait_queue_wake_one(&psema->wq);
+}
+
+// 记录一次优先级调整, 调用者持有 pi_lock
+static void pi_trace(struct task_struct* holder, pid_t waiter, uint8_t new_prio) {
+    struct pi_event* ev = &pi_events[pi_event_idx++ % PI_TRACE_CNT];
+    ev->tick = ticks;
+    ev->holder = holder->pid;
+    ev->waiter = waiter;
+    ev->old_prio = holder->priority;
+    ev->new_prio = new_prio;
+}
+
+// 当前线程即将阻塞在 plock 上, 沿 "持有者 -> 其等待的锁 -> 该锁的持有者" 链
+// 把优先级低于自己的持有者提升到自己的优先级
+static void pi_donate(struct lock* plock) {
+    struct task_struct* cur = running_thread();
+    enum intr_status old_status = spin_lock_irqsave(&pi_lock);
+    cur->blocked_on = plock;
+    struct lock* l = plock;
+    uint32_t depth = 0;
+    while (l != NULL && depth < PI_MAX_DEPTH) {
+        struct task_struct* holder = l->holder;
+        if (holder == NULL || holder->priority >= cur->priority) {
+            break;
+        }
+        pi_trace(holder, cur->pid, cur->priority);
+        pi_stat.boosts++;
+        thread_set_priority(holder, cur->priority);
+        l = holder->blocked_on;
+        depth++;
+    }
+    if (depth > pi_stat.max_depth) {
+        pi_stat.max_depth = depth;
+    }
+    spin_unlock_irqrestore(&pi_lock, old_status);
+}
+
+// 按 pthread 所持各锁上的等待者重新计算其有效优先级, 调用者持有 pi_lock
+static void pi_recompute(struct task_struct* pthread) {
+    uint8_t prio = pthread->base_priority;
+    struct list_elem* lock_elem = pthread->held_locks.head.next;
+    while (lock_elem != &pthread->held_locks.tail) {
+        struct lock* l = elem2entry(struct lock, holder_tag, lock_elem);
+        struct wait_queue* wq = &l->semaphore.wq;
+        spin_lock(&wq->guard);
+        struct list_elem* elem = wq->waiters.head.next;
+        while (elem != &wq->waiters.tail) {
+            struct task_struct* waiter = elem2entry(struct task_struct, general_tag, elem);
+            if (waiter->priority > prio) {
+                prio = waiter->priority;
+            }
+            elem = elem->next;
+        }
+        spin_unlock(&wq->guard);
+        lock_elem = lock_elem->next;
+    }
+    if (prio != pthread->priority) {
+        if (prio < pthread->priority) {
+            pi_trace(pthread, -1, prio);
+            pi_stat.restores++;
+        }
+        thread_set_priority(pthread, prio);
     }
-    psema->value++;
-    ASSERT(psema->value == 1);
-    intr_set_status(old_status);
 }
 
 // 获取锁 plock
 void lock_acquire(struct lock* plock) {
+    struct task_struct* cur = running_thread();
     // 排除曾经自己已经持有锁但还未将其释放的情况
-    if(plock->holder != running_thread()) {
-        sema_down(&plock->semaphore);
-        plock->holder = running_thread();
+    if(plock->holder != cur) {
+        // 锁被占用时先把优先级借给持有者, 再去阻塞
+        bool contended = false;
+        uint32_t wait_start = ticks;
+        if (!sema_trydown(&plock->semaphore)) {
+            contended = true;
+            pi_donate(plock);
+            sema_down(&plock->semaphore);
+        }
+        // 已持有锁, 统计信息由锁本身保护
+        plock->acquire_tick = ticks;
+        plock->stat.acquired++;
+        if (contended) {
+            uint32_t wait = plock->acquire_tick - wait_start;
+            plock->stat.contended++;
+            plock->stat.wait_ticks += wait;
+            if (wait > plock->stat.wait_ticks_max) {
+                plock->stat.wait_ticks_max = wait;
+            }
+        }
+        // 快路径: 没有等待者、自己也没有借来的优先级, 优先级不会变, 不必获取 pi_lock
+        // held_locks 只由线程自己修改和遍历, holder 是单个字的写入, pi_donate 读到的要么是新值要么是旧值
+        if (!contended && plock->semaphore.waiter_cnt == 0 && cur->priority == cur->base_priority) {
+            plock->holder = cur;
+            list_append(&cur->held_locks, &plock->holder_tag);
+        } else {
+            enum intr_status old_status = spin_lock_irqsave(&pi_lock);
+            cur->blocked_on = NULL;
+            plock->holder = cur;
+            list_append(&cur->held_locks, &plock->holder_tag);
+            // 仍在等这把锁的线程曾把优先级借给前任持有者, 现在由自己继承
+            pi_recompute(cur);
+            spin_unlock_irqrestore(&pi_lock, old_status);
+        }
         ASSERT(plock->holder_repeat_nr == 0);
         plock->holder_repeat_nr = 1;
     } else {
@@ -65,13 +382,284 @@ void lock_acquire(struct lock* plock) {
 
 // 释放锁 plock
 void lock_release(struct lock* plock) {
-    ASSERT(plock->holder == running_thread());
+    struct task_struct* cur = running_thread();
+    ASSERT(plock->holder == cur);
     if(plock->holder_repeat_nr > 1) {
         plock->holder_repeat_nr--;
         return;
     }
     ASSERT(plock->holder_repeat_nr == 1);
-    plock->holder = NULL;
     plock->holder_repeat_nr = 0;
+    uint32_t hold = ticks - plock->acquire_tick;
+    plock->stat.hold_ticks += hold;
+    if (hold > plock->stat.hold_ticks_max) {
+        plock->stat.hold_ticks_max = hold;
+    }
+    // 快路径: 没有等待者也没被提升过优先级, 交出锁不影响任何线程的优先级
+    // 若 pi_donate 恰好在此之前读到了自己并提升了优先级, 下一次获取或释放锁时会走慢路径恢复
+    if (plock->semaphore.waiter_cnt == 0 && cur->priority == cur->base_priority) {
+        plock->holder = NULL;
+        list_remove(&plock->holder_tag);
+    } else {
+        enum intr_status old_status = spin_lock_irqsave(&pi_lock);
+        plock->holder = NULL;
+        list_remove(&plock->holder_tag);
+        // 这把锁的等待者借来的优先级随锁一起交出
+        pi_recompute(cur);
+        spin_unlock_irqrestore(&pi_lock, old_status);
+    }
+    ASSERT(plock->semaphore.value == 0);
     sema_up(&plock->semaphore);
-}
\ No newline at end of file
+}
+
+// 打印优先级继承的统计和最近的调整记录
+void pi_trace_dump(void) {
+    enum intr_status old_status = spin_lock_irqsave(&pi_lock);
+    struct pi_stat stat = pi_stat;
+    struct pi_event events[PI_TRACE_CNT];
+    uint32_t end = pi_event_idx;
+    memcpy(events, pi_events, sizeof(events));
+    spin_unlock_irqrestore(&pi_lock, old_status);
+
+    printk("priority inheritance: boosts %d restores %d max depth %d\n",
+           stat.boosts, stat.restores, stat.max_depth);
+    uint32_t i = end > PI_TRACE_CNT ? end - PI_TRACE_CNT : 0;
+    for (; i < end; i++) {
+        struct pi_event* ev = &events[i % PI_TRACE_CNT];
+        if (ev->waiter == -1) {
+            printk("  tick %d: pid %d restored %d -> %d\n", ev->tick, ev->holder, ev->old_prio, ev->new_prio);
+        } else {
+            printk("  tick %d: pid %d boosted %d -> %d by pid %d\n", ev->tick, ev->holder, ev->old_prio, ev->new_prio, ev->waiter);
+        }
+    }
+}
+#define LOCKSTAT_COL     15  // 锁名一列的宽度
+#define LOCKSTAT_NUM_COL 10  // 各数值列的宽度
+
+// lockstat 中一把锁的快照
+struct lock_snapshot {
+    const char* name;
+    struct lock_stat stat;
+};
+
+// 按累计等待时间从大到小排序, 相同时争用次数多的在前
+static bool lock_snapshot_before(struct lock_snapshot* a, struct lock_snapshot* b) {
+    if (a->stat.wait_ticks != b->stat.wait_ticks) {
+        return a->stat.wait_ticks > b->stat.wait_ticks;
+    }
+    return a->stat.contended > b->stat.contended;
+}
+
+// 在 lockstat 中输出一行: 锁名占一列, 其后 val_cnt 个数值各占一列
+static void lockstat_print_row(const char* name, uint32_t* vals, uint32_t val_cnt) {
+    char buf[128];
+    memset(buf, 0, sizeof(buf));
+    uint32_t len = strlen(name);
+    memcpy(buf, name, len < LOCKSTAT_COL - 1 ? len : LOCKSTAT_COL - 1);
+    uint32_t j;
+    for (j = 0; j < val_cnt; j++) {
+        // 补空格到下一列的起始位置, vsprintf 不补结尾的 0, 依赖 buf 已清零
+        len = strlen(buf);
+        while (len < LOCKSTAT_COL + j * LOCKSTAT_NUM_COL) {
+            buf[len++] = ' ';
+        }
+        sprintf(buf + len, "%d", vals[j]);
+    }
+    buf[strlen(buf)] = '\n';
+    sys_write(stdout_no, buf, strlen(buf));
+}
+
+// lockstat 中一把读写锁的快照
+struct rwlock_snapshot {
+    const char* name;
+    struct rwlock_stat stat;
+};
+
+// 打印各读写锁的统计, 按初始化顺序排列
+static void rwlockstat(void) {
+    uint32_t rw_cnt = list_len(&rwlock_list);
+    if (rw_cnt == 0) {
+        return;
+    }
+    struct rwlock_snapshot* snaps = sys_malloc(rw_cnt * sizeof(struct rwlock_snapshot));
+    if (snaps == NULL) {
+        printk("sys_lockstat: sys_malloc for rwlock snapshot failed\n");
+        return;
+    }
+
+    // 各锁的统计由其 guard 保护, 拷贝时在 lock_list_guard 内再获取它
+    uint32_t cnt = 0;
+    enum intr_status old_status = spin_lock_irqsave(&lock_list_guard);
+    struct list_elem* elem = rwlock_list.head.next;
+    while (elem != &rwlock_list.tail && cnt < rw_cnt) {
+        struct rwlock* rw = elem2entry(struct rwlock, stat_tag, elem);
+        snaps[cnt].name = rw->name;
+        spin_lock(&rw->guard);
+        snaps[cnt].stat = rw->stat;
+        spin_unlock(&rw->guard);
+        cnt++;
+        elem = elem->next;
+    }
+    spin_unlock_irqrestore(&lock_list_guard, old_status);
+
+    char* title = "RWLOCK         READ      R_CONT    WRITE     W_CONT    MAX_READERS\n";
+    sys_write(stdout_no, title, strlen(title));
+    uint32_t i;
+    for (i = 0; i < cnt; i++) {
+        struct rwlock_stat* st = &snaps[i].stat;
+        uint32_t vals[5] = {st->read_acquired, st->read_contended, st->write_acquired,
+                            st->write_contended, st->max_readers};
+        lockstat_print_row(snaps[i].name, vals, 5);
+    }
+    sys_free(snaps);
+}
+
+// 打印各锁的争用统计, 争用最严重的排在最前面, 然后是各读写锁的统计, 最后附上优先级继承的统计和调整记录
+void sys_lockstat(void) {
+    uint32_t lock_cnt = list_len(&lock_list);
+    struct lock_snapshot* snaps = sys_malloc(lock_cnt * sizeof(struct lock_snapshot));
+    if (snaps == NULL) {
+        printk("sys_lockstat: sys_malloc for snapshot failed\n");
+        return;
+    }
+
+    // 先在 guard 下把统计拷出来, 排序和输出都不必持有 guard
+    uint32_t cnt = 0;
+    enum intr_status old_status = spin_lock_irqsave(&lock_list_guard);
+    struct list_elem* elem = lock_list.head.next;
+    while (elem != &lock_list.tail && cnt < lock_cnt) {
+        struct lock* plock = elem2entry(struct lock, stat_tag, elem);
+        snaps[cnt].name = plock->name;
+        snaps[cnt].stat = plock->stat;
+        cnt++;
+        elem = elem->next;
+    }
+    spin_unlock_irqrestore(&lock_list_guard, old_status);
+
+    // 锁不多, 插入排序即可
+    uint32_t i, j;
+    for (i = 1; i < cnt; i++) {
+        struct lock_snapshot key = snaps[i];
+        j = i;
+        while (j > 0 && lock_snapshot_before(&key, &snaps[j - 1])) {
+            snaps[j] = snaps[j - 1];
+            j--;
+        }
+        snaps[j] = key;
+    }
+
+    char* title = "NAME           ACQUIRED  CONTENDED WAIT      WAIT_MAX  HOLD      HOLD_MAX\n";
+    sys_write(stdout_no, title, strlen(title));
+    for (i = 0; i < cnt; i++) {
+        struct lock_stat* st = &snaps[i].stat;
+        uint32_t vals[6] = {st->acquired, st->contended, st->wait_ticks,
+                            st->wait_ticks_max, st->hold_ticks, st->hold_ticks_max};
+        lockstat_print_row(snaps[i].name, vals, 6);
+    }
+    sys_free(snaps);
+    rwlockstat();
+    pi_trace_dump();
+}
+
+// 初始化条件变量
+void cond_init(struct condition* cond) {
+    wait_queue_init(&cond->wq);
+}
+
+/* 释放 plock 并在 cond 上睡眠, 被唤醒后重新获取 plock 再返回
+ * 调用者须持有 plock 且没有重入; 醒来不代表条件成立, 应在循环中重新检查 */
+void cond_wait(struct condition* cond, struct lock* plock) {
+    struct task_struct* cur = running_thread();
+    ASSERT(plock->holder == cur && plock->holder_repeat_nr == 1);
+    // 先挂入等待队列再释放 plock, 持 plock 修改条件并 signal 的一方不会错过本线程
+    enum intr_status old_status = spin_lock_irqsave(&cond->wq.guard);
+    list_append(&cond->wq.waiters, &cur->general_tag);
+    lock_release(plock);
+    thread_block_locked(TASK_BLOCKED, &cond->wq.guard);
+    intr_set_status(old_status);
+    lock_acquire(plock);
+}
+
+// 唤醒一个在 cond 上等待的线程
+void cond_signal(struct condition* cond) {
+    wait_queue_wake_one(&cond->wq);
+}
+
+// 唤醒所有在 cond 上等待的线程
+void cond_broadcast(struct condition* cond) {
+    wait_queue_wake_all(&cond->wq);
+}
+
+// 初始化读写锁, name 用于在 lockstat 中标识这把锁
+void rwlock_init(struct rwlock* rw, const char* name) {
+    rw->name = name;
+    spin_init(&rw->guard);
+    rw->readers = 0;
+    rw->writer = NULL;
+    rw->writers_waiting = 0;
+    wait_queue_init(&rw->read_wq);
+    wait_queue_init(&rw->write_wq);
+    memset(&rw->stat, 0, sizeof(rw->stat));
+    enum intr_status old_status = spin_lock_irqsave(&lock_list_guard);
+    list_append(&rwlock_list, &rw->stat_tag);
+    spin_unlock_irqrestore(&lock_list_guard, old_status);
+}
+
+// 获取读锁, 有写者持有或等待时阻塞
+void read_lock(struct rwlock* rw) {
+    enum intr_status old_status = spin_lock_irqsave(&rw->guard);
+    ASSERT(rw->writer != running_thread());
+    rw->stat.read_acquired++;
+    if (rw->writer != NULL || rw->writers_waiting != 0) {
+        rw->stat.read_contended++;
+        do {
+            wait_queue_sleep(&rw->read_wq, &rw->guard);
+        } while (rw->writer != NULL || rw->writers_waiting != 0);
+    }
+    rw->readers++;
+    if (rw->readers > rw->stat.max_readers) {
+        rw->stat.max_readers = rw->readers;
+    }
+    spin_unlock_irqrestore(&rw->guard, old_status);
+}
+
+// 释放读锁, 最后一个读者离开时唤醒一个等待的写者
+void read_unlock(struct rwlock* rw) {
+    enum intr_status old_status = spin_lock_irqsave(&rw->guard);
+    ASSERT(rw->readers > 0 && rw->writer == NULL);
+    if (--rw->readers == 0 && rw->writers_waiting != 0) {
+        wait_queue_wake_one(&rw->write_wq);
+    }
+    spin_unlock_irqrestore(&rw->guard, old_status);
+}
+
+// 获取写锁, 有读者或写者持有时阻塞
+void write_lock(struct rwlock* rw) {
+    struct task_struct* cur = running_thread();
+    enum intr_status old_status = spin_lock_irqsave(&rw->guard);
+    ASSERT(rw->writer != cur);
+    rw->stat.write_acquired++;
+    if (rw->writer != NULL || rw->readers != 0) {
+        rw->stat.write_contended++;
+        rw->writers_waiting++;
+        do {
+            wait_queue_sleep(&rw->write_wq, &rw->guard);
+        } while (rw->writer != NULL || rw->readers != 0);
+        rw->writers_waiting--;
+    }
+    rw->writer = cur;
+    spin_unlock_irqrestore(&rw->guard, old_status);
+}
+
+// 释放写锁, 优先交给下一个写者, 没有写者等待时放行全部读者
+void write_unlock(struct rwlock* rw) {
+    enum intr_status old_status = spin_lock_irqsave(&rw->guard);
+    ASSERT(rw->writer == running_thread());
+    rw->writer = NULL;
+    if (rw->writers_waiting != 0) {
+        wait_queue_wake_one(&rw->write_wq);
+    } else {
+        wait_queue_wake_all(&rw->read_wq);
+    }
+    spin_unlock_irqrestore(&rw->guard, old_status);
+}
@@ -3,24 +3,127 @@
 #include "list.h"
 #include "stdint.h"
 #include "thread.h"
+#include "interrupt.h"
 
-// 信号量结构
-struct semaphore {
-    uint8_t value;
+// 自旋锁, 用于多处理器间的短临界区, 持有期间不能阻塞
+struct spinlock {
+    volatile uint32_t locked; // 0 表示空闲, 1 表示已被持有
+};
+
+// 等待队列, 线程在某个条件上睡眠, 由改变条件的一方唤醒
+struct wait_queue {
     struct list waiters;
+    struct spinlock guard; // 保护 waiters
+};
+
+// 计数信号量
+// value 用原子指令增减, 无竞争时 down/up 不必关中断也不必碰等待队列
+struct semaphore {
+    volatile uint32_t value;
+    volatile uint32_t waiter_cnt; // 已进入慢路径、可能阻塞在 wq 上的线程数
+    struct wait_queue wq;
+};
+
+// 锁的争用统计, 时间均以嘀嗒计
+struct lock_stat {
+    uint32_t acquired;        // 获取锁的次数, 不含持有者的重复申请
+    uint32_t contended;       // 其中锁已被占用、需要等待的次数
+    uint32_t wait_ticks;      // 累计等待时间
+    uint32_t wait_ticks_max;  // 单次最长等待时间
+    uint32_t hold_ticks;      // 累计持有时间
+    uint32_t hold_ticks_max;  // 单次最长持有时间
 };
 
-// 锁结构
+// 锁结构, 支持优先级继承
 struct lock {
+    const char* name;
     struct task_struct* holder; // 锁的持有者
     struct semaphore semaphore; // 用二元信号量实现锁
     uint32_t holder_repeat_nr;  // 锁的持有者重复申请锁的次数
+    struct list_elem holder_tag; // 用于加入持有者的 held_locks 队列
+    uint32_t acquire_tick;      // 本次获取锁的时刻, 释放时据此计算持有时间
+    struct lock_stat stat;      // 由锁本身保护, 只在持有锁时修改
+    struct list_elem stat_tag;  // 用于加入全部锁的队列, 供 lockstat 遍历
+};
+
+#define PI_MAX_DEPTH 8   // 优先级继承沿等待链传递的最大深度
+#define PI_TRACE_CNT 32  // 保留最近多少条优先级调整记录
+
+// 一次优先级调整的记录, new_prio 大于 old_prio 为提升, 否则为恢复
+struct pi_event {
+    uint32_t tick;       // 发生的时刻
+    pid_t holder;        // 被调整的锁持有者
+    pid_t waiter;        // 引起提升的等待者, 恢复时为 -1
+    uint8_t old_prio;
+    uint8_t new_prio;
+};
+
+// 优先级反转的统计信息
+struct pi_stat {
+    uint32_t boosts;     // 提升的次数
+    uint32_t restores;   // 恢复的次数
+    uint32_t max_depth;  // 沿等待链传递的最大深度
+};
+
+// 条件变量, 与一把 struct lock 配合使用
+struct condition {
+    struct wait_queue wq;
+};
+
+// 读写锁的统计信息
+struct rwlock_stat {
+    uint32_t read_acquired;   // 获取读锁的次数
+    uint32_t read_contended;  // 其中需要等待的次数
+    uint32_t write_acquired;  // 获取写锁的次数
+    uint32_t write_contended; // 其中需要等待的次数
+    uint32_t max_readers;     // 同时持有读锁的最大线程数
+};
+
+// 读写锁, 可睡眠, 写者优先: 有写者等待时新来的读者也要等待, 避免写者饿死
+// 不可重入, 持有读锁时再次获取读锁可能与等待中的写者死锁
+struct rwlock {
+    const char* name;
+    struct spinlock guard;        // 保护以下各项
+    uint32_t readers;             // 正持有读锁的线程数
+    struct task_struct* writer;   // 持有写锁的线程
+    uint32_t writers_waiting;     // 正等待写锁的线程数
+    struct wait_queue read_wq;
+    struct wait_queue write_wq;
+    struct rwlock_stat stat;      // 由 guard 保护
+    struct list_elem stat_tag;    // 用于加入全部读写锁的队列, 供 lockstat 遍历
 };
 
-void sema_init(struct semaphore* psema, uint8_t value); 
+void spin_init(struct spinlock* plock);
+void spin_lock(struct spinlock* plock);
+bool spin_trylock(struct spinlock* plock);
+void spin_unlock(struct spinlock* plock);
+enum intr_status spin_lock_irqsave(struct spinlock* plock);
+void spin_unlock_irqrestore(struct spinlock* plock, enum intr_status old_status);
+void kernel_lock(void);
+void kernel_unlock(void);
+void kernel_lock_drop(struct task_struct* cur);
+void kernel_lock_resume(struct task_struct* cur);
+void wait_queue_init(struct wait_queue* wq);
+void wait_queue_sleep(struct wait_queue* wq, struct spinlock* held);
+bool wait_queue_sleep_interruptible(struct wait_queue* wq, struct spinlock* held);
+void thread_interrupt(struct task_struct* pthread);
+bool wait_queue_wake_one(struct wait_queue* wq);
+uint32_t wait_queue_wake_all(struct wait_queue* wq);
+void sema_init(struct semaphore* psema, uint32_t value); 
 void sema_down(struct semaphore* psema);
 void sema_up(struct semaphore* psema);
-void lock_init(struct lock* plock);
+void lock_init(struct lock* plock, const char* name);
 void lock_acquire(struct lock* plock);
 void lock_release(struct lock* plock);
-#endif
\ No newline at end of file
+void pi_trace_dump(void);
+void sys_lockstat(void);
+void cond_init(struct condition* cond);
+void cond_wait(struct condition* cond, struct lock* plock);
+void cond_signal(struct condition* cond);
+void cond_broadcast(struct condition* cond);
+void rwlock_init(struct rwlock* rw, const char* name);
+void read_lock(struct rwlock* rw);
+void read_unlock(struct rwlock* rw);
+void write_lock(struct rwlock* rw);
+void write_unlock(struct rwlock* rw);
+#endif
@@ -11,32 +11,152 @@
 #include "stdio.h"
 #include "file.h"
 #include "fs.h"
+#include "timer.h"
+#include "smp.h"
+#include "atomic.h"
+#include "fpu.h"
 
-// pid 的位图, 最大支持 1024 个 pid
-uint8_t pid_bitmap_bits[128] = {0};
+#define PID_HASH_SIZE 64 // pid 散列表的桶数
+
+// pid 的位图, 第 i 位对应 pid i + 1, 最后一位不用
+uint8_t pid_bitmap_bits[(PID_MAX + 1) / 8] = {0};
 
 // pid 池
 struct pid_pool {
     struct bitmap pid_bitmap; // pid 位图
     uint32_t pid_start; // 起始pid
+    uint32_t next_idx; // 下次从哪一位开始查找, 循环分配使刚释放的 pid 不会马上被复用
     struct lock pid_lock; // 分配 pid 锁
 }pid_pool;
 
 struct task_struct* main_thread;        // 主线程 PCB
-struct task_struct* idle_thread;        // idle 线程
-struct list thread_ready_list;          // 就绪队列
-struct list thread_all_list;            // 所有任务队列
-static struct list_elem* thread_tag;    // 用于保存队列中的线程结点
+struct list thread_all_list;            // 所有任务队列, 运行期间的增删都在系统调用中, 由大内核锁保护
+
+// 以 pid 为键的散列表, 使 pid2thread 不必遍历 thread_all_list
+static struct list pid_hash[PID_HASH_SIZE];
+static struct spinlock pid_hash_lock;
 
 extern void switch_to(struct task_struct* cur, struct task_struct* next);
 extern void init(void);
 
-// 系统空闲时运行的线程
-static void idle(void* arg UNUSED) {
+// 是否有任一 cpu 的就绪队列非空
+bool thread_has_ready(void) {
+    uint8_t i;
+    for (i = 0; i < cpu_cnt; i++) {
+        if (cpus[i].ready_cnt != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 每个 cpu 空闲时运行的循环, BSP 的 idle 线程和 AP 的启动栈都会进入这里
+void cpu_idle(void) {
+    struct cpu* c = this_cpu();
     while (1) {
         thread_block(TASK_BLOCKED);
-        // 执行 hlt 时必须要保证目前处在开中断的情况下
-        asm volatile ("sti; hlt" : : : "memory");
+        intr_disable();
+        // 先声明自己要停机, 再检查一遍各就绪队列,
+        // 与入队者的 "先入队, 再看 idling" 配对, 避免错过唤醒
+        c->idling = true;
+        smp_mb();
+        if (!thread_has_ready()) {
+            // 没有就绪任务, 按最近的睡眠期限把时钟改为单次模式, 省去无用的嘀嗒
+            if (c->id == 0) {
+                timer_idle_enter();
+            }
+            // 执行 hlt 时必须要保证目前处在开中断的情况下
+            asm volatile ("sti; hlt" : : : "memory");
+            if (c->id == 0) {
+                timer_idle_exit();
+            }
+        }
+        c->idling = false;
+    }
+}
+
+// 系统空闲时运行的线程
+static void idle(void* arg UNUSED) {
+    cpu_idle();
+}
+
+// 把 pthread 加入 cpu c 的就绪队列, head 为 true 时放在队首
+static void ready_enqueue(struct cpu* c, struct task_struct* pthread, bool head) {
+    spin_lock(&c->rq_lock);
+    ASSERT(!elem_find(&c->ready_list, &pthread->general_tag));
+    if (head) {
+        list_push(&c->ready_list, &pthread->general_tag);
+    } else {
+        list_append(&c->ready_list, &pthread->general_tag);
+    }
+    c->ready_cnt++;
+    spin_unlock(&c->rq_lock);
+}
+
+// 从 cpu c 的就绪队列首取出一个任务, 队列为空时返回 NULL
+static struct task_struct* ready_dequeue(struct cpu* c) {
+    struct task_struct* pthread = NULL;
+    spin_lock(&c->rq_lock);
+    if (!list_empty(&c->ready_list)) {
+        pthread = elem2entry(struct task_struct, general_tag, list_pop(&c->ready_list));
+        c->ready_cnt--;
+    }
+    spin_unlock(&c->rq_lock);
+    return pthread;
+}
+
+// 本 cpu 无事可做时从其它 cpu 的就绪队列尾部窃取一个任务
+// 队首的任务很快会在原 cpu 上运行, 队尾的则还要等很久
+static struct task_struct* ready_steal(struct cpu* self) {
+    uint8_t i;
+    for (i = 0; i < cpu_cnt; i++) {
+        struct cpu* c = &cpus[i];
+        // 先无锁地窥探, 拿不到锁就换下一个, 不与对方争抢
+        if (c == self || c->ready_cnt == 0 || !spin_trylock(&c->rq_lock)) {
+            continue;
+        }
+        struct task_struct* pthread = NULL;
+        if (!list_empty(&c->ready_list)) {
+            struct list_elem* elem = c->ready_list.tail.prev;
+            list_remove(elem);
+            c->ready_cnt--;
+            pthread = elem2entry(struct task_struct, general_tag, elem);
+        }
+        spin_unlock(&c->rq_lock);
+        if (pthread != NULL) {
+            return pthread;
+        }
+    }
+    return NULL;
+}
+
+// 把 pthread 从它所在的就绪队列中删除
+static bool ready_remove(struct task_struct* pthread) {
+    uint8_t i;
+    bool found = false;
+    for (i = 0; i < cpu_cnt; i++) {
+        struct cpu* c = &cpus[i];
+        spin_lock(&c->rq_lock);
+        if (elem_find(&c->ready_list, &pthread->general_tag)) {
+            list_remove(&pthread->general_tag);
+            c->ready_cnt--;
+            found = true;
+        }
+        spin_unlock(&c->rq_lock);
+    }
+    return found;
+}
+
+// 有新任务入队后, 用 IPI 唤醒一个正在停机的 cpu, 让它来窃取
+static void kick_idle_cpu(struct cpu* self) {
+    uint8_t i;
+    smp_mb();
+    for (i = 0; i < cpu_cnt; i++) {
+        struct cpu* c = &cpus[i];
+        if (c != self && c->started && c->idling) {
+            smp_send_reschedule(c);
+            return;
+        }
     }
 }
 
@@ -59,17 +179,38 @@ static void kernel_thread(thread_func* function, void* func_arg) {
 // 初始化 pid 池
 static void pid_pool_init(void) {
     pid_pool.pid_start = 1;
+    pid_pool.next_idx = 0;
     pid_pool.pid_bitmap.bits = pid_bitmap_bits;
-    pid_pool.pid_bitmap.btmp_bytes_len = 128;
+    pid_pool.pid_bitmap.btmp_bytes_len = sizeof(pid_bitmap_bits);
     bitmap_init(&pid_pool.pid_bitmap);
-    lock_init(&pid_pool.pid_lock);
+    lock_init(&pid_pool.pid_lock, "pid_pool");
+
+    uint32_t i;
+    for (i = 0; i < PID_HASH_SIZE; i++) {
+        list_init(&pid_hash[i]);
+    }
+    spin_init(&pid_hash_lock);
 }
 
-// 分配 pid
+// 分配 pid, 从上次分配的位置往后循环查找空闲的 pid
 static pid_t allocate_pid(void) {
     lock_acquire(&pid_pool.pid_lock);
-    int32_t bit_idx = bitmap_scan(&pid_pool.pid_bitmap, 1);
+    uint32_t bit_idx = pid_pool.next_idx;
+    uint32_t scanned = 0;
+    while (bitmap_scan_test(&pid_pool.pid_bitmap, bit_idx)) {
+        // 整字节都已分配时一次跳过 8 位
+        uint32_t step = 1;
+        if (bit_idx % 8 == 0 && bit_idx + 8 <= PID_MAX && pid_bitmap_bits[bit_idx / 8] == 0xff) {
+            step = 8;
+        }
+        scanned += step;
+        if (scanned >= PID_MAX) {
+            PANIC("allocate_pid: no free pid");
+        }
+        bit_idx = (bit_idx + step) % PID_MAX;
+    }
     bitmap_set(&pid_pool.pid_bitmap, bit_idx, 1);
+    pid_pool.next_idx = (bit_idx + 1) % PID_MAX;
     lock_release(&pid_pool.pid_lock);
     return (bit_idx + pid_pool.pid_start);
 }
@@ -87,6 +228,15 @@ pid_t fork_pid(void) {
     return allocate_pid();
 }
 
+// 把新任务加入全部任务队列和 pid 散列表, 此后才能被 ps 和 pid2thread 看到
+void thread_register(struct task_struct* pthread) {
+    ASSERT(!elem_find(&thread_all_list, &pthread->all_list_tag));
+    list_append(&thread_all_list, &pthread->all_list_tag);
+    enum intr_status old_status = spin_lock_irqsave(&pid_hash_lock);
+    list_append(&pid_hash[pthread->pid % PID_HASH_SIZE], &pthread->pid_tag);
+    spin_unlock_irqrestore(&pid_hash_lock, old_status);
+}
+
 // 初始化线程栈 thread_stack
 // 将待执行的函数和参数放到 thread_stack 中相应的位置
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg) {
@@ -105,9 +255,20 @@ void thread_create(struct task_struct* pthread, thread_func function, void* func
     kthread_stack->edi = 0;
 }
 
+// pthread 所在进程是否正在退出, 是则它应放弃可中断的等待, 尽快回到系统调用出口结束自己
+bool thread_kill_pending(struct task_struct* pthread) {
+    return pthread->group_leader->group_exiting;
+}
+
 // 初始化线程基本信息
 void init_thread(struct task_struct* pthread, char* name, int prio) {
     memset(pthread, 0, sizeof(*pthread));
+    // allocate_pid 要获取 pid_lock, 获取锁会记入 held_locks, 所以要先初始化它
+    list_init(&pthread->held_locks);
+    list_init(&pthread->children);
+    list_init(&pthread->zombies);
+    list_init(&pthread->threads);
+    pthread->group_leader = pthread;
     pthread->pid = allocate_pid();
     strcpy(pthread->name, name);
 
@@ -120,9 +281,13 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
     // self_kstack 是线程自己在内核态下使用的栈顶地址
     pthread->self_kstack = (uint32_t*)((uint32_t)pthread + PG_SIZE);
     pthread->priority = prio;
+    pthread->base_priority = prio;
     pthread->ticks = prio;
+    pthread->blocked_on = NULL;
     pthread->elapsed_ticks = 0;
     pthread->pgdir = NULL;
+    pthread->cpu_id = this_cpu()->id;
+    pthread->fpu_cpu = NO_FPU_CPU;
 
     // 预留标准输入输出
     pthread->fd_table[0] = 0;
@@ -151,14 +316,10 @@ struct task_struct* thread_start(char* name,
     init_thread(thread, name, prio);
     thread_create(thread, function, func_arg);
 
-    // 确保之前不在队列中
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
     // 加入就绪线程队列
-    list_append(&thread_ready_list, &thread->general_tag);
-    // 确保之前不在队列中
-    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
+    thread_ready(thread);
     // 加入全部线程队列
-    list_append(&thread_all_list, &thread->all_list_tag);
+    thread_register(thread);
 
     return thread;
 }
@@ -167,50 +328,68 @@ struct task_struct* thread_start(char* name,
 static void make_main_thread(void) {
     main_thread = running_thread();
     init_thread(main_thread, "main", 31);
-
-    ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
-    list_append(&thread_all_list, &main_thread->all_list_tag);
+    main_thread->on_cpu = 1;
+    thread_register(main_thread);
 }
 
 // 实现线程调度
 void schedule(void) {
     ASSERT(intr_get_status() == INTR_OFF);
 
+    struct cpu* c = this_cpu();
     struct task_struct* cur = running_thread();
     if(cur->status == TASK_RUNNING) {
         // 若此线程只是 CPU 时间片到了, 将其加入到就绪队尾
-        ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-        list_append(&thread_ready_list, &cur->general_tag);
         cur->ticks = cur->priority;
         cur->status = TASK_READY;
+        // idle 线程专属于本 cpu, 不进入就绪队列
+        if (cur != c->idle_thread) {
+            ready_enqueue(c, cur, false);
+        }
     } else {
         // 若此线程阻塞, 不需要将其加入队列
     }
 
-    // 如果就绪队列中没有可运行的任务, 就唤醒 idle
-    if (list_empty(&thread_ready_list)) {
-        thread_unblock(idle_thread);
+    // 本 cpu 的就绪队列为空就去别的 cpu 窃取, 仍没有可运行的任务就运行 idle
+    struct task_struct* next = ready_dequeue(c);
+    if (next == NULL) {
+        next = ready_steal(c);
+    }
+    if (next == NULL) {
+        next = c->idle_thread;
     }
-
-    ASSERT(!list_empty(&thread_ready_list));
-    thread_tag = NULL;
-    thread_tag = list_pop(&thread_ready_list);
-    struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
     next->status = TASK_RUNNING;
+    if (next == cur) {
+        return;
+    }
+
+    // next 可能刚在别的 cpu 上被换下, 等它在 switch_to 中保存完上下文
+    while (next->on_cpu) {
+        cpu_relax();
+        smp_tlb_poll();
+    }
+    next->on_cpu = 1;
+    next->cpu_id = c->id;
 
     // 激活任务页表等
     process_activate(next);
+    fpu_switch(cur, next);
 
+    kernel_lock_drop(cur);
     switch_to(cur, next);
+    // 又被调度上 cpu, 可能已经换了一个 cpu
+    kernel_lock_resume(cur);
 }
 
 // 主动让出 cpu, 换其它线程运行
 void thread_yield(void) {
     struct task_struct* cur = running_thread();
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-    list_append(&thread_ready_list, &cur->general_tag);
+    struct cpu* c = this_cpu();
     cur->status = TASK_READY;
+    if (cur != c->idle_thread) {
+        ready_enqueue(c, cur, false);
+    }
     schedule();
     intr_set_status(old_status);
 }
@@ -290,17 +469,30 @@ void thread_exit(struct task_struct* thread_over, bool need_schedule) {
     // 要保证 schedule 在关中断情况下调用
     intr_disable();
     thread_over->status = TASK_DIED;
-
-    // 如果 thread_over 不是当前线程, 就有可能还在就绪队列中, 将其从中删除
-    if (elem_find(&thread_ready_list, &thread_over->general_tag)) {
-        list_remove(&thread_over->general_tag);
+    // 其 pcb 即将回收, 不能再让 schedule 把浮点寄存器存进去
+    fpu_reset(thread_over);
+
+    // 如果 thread_over 不是当前线程, 就有可能还在某个 cpu 的就绪队列中, 将其从中删除
+    if (thread_over != running_thread()) {
+        ready_remove(thread_over);
+        // 它可能刚在别的 cpu 上阻塞, 要等其换下 cpu 后才能回收 pcb
+        while (thread_over->on_cpu) {
+            cpu_relax();
+            smp_tlb_poll();
+        }
     }
-    if (thread_over->pgdir) { // 如果是进程, 回收进程的页表
+    // 如果是进程, 回收进程的页表. 进程内的其它线程与主线程共用页表, 不回收
+    if (thread_over->pgdir && thread_over->group_leader == thread_over) {
+        // 别的 cpu 上的内核线程可能还借用着这个页目录
+        pgdir_unload(addr_v2p((uint32_t)thread_over->pgdir));
         mfree_page(PF_KERNEL, thread_over->pgdir, 1);
     }
 
-    // 从 all_thread_list 中去掉此任务
+    // 从 all_thread_list 和 pid 散列表中去掉此任务
     list_remove(&thread_over->all_list_tag);
+    enum intr_status old_status = spin_lock_irqsave(&pid_hash_lock);
+    list_remove(&thread_over->pid_tag);
+    spin_unlock_irqrestore(&pid_hash_lock, old_status);
 
     // 回收 pcb 所在的页, 主线程的 pcb 不在堆中, 跨过
     if (thread_over != main_thread) {
@@ -317,19 +509,25 @@ void thread_exit(struct task_struct* thread_over, bool need_schedule) {
     }
 }
 
-// 比对任务的 pid
-static bool pid_check(struct list_elem* pelem, int32_t pid) {
-    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
-    return pthread->pid == pid;
-}
-
 // 根据 pid 找 pcb, 若找到则返回该 pcb, 否则返回 NULL
+// 返回的 pcb 由大内核锁保证不被回收
 struct task_struct* pid2thread(int32_t pid) {
-    struct list_elem* pelem = list_traversal(&thread_all_list, pid_check, pid);
-    if (pelem == NULL) {
+    if (pid <= 0 || pid > PID_MAX) {
         return NULL;
     }
-    struct task_struct* thread = elem2entry(struct task_struct, all_list_tag, pelem);
+    struct task_struct* thread = NULL;
+    enum intr_status old_status = spin_lock_irqsave(&pid_hash_lock);
+    struct list* bucket = &pid_hash[pid % PID_HASH_SIZE];
+    struct list_elem* pelem = bucket->head.next;
+    while (pelem != &bucket->tail) {
+        struct task_struct* pthread = elem2entry(struct task_struct, pid_tag, pelem);
+        if (pthread->pid == pid) {
+            thread = pthread;
+            break;
+        }
+        pelem = pelem->next;
+    }
+    spin_unlock_irqrestore(&pid_hash_lock, old_status);
     return thread;
 }
 
@@ -337,22 +535,53 @@ struct task_struct* pid2thread(int32_t pid) {
 void thread_init(void) {
     put_str("thread_init start\n");
 
-    list_init(&thread_ready_list);
+    uint8_t i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        cpus[i].id = i;
+        spin_init(&cpus[i].rq_lock);
+        list_init(&cpus[i].ready_list);
+        cpus[i].cr3 = KERNEL_PGDIR_PADDR; // BSP 的 loader 和 AP 的启动代码都装入内核页目录
+    }
+    cpus[0].started = true;
     list_init(&thread_all_list);
     pid_pool_init();
 
+    // main 线程的 pcb 要在 init 之后才初始化, 先让 this_cpu() 指向 BSP
+    // 创建 init 时 get_kernel_pages 和 allocate_pid 会以 main 的身份获取锁,
+    // 锁的持有记录和优先级继承要用到的几项也须先就绪, 其余的留给 make_main_thread
+    struct task_struct* cur = running_thread();
+    cur->cpu_id = 0;
+    list_init(&cur->held_locks);
+    cur->blocked_on = NULL;
+    cur->base_priority = cur->priority = 31;
+
     // 先创建第一个用户进程 init
     process_execute(init, "init"); // init 进程的 pid 是 1
 
     // 将当前 main 函数创建为线程
     make_main_thread();
 
-    // 创建 idle 线程
-    idle_thread = thread_start("idle", 10, idle, NULL);
+    // 创建 BSP 的 idle 线程, 它不进入就绪队列, 只在无事可做时由 schedule 选中
+    struct task_struct* idle_thread = get_kernel_pages(1);
+    init_thread(idle_thread, "idle", 10);
+    thread_create(idle_thread, idle, NULL);
+    thread_register(idle_thread);
+    cpus[0].idle_thread = idle_thread;
 
     put_str("thread_init done\n");
 }
 
+// 为 cpu_id 号 AP 创建 idle 线程, AP 启动后直接在其 pcb 所在页的栈上运行
+struct task_struct* thread_ap_idle_create(uint8_t cpu_id) {
+    struct task_struct* idle_thread = get_kernel_pages(1);
+    init_thread(idle_thread, "idle", 10);
+    idle_thread->status = TASK_RUNNING;
+    idle_thread->cpu_id = cpu_id;
+    idle_thread->on_cpu = 1;
+    thread_register(idle_thread);
+    return idle_thread;
+}
+
 // 当前线程将自己阻塞, 标志其状态为 stat
 void thread_block(enum task_status stat) {
     ASSERT(((stat == TASK_BLOCKED) || 
@@ -365,6 +594,19 @@ void thread_block(enum task_status stat) {
     intr_set_status(old_status);
 }
 
+// 同 thread_block, 但调用者已关中断并持有自旋锁 held
+// 先置好阻塞状态再释放 held, 使持有 held 的唤醒者看到的一定是阻塞状态
+// 返回时 held 已释放, 中断仍为关闭
+void thread_block_locked(enum task_status stat, struct spinlock* held) {
+    ASSERT(((stat == TASK_BLOCKED) || 
+           (stat == TASK_WAITING) || 
+           (stat == TASK_HANGING)));
+    ASSERT(intr_get_status() == INTR_OFF);
+    running_thread()->status = stat;
+    spin_unlock(held);
+    schedule();
+}
+
 // 将线程解除阻塞
 void thread_unblock(struct task_struct* pthread) {
     enum intr_status old_status = intr_disable();
@@ -372,13 +614,41 @@ void thread_unblock(struct task_struct* pthread) {
            (pthread->status == TASK_WAITING) || 
            (pthread->status == TASK_HANGING)));
     if(pthread->status != TASK_READY) {
-        ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        if(elem_find(&thread_ready_list, &pthread->general_tag)) {
-            PANIC("thread_unblock: blocked thread in ready_list\n");
-        }
-        // 放在就绪队列最前面, 使其尽快得到调度
-        list_push(&thread_ready_list, &pthread->general_tag);
+        // 先置状态再入队, 入队后它随时可能被别的 cpu 取走
         pthread->status = TASK_READY;
+        // 放在就绪队列最前面, 使其尽快得到调度
+        struct cpu* c = this_cpu();
+        ready_enqueue(c, pthread, true);
+        kick_idle_cpu(c);
     }
     intr_set_status(old_status);
 }
+
+// 调整 pthread 的有效优先级, 供锁的优先级继承使用
+// 提升时补足其时间片, 若它正在就绪队列中就移到本 cpu 队首, 使其尽快运行并释放锁
+void thread_set_priority(struct task_struct* pthread, uint8_t prio) {
+    enum intr_status old_status = intr_disable();
+    bool boost = prio > pthread->priority;
+    pthread->priority = prio;
+    if (boost) {
+        if (pthread->ticks < prio) {
+            pthread->ticks = prio;
+        }
+        // 它可能正被别的 cpu 取走, 只有确实从队列中摘下来了才重新入队
+        if (pthread->status == TASK_READY && ready_remove(pthread)) {
+            struct cpu* c = this_cpu();
+            ready_enqueue(c, pthread, true);
+            kick_idle_cpu(c);
+        }
+    }
+    intr_set_status(old_status);
+}
+
+// 把新建的任务加入当前 cpu 的就绪队尾
+void thread_ready(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    struct cpu* c = this_cpu();
+    ready_enqueue(c, pthread, false);
+    kick_idle_cpu(c);
+    intr_set_status(old_status);
+}
@@ -4,10 +4,12 @@
 #include "bitmap.h"
 #include "list.h"
 #include "memory.h"
+#include "fpu.h"
 #include "stdint.h"
 
 #define TASK_NAME_LEN 16
 #define MAX_FILES_OPEN_PER_PROC 8
+#define PID_MAX 32767 // 最大的 pid, 受 pid_t 的范围限制
 // 自定义通用函数类型, 在线程函数中作为形参类型
 typedef void thread_func(void*);
 typedef int16_t pid_t;
@@ -69,21 +71,58 @@ struct thread_stack {
     void* func_arg; // 由 kernel_thread 所调用的函数所需的参数
 };
 
+struct spinlock;
+struct lock;
+struct aio_ctx;
+
 // 进程或线程的 PCB
 struct task_struct {
     uint32_t* self_kstack; // 各内核线程都用自己的内核栈
+    // 是否正在某个 cpu 上运行, 由 switch_to 在保存完上下文后清 0
+    // switch_to 依赖其在 task_struct 中的偏移为 4
+    volatile uint32_t on_cpu;
     pid_t pid;
     enum task_status status;
     char name[16];
-    uint8_t priority; // 线程优先级
+    uint8_t priority; // 线程优先级, 可能因优先级继承而被临时提升
+    uint8_t base_priority; // 线程本来的优先级
     uint8_t ticks; // 每次在处理器上执行的时间嘀嗒数
+    uint8_t cpu_id; // 最近一次运行所在 cpu 的逻辑编号
+    bool bkl_held; // 是否持有大内核锁, 即正在执行系统调用
+    uint8_t fpu_cpu; // 其浮点状态还留在哪个 cpu 的寄存器中, NO_FPU_CPU 表示不在任何 cpu 上
+    bool fpu_used; // 是否用过浮点或 SSE 指令, 即 fpu 中是否有有效的状态
+    bool group_exiting; // 仅主线程中有效, 表示所在进程正在退出, 其余线程须尽快结束
 
     uint32_t elapsed_ticks; // 此任务上 cpu 运行后至今占用了多少嘀嗒数
+    uint32_t wake_tick; // 睡眠时的唤醒时刻, 仅在 sleep_list 中时有效
+
+    // 可中断睡眠时所在等待队列的自旋锁和本线程在队列中的结点, 进程退出时据此把它摘下唤醒
+    // 不在可中断睡眠中时 intr_guard 为 NULL, 两项都在 intr_guard 所指的锁下修改
+    struct spinlock* intr_guard;
+    struct list_elem* intr_elem;
+
+    struct lock* blocked_on; // 正在等待的锁, 优先级继承沿此链传递
+    struct list held_locks; // 持有的锁, 释放锁时据此重新计算继承来的优先级
 
     int32_t fd_table[MAX_FILES_OPEN_PER_PROC]; // 文件描述符数组
 
     struct list_elem general_tag; // 用于线程在一般队列中的结点
     struct list_elem all_list_tag; // 用于线程在 thread_all_list 中的结点
+    struct list_elem pid_tag; // 用于线程在 pid 散列表中的结点
+    struct list_elem sibling_tag; // 用于进程在父进程的 children 或 zombies 队列中的结点
+
+    // 以下两个队列由大内核锁保护
+    struct list children; // 尚未退出的子进程
+    struct list zombies; // 已退出、等待父进程回收的子进程
+
+    // 进程内的线程共用主线程的页表、用户虚拟地址池、堆、文件描述符和工作目录
+    // 以下各项由大内核锁保护
+    struct task_struct* group_leader; // 所在进程的主线程, 进程和内核线程的主线程就是自己
+    struct list threads; // 仅主线程中有效, 本进程的其余线程
+    struct list_elem thread_tag; // 用于线程在主线程的 threads 队列中的结点
+    struct task_struct* joiner; // 正在 thread_join 中等待本线程结束的线程
+    int32_t thread_retval; // 线程结束时的返回值
+    struct aio_ctx* aio; // 仅主线程中有效, 本进程的异步 io 上下文, 首次提交时创建
 
     uint32_t* pgdir; // 进程自己页表的虚拟地址
     struct virtual_addr userprog_vaddr; // 用户进程的虚拟地址
@@ -91,10 +130,10 @@ struct task_struct {
     uint32_t cwd_inode_nr; // 进程所在的工作目录的 inode 编号
     int16_t parent_pid; // 父进程 pid
     int8_t exit_status; // 进程结束时自己调用 exit 传入的参数
+    struct fpu_state fpu; // 换下 cpu 时保存的浮点和 SSE 寄存器
     uint32_t stack_magic; // 栈的边界标记, 用于检测栈的溢出
 };
 
-extern struct list thread_ready_list;
 extern struct list thread_all_list;
 
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
@@ -104,11 +143,19 @@ struct task_struct* running_thread(void);
 void schedule(void);
 void thread_init(void);
 void thread_block(enum task_status stat);
+void thread_block_locked(enum task_status stat, struct spinlock* held);
 void thread_unblock(struct task_struct* pthread);
+void thread_ready(struct task_struct* pthread);
+void thread_set_priority(struct task_struct* pthread, uint8_t prio);
+bool thread_kill_pending(struct task_struct* pthread);
+bool thread_has_ready(void);
+struct task_struct* thread_ap_idle_create(uint8_t cpu_id);
+void cpu_idle(void);
 void thread_yield(void);
 pid_t fork_pid(void);
 void sys_ps(void);
 void thread_exit(struct task_struct* thread_over, bool need_schedule);
 struct task_struct* pid2thread(int32_t pid);
+void thread_register(struct task_struct* pthread);
 void release_pid(pid_t pid);
 #endif
@@ -0,0 +1,115 @@
+#include "workqueue.h"
+#include "thread.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "print.h"
+#include "string.h"
+
+/* 工作队列把不必在系统调用或中断处理中同步完成的工作推迟给内核线程执行
+ * queue_work 只持有自旋锁, 可以在中断处理程序和软中断中调用.
+ * 工作在线程上下文中执行, 可以睡眠, 也可以获取 struct lock */
+
+#define SYSTEM_WQ_WORKERS 2
+
+// 供内核各处共用的工作队列, 工作在大内核锁下执行, 可以直接调用文件系统等
+struct workqueue* system_wq;
+
+// 初始化工作 w, 执行时调用 func(arg)
+void work_init(struct work* w, work_func* func, void* arg) {
+    w->func = func;
+    w->arg = arg;
+    w->pending = false;
+}
+
+// 工作线程, 不断取出 wq 中的工作执行
+static void worker_thread(void* arg) {
+    struct workqueue* wq = arg;
+    while (1) {
+        enum intr_status old_status = spin_lock_irqsave(&wq->guard);
+        while (list_empty(&wq->works)) {
+            wait_queue_sleep(&wq->more_work, &wq->guard);
+        }
+        struct work* w = elem2entry(struct work, tag, list_pop(&wq->works));
+        // 先清 pending, 使执行期间该工作可以被再次提交
+        w->pending = false;
+        work_func* func = w->func;
+        void* func_arg = w->arg;
+        wq->busy++;
+        spin_unlock_irqrestore(&wq->guard, old_status);
+
+        if (wq->need_bkl) {
+            old_status = intr_disable();
+            kernel_lock();
+            intr_set_status(old_status);
+        }
+        func(func_arg);
+        if (wq->need_bkl) {
+            old_status = intr_disable();
+            kernel_unlock();
+            intr_set_status(old_status);
+        }
+
+        old_status = spin_lock_irqsave(&wq->guard);
+        wq->busy--;
+        bool drained = list_empty(&wq->works) && wq->busy == 0;
+        spin_unlock_irqrestore(&wq->guard, old_status);
+        if (drained) {
+            wait_queue_wake_all(&wq->drained);
+        }
+    }
+}
+
+// 创建名为 name、有 worker_cnt 个工作线程的工作队列, 须在初始化阶段或大内核锁下调用
+// need_bkl 为 true 时工作在大内核锁下执行
+struct workqueue* workqueue_create(const char* name, uint32_t worker_cnt, bool need_bkl) {
+    ASSERT(worker_cnt > 0 && strlen(name) < TASK_NAME_LEN);
+    struct workqueue* wq = sys_malloc(sizeof(struct workqueue));
+    if (wq == NULL) {
+        return NULL;
+    }
+    wq->name = name;
+    spin_init(&wq->guard);
+    list_init(&wq->works);
+    wq->busy = 0;
+    wq->need_bkl = need_bkl;
+    wait_queue_init(&wq->more_work);
+    wait_queue_init(&wq->drained);
+    while (worker_cnt-- > 0) {
+        thread_start((char*)name, 31, worker_thread, wq);
+    }
+    return wq;
+}
+
+// 把 w 提交到 wq, w 已在队列中等待时不重复提交, 返回 false
+bool queue_work(struct workqueue* wq, struct work* w) {
+    enum intr_status old_status = spin_lock_irqsave(&wq->guard);
+    if (w->pending) {
+        spin_unlock_irqrestore(&wq->guard, old_status);
+        return false;
+    }
+    w->pending = true;
+    list_append(&wq->works, &w->tag);
+    spin_unlock_irqrestore(&wq->guard, old_status);
+    wait_queue_wake_one(&wq->more_work);
+    return true;
+}
+
+// 等待 wq 中已提交的工作全部执行完毕, 不能在 wq 的工作中调用
+void flush_workqueue(struct workqueue* wq) {
+    enum intr_status old_status = spin_lock_irqsave(&wq->guard);
+    while (!list_empty(&wq->works) || wq->busy != 0) {
+        wait_queue_sleep(&wq->drained, &wq->guard);
+    }
+    spin_unlock_irqrestore(&wq->guard, old_status);
+}
+
+// 创建共用的工作队列, 须在线程和内存管理初始化之后调用
+void workqueue_init(void) {
+    put_str("workqueue_init start\n");
+    system_wq = workqueue_create("kworker", SYSTEM_WQ_WORKERS, true);
+    if (system_wq == NULL) {
+        PANIC("workqueue_init: create system_wq failed");
+    }
+    put_str("workqueue_init done\n");
+}
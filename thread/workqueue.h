@@ -0,0 +1,36 @@
+#ifndef __THREAD_WORKQUEUE_H
+#define __THREAD_WORKQUEUE_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "sync.h"
+
+typedef void work_func(void* arg);
+
+// 一项推迟执行的工作, 由提交者分配, 执行完之前不能释放
+struct work {
+    struct list_elem tag;    // 用于加入工作队列的 works 队列
+    work_func* func;
+    void* arg;
+    bool pending;            // 是否已在队列中等待执行, 由所在工作队列的 guard 保护
+};
+
+// 工作队列, 由一组内核线程依次取出其中的工作执行
+struct workqueue {
+    const char* name;
+    struct spinlock guard;         // 保护 works、busy 及各工作的 pending
+    struct list works;             // 待执行的工作
+    uint32_t busy;                 // 正在执行工作的线程数
+    bool need_bkl;                 // 工作是否像系统调用那样在大内核锁下执行
+    struct wait_queue more_work;   // 空闲的工作线程在此等待
+    struct wait_queue drained;     // flush_workqueue 在此等待队列清空
+};
+
+extern struct workqueue* system_wq;
+
+void work_init(struct work* w, work_func* func, void* arg);
+struct workqueue* workqueue_create(const char* name, uint32_t worker_cnt, bool need_bkl);
+bool queue_work(struct workqueue* wq, struct work* w);
+void flush_workqueue(struct workqueue* wq);
+void workqueue_init(void);
+#endif
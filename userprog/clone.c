@@ -0,0 +1,133 @@
+#include "clone.h"
+#include "process.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "global.h"
+#include "thread.h"
+#include "wait_exit.h"
+
+extern void intr_exit(void);
+
+/* 进程内的线程
+ * clone 出的线程有自己的 pcb、内核栈和用户栈, 与主线程共用页表、用户虚拟地址池、堆、
+ * 文件描述符和工作目录, 后几项都通过 group_leader 访问主线程中的那一份.
+ * 线程结束后挂起等待 thread_join 回收; 进程退出时由主线程等其余线程都结束后统一回收 */
+
+// 新线程第一次被调度时从这里经 intr_exit 进入用户态, 中断栈已由 sys_clone 填好
+static void start_clone(void* arg UNUSED) {
+    struct task_struct* cur = running_thread();
+    struct intr_stack* proc_stack = (struct intr_stack*)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
+    asm volatile("movl %0, %%esp; jmp intr_exit" : : "g" (proc_stack) : "memory");
+}
+
+// 在当前进程中创建一个线程, 从用户态的 entry 处开始执行, 用户栈顶为 stack_top
+// 成功返回新线程的 id(即其 pid), 失败返回 -1
+pid_t sys_clone(void* entry, void* stack_top) {
+    struct task_struct* cur = running_thread();
+    struct task_struct* leader = cur->group_leader;
+    if (cur->pgdir == NULL || leader->group_exiting ||
+        (uint32_t)entry < USER_VADDR_START || (uint32_t)entry >= 0xc0000000 ||
+        (uint32_t)stack_top <= USER_VADDR_START || (uint32_t)stack_top > 0xc0000000) {
+        return -1;
+    }
+
+    struct task_struct* thread = get_kernel_pages(1);
+    if (thread == NULL) {
+        return -1;
+    }
+    init_thread(thread, leader->name, leader->base_priority);
+    thread_create(thread, start_clone, NULL);
+    thread->pgdir = leader->pgdir;
+    thread->userprog_vaddr = leader->userprog_vaddr; // 复制的只是位图的指针, 位图本身是共用的
+    thread->group_leader = leader;
+    thread->parent_pid = leader->pid;
+
+    // 构建进入用户态的中断栈
+    struct intr_stack* proc_stack = (struct intr_stack*)((uint32_t)thread + PG_SIZE - sizeof(struct intr_stack));
+    proc_stack->edi = proc_stack->esi = proc_stack->ebp = proc_stack->esp_dummy = 0;
+    proc_stack->ebx = proc_stack->edx = proc_stack->ecx = proc_stack->eax = 0;
+    proc_stack->gs = 0;
+    proc_stack->ds = proc_stack->es = proc_stack->fs = SELECTOR_U_DATA;
+    proc_stack->eip = entry;
+    proc_stack->cs = SELECTOR_U_CODE;
+    proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
+    proc_stack->esp = stack_top;
+    proc_stack->ss = SELECTOR_U_DATA;
+
+    list_append(&leader->threads, &thread->thread_tag);
+    thread_ready(thread);
+    thread_register(thread);
+    return thread->pid;
+}
+
+// 回收已结束的线程 thread
+static void thread_reap(struct task_struct* thread) {
+    list_remove(&thread->thread_tag);
+    thread_exit(thread, false);
+}
+
+// 等待本进程中的线程 tid 结束并回收它, 返回值存入 retval
+// 成功返回 0, tid 不是本进程的其它线程、已有别的线程在等它或进程正在退出时返回 -1
+int32_t sys_thread_join(pid_t tid, int32_t* retval) {
+    struct task_struct* cur = running_thread();
+    struct task_struct* leader = cur->group_leader;
+    struct task_struct* thread = pid2thread(tid);
+    if (thread == NULL || thread == cur || thread == leader ||
+        thread->group_leader != leader || thread->joiner != NULL) {
+        return -1;
+    }
+
+    thread->joiner = cur;
+    // 在大内核锁下, 线程在 sys_thread_exit 中释放大内核锁时状态已是 TASK_HANGING
+    while (thread->status != TASK_HANGING) {
+        if (leader->group_exiting) {
+            // 进程要退出了, 剩下的线程由主线程回收
+            thread->joiner = NULL;
+            return -1;
+        }
+        thread_block(TASK_WAITING);
+    }
+    if (retval != NULL) {
+        *retval = thread->thread_retval;
+    }
+    thread_reap(thread);
+    return 0;
+}
+
+// 结束当前线程, 主线程调用时等同于结束整个进程
+void sys_thread_exit(int32_t retval) {
+    struct task_struct* cur = running_thread();
+    struct task_struct* leader = cur->group_leader;
+    if (cur == leader) {
+        sys_exit(retval);
+    }
+    cur->thread_retval = retval;
+
+    // 唤醒等待本线程的线程, 进程退出时主线程也在等待各线程结束
+    if (cur->joiner != NULL && cur->joiner->status == TASK_WAITING) {
+        thread_unblock(cur->joiner);
+    }
+    if (leader->group_exiting && leader->status == TASK_WAITING && leader != cur->joiner) {
+        thread_unblock(leader);
+    }
+
+    // 将自己挂起, 等待 thread_join 或主线程回收 pcb
+    thread_block(TASK_HANGING);
+}
+
+// 所在进程正在退出时结束当前线程, 不返回
+// 由系统调用返回用户态前调用, 也由时钟中断在打断用户态时调用, 调用者须持有大内核锁
+void thread_group_check(void) {
+    struct task_struct* cur = running_thread();
+    struct task_struct* leader = cur->group_leader;
+    if (!leader->group_exiting) {
+        return;
+    }
+    if (cur == leader) {
+        sys_exit(leader->exit_status);
+    } else {
+        sys_thread_exit(-1);
+    }
+    PANIC("thread_group_check: should not be here\n");
+}
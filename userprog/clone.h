@@ -0,0 +1,8 @@
+#ifndef __USERPROG_CLONE_H
+#define __USERPROG_CLONE_H
+#include "thread.h"
+pid_t sys_clone(void* entry, void* stack_top);
+int32_t sys_thread_join(pid_t tid, int32_t* retval);
+void sys_thread_exit(int32_t retval);
+void thread_group_check(void);
+#endif
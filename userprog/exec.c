@@ -5,6 +5,9 @@
 #include "string.h"
 #include "global.h"
 #include "memory.h"
+#include "sync.h"
+#include "fpu.h"
+#include "aio.h"
 
 extern void intr_exit(void);
 typedef uint32_t Elf32_Word, Elf32_Addr, Elf32_Off;
@@ -149,6 +152,13 @@ done:
 
 // 用 path 指向的程序替换当前进程
 int32_t sys_execv(const char* path, const char* argv[]) {
+    // 新程序会替换整个地址空间, 还有其它线程在用时不能执行
+    struct task_struct* self = running_thread();
+    if (self->group_leader != self || !list_empty(&self->threads)) {
+        return -1;
+    }
+    // 在途的异步 io 会写进即将被新程序覆盖的内存, 先等它们完成
+    aio_exit(self);
     uint32_t argc = 0;
     while (argv[argc]) {
         argc++;
@@ -162,6 +172,8 @@ int32_t sys_execv(const char* path, const char* argv[]) {
     // 修改进程名
     memcpy(cur->name, path, TASK_NAME_LEN);
     cur->name[TASK_NAME_LEN-1] = 0;
+    // 新程序从初始的浮点状态开始
+    fpu_reset(cur);
 
     struct intr_stack* intr_0_stack = (struct intr_stack*)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
     // 参数传递给用户进程
@@ -172,6 +184,8 @@ int32_t sys_execv(const char* path, const char* argv[]) {
     intr_0_stack->esp = (void*)0xc0000000;
 
     // exec 不同于 fork, 为使新进程更快被执行, 直接从中断返回
+    // 不再经过 syscall_handler 的返回路径, 在此释放大内核锁
+    kernel_unlock();
     asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (intr_0_stack) : "memory");
     return 0;
 }
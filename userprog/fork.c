@@ -7,18 +7,37 @@
 #include "string.h"
 #include "file.h"
 #include "pipe.h"
+#include "fpu.h"
 
 extern void intr_exit(void);
 
 // 将父进程的 pcb、虚拟地址位图拷贝给子进程
 static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
 // a 复制 pcb 所在的整个页, 里面包含进程 pcb 信息及特权 0 级的栈, 里面包含了返回地址, 然后再单独修改个别部分
+    fpu_sync(parent_thread); // 父进程的浮点状态可能还只在寄存器中, 先存回 pcb 再复制
     memcpy(child_thread, parent_thread, PG_SIZE);
     child_thread->pid = fork_pid();
     child_thread->elapsed_ticks = 0;
     child_thread->status = TASK_READY;
+    child_thread->on_cpu = 0;
+    child_thread->bkl_held = false; // 子进程从 intr_exit 返回, 不经过释放大内核锁的路径
+    child_thread->fpu_cpu = NO_FPU_CPU;
+    child_thread->priority = child_thread->base_priority; // 父进程继承来的优先级不传给子进程
     child_thread->ticks = child_thread->priority; // 为新进程把时间片充满
-    child_thread->parent_pid = parent_thread->pid;
+    child_thread->blocked_on = NULL;
+    list_init(&child_thread->held_locks);
+    list_init(&child_thread->children);
+    list_init(&child_thread->zombies);
+    // 子进程只复制调用 fork 的这一个线程, 进程共有的文件描述符和工作目录取自主线程
+    struct task_struct* leader = parent_thread->group_leader;
+    memcpy(child_thread->fd_table, leader->fd_table, sizeof(leader->fd_table));
+    child_thread->cwd_inode_nr = leader->cwd_inode_nr;
+    child_thread->group_leader = child_thread;
+    list_init(&child_thread->threads);
+    child_thread->joiner = NULL;
+    child_thread->aio = NULL; // 在途的异步 io 属于父进程
+    child_thread->group_exiting = false;
+    child_thread->parent_pid = leader->pid;
     child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
     child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
     block_desc_init(child_thread->u_block_desc);
@@ -170,10 +189,9 @@ pid_t sys_fork(void) {
     }
 
     // 添加到就绪线程队列和所有线程队列, 子进程由调试器安排运行
-    ASSERT(!elem_find(&thread_ready_list, &child_thread->general_tag));
-    list_append(&thread_ready_list, &child_thread->general_tag);
-    ASSERT(!elem_find(&thread_all_list, &child_thread->all_list_tag));
-    list_append(&thread_all_list, &child_thread->all_list_tag);
+    list_append(&parent_thread->group_leader->children, &child_thread->sibling_tag);
+    thread_ready(child_thread);
+    thread_register(child_thread);
 
     return child_thread->pid; // 父进程返回子进程的 pid
 }
@@ -8,6 +8,7 @@
 #include "interrupt.h"
 #include "string.h"
 #include "console.h"
+#include "smp.h"
 
 extern void intr_exit(void);
 
@@ -31,14 +32,18 @@ void start_process(void* filename_) {
 
 // 激活页表
 void page_dir_activate(struct task_struct* p_thread) {
-    // 若为内核线程, 需要重新填充页表为 0x100000
-    uint32_t pagedir_phy_addr = 0x100000;
-    // 默认为内核的页目录物理地址, 也就是内核线程所用的页目录表
-    if(p_thread->pgdir != NULL) { // 用户态进程有自己的页目录表
-        pagedir_phy_addr = addr_v2p((uint32_t)p_thread->pgdir);
+    // 内核线程不访问用户空间, 而各页目录中内核空间的映射都相同,
+    // 所以内核线程直接借用上一个任务的页目录, 不必切换 cr3 而冲掉 TLB
+    if (p_thread->pgdir == NULL) {
+        return;
+    }
+    // 用户态进程有自己的页目录表, 已经装在 cr3 中时也不必重新加载
+    uint32_t pagedir_phy_addr = addr_v2p((uint32_t)p_thread->pgdir);
+    struct cpu* c = this_cpu();
+    if (c->cr3 != pagedir_phy_addr) {
+        asm volatile("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");
+        c->cr3 = pagedir_phy_addr;
     }
-
-    asm volatile("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");
 }
 
 // 激活线程或进程的页表, 更新 tss 中的 esp0 为进程的特权级 0 的栈
@@ -93,10 +98,8 @@ void process_execute(void* filename, char* name) {
     block_desc_init(thread->u_block_desc);
 
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready(thread);
 
-    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
-    list_append(&thread_all_list, &thread->all_list_tag);
+    thread_register(thread);
     intr_set_status(old_status);
 }
\ No newline at end of file
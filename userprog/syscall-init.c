@@ -10,8 +10,14 @@
 #include "exec.h"
 #include "wait_exit.h"
 #include "pipe.h"
+#include "timer.h"
+#include "futex.h"
+#include "sync.h"
+#include "clone.h"
+#include "aio.h"
+#include "blk.h"
 
-#define syscall_nr 32
+#define syscall_nr 64
 typedef void* syscall;
 syscall syscall_table[syscall_nr];
 
@@ -51,5 +57,15 @@ void syscall_init(void) {
     syscall_table[SYS_PIPE] = sys_pipe;
     syscall_table[SYS_FD_REDIRECT] = sys_fd_redirect;
     syscall_table[SYS_HELP] = sys_help;
+    syscall_table[SYS_CLOCK_GETTIME] = sys_clock_gettime;
+    syscall_table[SYS_FUTEX] = sys_futex;
+    syscall_table[SYS_LOCKSTAT] = sys_lockstat;
+    syscall_table[SYS_WAITPID] = sys_waitpid;
+    syscall_table[SYS_CLONE] = sys_clone;
+    syscall_table[SYS_THREAD_JOIN] = sys_thread_join;
+    syscall_table[SYS_THREAD_EXIT] = sys_thread_exit;
+    syscall_table[SYS_AIO_SUBMIT] = sys_aio_submit;
+    syscall_table[SYS_AIO_REAP] = sys_aio_reap;
+    syscall_table[SYS_IOSTAT] = sys_iostat;
     put_str("syscall_init done\n");
 }
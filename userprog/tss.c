@@ -3,6 +3,7 @@
 #include "global.h"
 #include "string.h"
 #include "print.h"
+#include "smp.h"
 
 // 任务状态段 tss 结构
 struct tss {
@@ -34,11 +35,18 @@ struct tss {
     uint32_t trace;
     uint32_t io_base;
 }; 
-static struct tss tss;
+// 每个 cpu 一个 tss, 进入中断时各自从中取 0 级栈
+static struct tss tss[MAX_CPUS];
 
-// 更新 tss 中 esp0 字段的值为 pthread 的 0 级栈
+// cpu_id 号 cpu 的 tss 描述符在 gdt 中的下标
+// BSP 沿用第 4 项, AP 的依次放在第 7 项(用户数据段之后)起
+static uint32_t tss_gdt_idx(uint8_t cpu_id) {
+    return cpu_id == 0 ? 4 : 6 + cpu_id;
+}
+
+// 更新本 cpu 的 tss 中 esp0 字段的值为 pthread 的 0 级栈
 void update_tss_esp(struct task_struct* pthread) {
-    tss.esp0 = (uint32_t*)((uint32_t)pthread + PG_SIZE);
+    tss[this_cpu()->id].esp0 = (uint32_t*)((uint32_t)pthread + PG_SIZE);
 }
 
 // 创建 gdt 描述符
@@ -57,24 +65,32 @@ static struct gdt_desc make_gdt_desc(uint32_t* desc_addr,
     return desc;
 }
 
+// 为本 cpu 重新加载 gdt 并加载自己的 tss, AP 启动时也要调用
+void tss_load(void) {
+    // gdt 16 位的 limit 32 位的段基址
+    uint64_t gdt_operand = ((8 * tss_gdt_idx(MAX_CPUS - 1) + 7) | ((uint64_t)(uint32_t)0xc0000900 << 16));
+    asm volatile ("lgdt %0" : : "m" (gdt_operand));
+    uint16_t selector = (tss_gdt_idx(this_cpu()->id) << 3) + (TI_GDT << 2) + RPL0;
+    asm volatile ("ltr %w0" : : "r" (selector));
+}
+
 // 在 gdt 中创建 tss 并重新加载 gdt
 void tss_init() {
     put_str("tss_init start\n");
-    uint32_t tss_size = sizeof(tss);
-    memset(&tss, 0, tss_size);
-    tss.ss0 = SELECTOR_K_STACK;
-    tss.io_base = tss_size;
-
-    // gdt 段基址为 0x900, 把 tss 放到第 4 个位置, 也就是 0x900+0x20 的位置
-    // 在 gdt 中添加 dpl 为 0 的 TSS 描述符
-    *((struct gdt_desc*)0xc0000920) = make_gdt_desc((uint32_t*)&tss, tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
+    uint32_t tss_size = sizeof(struct tss);
+    uint8_t cpu_id;
+    for (cpu_id = 0; cpu_id < MAX_CPUS; cpu_id++) {
+        memset(&tss[cpu_id], 0, tss_size);
+        tss[cpu_id].ss0 = SELECTOR_K_STACK;
+        tss[cpu_id].io_base = tss_size;
+        // gdt 段基址为 0x900, 在 gdt 中添加 dpl 为 0 的 TSS 描述符
+        *((struct gdt_desc*)0xc0000900 + tss_gdt_idx(cpu_id)) = \
+            make_gdt_desc((uint32_t*)&tss[cpu_id], tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
+    }
     // 在 gdt 中添加 dpl 为 3 的数据段和代码段描述符
     *((struct gdt_desc*)0xc0000928) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
     *((struct gdt_desc*)0xc0000930) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
 
-    // gdt 16 位的 limit 32 位的段基址
-    uint64_t gdt_operand = ((8 * 7 - 1) | ((uint64_t)(uint32_t)0xc0000900 << 16));
-    asm volatile ("lgdt %0" : : "m" (gdt_operand));
-    asm volatile ("ltr %w0" : : "r" (SELECTOR_TSS));
+    tss_load();
     put_str("tss_init and ltr done\n");
 }
\ No newline at end of file
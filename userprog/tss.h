@@ -2,5 +2,6 @@
 #define __USERPROG_TSS_H
 #include "thread.h"
 void update_tss_esp(struct task_struct* pthread);
+void tss_load(void);
 void tss_init(void);
 #endif
\ No newline at end of file
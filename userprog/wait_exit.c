@@ -9,6 +9,8 @@
 #include "fs.h"
 #include "file.h"
 #include "pipe.h"
+#include "clone.h"
+#include "aio.h"
 
 // 释放用户进程资源:
 // 1 页表中对应的物理页
@@ -74,59 +76,105 @@ static void release_prog_resource(struct task_struct* release_thread) {
     }
 }
 
-// list_traversal 的回调函数
-// 查找 pelem 的 parent_pid 是否是 ppid, 成功返回 true, 失败则返回 false
-static bool find_child(struct list_elem* pelem, int32_t ppid) {
-    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
-    return pthread->parent_pid == ppid;
-}
-
-// list_traversal 的回调函数
-// 查找状态为 TASK_HANGING 的任务
-static bool find_hanging_child(struct list_elem* pelem, int32_t ppid) {
-    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
-    return pthread->parent_pid == ppid && pthread->status == TASK_HANGING;
-}
-
-// list_traversal 的回调函数
-// 将一个子进程过继给 init
-static bool init_adopt_a_child(struct list_elem* pelem, int32_t pid) {
-    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
-    if (pthread->parent_pid == pid) {
-        pthread->parent_pid = 1;
+// 回收已退出的子进程 child, 返回其 pid
+static pid_t reap_child(struct task_struct* child, int32_t* status) {
+    list_remove(&child->sibling_tag);
+    if (status != NULL) {
+        *status = child->exit_status;
     }
-    // 让 list_traversal 继续传递下一个元素
-    return false;
+    // thread_exit 之后, pcb 会被回收, 因此提前获取 pid
+    pid_t child_pid = child->pid;
+    // 从就绪队列和全部队列中删除进程表项
+    thread_exit(child, false);
+    return child_pid;
 }
 
 // 等待子进程调用 exit, 将子进程的退出状态保存到 status 指向的变量
-// 成功则返回子进程的 pid, 失败则返回 -1
-pid_t sys_wait(int32_t* status) {
+// pid 为 -1 时等待任一子进程, 否则只等 pid 号子进程
+// options 含 WNOHANG 时若没有已退出的子进程则立即返回 0
+// 成功则返回子进程的 pid, 没有符合条件的子进程则返回 -1
+// 子进程退出时只唤醒父进程的主线程, 所以只有主线程能等待子进程
+pid_t sys_waitpid(pid_t pid, int32_t* status, uint32_t options) {
     struct task_struct* parent_thread = running_thread();
+    if (parent_thread->group_leader != parent_thread) {
+        return -1;
+    }
 
     while (1) {
-        // 优先处理已经是挂起状态的任务
-        struct list_elem* child_elem = list_traversal(&thread_all_list, find_hanging_child, parent_thread->pid);
-        // 若有挂起的子进程
-        if (child_elem != NULL) {
-            struct task_struct* child_thread = elem2entry(struct task_struct, all_list_tag, child_elem);
-            *status = child_thread->exit_status;
+        if (pid == -1) {
+            // 优先处理已经是挂起状态的任务
+            if (!list_empty(&parent_thread->zombies)) {
+                struct task_struct* child_thread = elem2entry(struct task_struct, sibling_tag, parent_thread->zombies.head.next);
+                return reap_child(child_thread, status);
+            }
+            // 判断是否有子进程, 若没有子进程则出错返回
+            if (list_empty(&parent_thread->children)) {
+                return -1;
+            }
+        } else {
+            struct task_struct* child_thread = pid2thread(pid);
+            if (child_thread == NULL || child_thread->group_leader != child_thread ||
+                child_thread->parent_pid != parent_thread->pid) {
+                return -1;
+            }
+            // 在大内核锁下, 子进程进入 zombies 队列后才会释放大内核锁, 此时状态已是 TASK_HANGING
+            if (child_thread->status == TASK_HANGING) {
+                return reap_child(child_thread, status);
+            }
+        }
 
-            // thread_exit 之后, pcb 会被回收, 因此提前获取 pid
-            uint16_t child_pid = child_thread->pid;
+        if (options & WNOHANG) {
+            return 0;
+        }
+        // 别的线程已发起进程退出, 返回后在系统调用出口结束
+        if (parent_thread->group_exiting) {
+            return -1;
+        }
+        // 若子进程还未运行完, 即还未调用 exit, 则将自己挂起, 直到子进程在执行 exit 时将自己唤醒
+        thread_block(TASK_WAITING);
+    }
+}
 
-            // 从就绪队列和全部队列中删除进程表项
-            thread_exit(child_thread, false); 
+// 等待任一子进程退出
+pid_t sys_wait(int32_t* status) {
+    return sys_waitpid(-1, status, 0);
+}
 
-            return child_pid;
-        }
+// 把 src 队列中的进程全部移到 dst 队列, 并把它们的父进程改为 new_ppid
+static uint32_t move_children(struct list* dst, struct list* src, pid_t new_ppid) {
+    uint32_t cnt = 0;
+    while (!list_empty(src)) {
+        struct list_elem* pelem = list_pop(src);
+        struct task_struct* pthread = elem2entry(struct task_struct, sibling_tag, pelem);
+        pthread->parent_pid = new_ppid;
+        list_append(dst, pelem);
+        cnt++;
+    }
+    return cnt;
+}
 
-        // 判断是否有子进程
-        child_elem = list_traversal(&thread_all_list, find_child, parent_thread->pid);
-        if (child_elem == NULL) { // 若没有子进程则出错返回
-            return -1;
-        } else {
-            // 若子进程还未运行完, 即还未调用 exit, 则将自己挂起, 直到子进程在执行 exit 时将自己唤醒
+// 进程退出前等其余线程都结束, 并回收它们的 pcb
+// 阻塞在 thread_join 或可中断睡眠(futex、键盘读、aio_reap)中的线程先唤醒, 使其看到进程正在退出
+// 其余阻塞(磁盘 io、定时睡眠)都会在有限时间内结束, 届时线程在系统调用出口结束自己
+static void thread_group_reap(struct task_struct* leader) {
+    while (!list_empty(&leader->threads)) {
+        bool reaped = false;
+        struct list_elem* pelem = leader->threads.head.next;
+        while (pelem != &leader->threads.tail) {
+            struct task_struct* thread = elem2entry(struct task_struct, thread_tag, pelem);
+            pelem = pelem->next;
+            if (thread->status == TASK_HANGING) {
+                list_remove(&thread->thread_tag);
+                thread_exit(thread, false);
+                reaped = true;
+            } else if (thread->status == TASK_WAITING) {
+                thread_unblock(thread);
+            } else if (thread->status == TASK_BLOCKED) {
+                thread_interrupt(thread);
+            }
+        }
+        if (!reaped && !list_empty(&leader->threads)) {
+            // 等剩下的线程在 sys_thread_exit 中唤醒自己
             thread_block(TASK_WAITING);
         }
     }
@@ -135,19 +183,43 @@ pid_t sys_wait(int32_t* status) {
 // 子进程用来结束自己时调用
 void sys_exit(int32_t status) {
     struct task_struct* child_thread = running_thread();
-    child_thread->exit_status = status;
+    struct task_struct* leader = child_thread->group_leader;
+    // 进程退出以主线程为准, 其余线程发起时先记下退出状态, 自己结束后由主线程完成退出
+    if (!leader->group_exiting) {
+        leader->group_exiting = true;
+        leader->exit_status = status;
+    }
+    if (child_thread != leader) {
+        if (leader->status == TASK_WAITING) {
+            thread_unblock(leader);
+        } else if (leader->status == TASK_BLOCKED) {
+            thread_interrupt(leader);
+        }
+        sys_thread_exit(-1);
+    }
+    thread_group_reap(child_thread);
+
     if (child_thread->parent_pid == -1) {
         PANIC("sys_exit: child_thread->parent_pid is -1\n");
     }
 
-    // 将进程 child_thread 的所有子进程都过继给 init
-    list_traversal(&thread_all_list, init_adopt_a_child, child_thread->pid);
+    // 将进程 child_thread 的所有子进程都过继给 init, 已退出的子进程交给 init 回收
+    struct task_struct* init_proc = pid2thread(1);
+    ASSERT(init_proc != NULL && init_proc != child_thread);
+    move_children(&init_proc->children, &child_thread->children, 1);
+    if (move_children(&init_proc->zombies, &child_thread->zombies, 1) > 0 &&
+        init_proc->status == TASK_WAITING) {
+        thread_unblock(init_proc);
+    }
 
-    // 回收进程 child_thread 的资源
+    // 回收进程 child_thread 的资源, 先等在途的异步 io 完成, 它们还在往用户页里写
+    aio_exit(child_thread);
     release_prog_resource(child_thread);
 
-    // 如果父进程正在等待子进程退出, 将父进程唤醒
+    // 转入父进程的 zombies 队列, 如果父进程正在等待子进程退出, 将父进程唤醒
     struct task_struct* parent_thread = pid2thread(child_thread->parent_pid);
+    list_remove(&child_thread->sibling_tag);
+    list_append(&parent_thread->zombies, &child_thread->sibling_tag);
     if (parent_thread->status == TASK_WAITING) {
         thread_unblock(parent_thread);
     }
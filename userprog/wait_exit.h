@@ -1,6 +1,9 @@
 #ifndef __USERPROG_WAITEXIT_H
 #define __USERPROG_WAITEXIT_H
 #include "thread.h"
+#include "wait.h"
+
+pid_t sys_waitpid(pid_t pid, int32_t* status, uint32_t options);
 pid_t sys_wait(int32_t* status);
 void sys_exit(int32_t status);
 #endif